@@ -0,0 +1,181 @@
+/*-----------------------------------------------------------------------------
+ * file:  bench_churn.c
+ *
+ * Description:
+ *
+ * Route churn benchmark.  Builds a random routing table and flaps random
+ * routes with sr_rt_del/sr_rt_add while a reader thread keeps looking up
+ * random destinations, then reports update rate and latency, and the
+ * lookup rate with and without the churn.
+ *
+ * usage: bench_churn [prefixes] [flaps]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_rcu.h"
+
+#define BENCH_READ_SECS 0.5    /* lookup baseline without churn */
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t bench_rand(void)
+{
+	return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+/* Random table, mostly /16 to /24 with some longer prefixes */
+static struct sr_rt *bench_table(int n)
+{
+	struct sr_rt *head = NULL, *rt;
+	int i, len;
+
+	for (i = 0; i < n; i++)
+	{
+		rt = calloc(1, sizeof(struct sr_rt));
+		len = 8 + bench_rand() % 25;
+		if (len < 16 || (len > 24 && bench_rand() % 4))
+			len = 16 + bench_rand() % 9;
+		rt->mask.s_addr = htonl(~0u << (32 - len));
+		rt->dest.s_addr = htonl(bench_rand()) & rt->mask.s_addr;
+		rt->gw.s_addr = htonl(bench_rand());
+		sprintf(rt->interface, "eth%d", i % 4);
+		rt->next = head;
+		head = rt;
+	}
+
+	return head;
+}
+
+static struct sr_instance bench_sr;
+static volatile int bench_stop;
+
+/* Looks up random destinations until told to stop, the way the packet
+   thread does: online, with a quiescent state every so often. */
+static void *bench_reader(void *arg)
+{
+	unsigned long *count = arg;
+	volatile unsigned long sink = 0;
+	uint32_t x = 12345;
+	unsigned long n = 0;
+	int i;
+
+	sr_rcu_register_thread();
+	while (!bench_stop)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			x = x * 1664525 + 1013904223;
+			sink += (unsigned long)sr_fib_lookup(sr_rcu_dereference(bench_sr.fib), x);
+		}
+		n += 256;
+		sr_rcu_quiescent_state();
+	}
+	sr_rcu_unregister_thread();
+
+	*count = n;
+	return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+	int nroutes = argc > 1 ? atoi(argv[1]) : 100000;
+	int nflaps = argc > 2 ? atoi(argv[2]) : 100000;
+	struct sr_rt *rtable, *rt, **pick;
+	struct sr_fib *fib;
+	pthread_t reader;
+	unsigned long base_lookups, churn_lookups;
+	double t0, t1, t_base, t_churn, *lat;
+	int i, len;
+
+	srand(1);
+	memset(&bench_sr, 0, sizeof(bench_sr));
+	pthread_mutex_init(&bench_sr.rt_lock, NULL);
+
+	rtable = bench_table(nroutes);
+	pick = malloc(nroutes * sizeof(struct sr_rt *));
+	lat = malloc(2 * nflaps * sizeof(double));
+	for (rt = rtable, i = 0; rt != NULL; rt = rt->next, i++)
+		pick[i] = rt;
+
+	t0 = bench_now();
+	if ((fib = sr_fib_build(rtable)) == NULL)
+	{
+		fprintf(stderr, "sr_fib_build failed\n");
+		return 1;
+	}
+	sr_rt_publish(&bench_sr, rtable, fib);
+	printf("routes %d, build %.3f s\n", nroutes, bench_now() - t0);
+
+	/* -- lookups alone -- */
+	bench_stop = 0;
+	pthread_create(&reader, NULL, bench_reader, &base_lookups);
+	t0 = bench_now();
+	while (bench_now() - t0 < BENCH_READ_SECS)
+		sched_yield();
+	bench_stop = 1;
+	pthread_join(reader, NULL);
+	t_base = bench_now() - t0;
+
+	/* -- lookups while routes flap -- */
+	bench_stop = 0;
+	pthread_create(&reader, NULL, bench_reader, &churn_lookups);
+	t0 = bench_now();
+	for (i = 0; i < nflaps; i++)
+	{
+		rt = pick[bench_rand() % nroutes];
+		len = __builtin_popcount(rt->mask.s_addr);
+
+		t1 = bench_now();
+		if (sr_rt_del(&bench_sr, rt->dest, len) != 0)
+		{
+			perror("sr_rt_del");
+			return 1;
+		}
+		lat[2 * i] = bench_now() - t1;
+
+		t1 = bench_now();
+		if (sr_rt_add(&bench_sr, rt->dest, len, rt->gw, rt->interface) != 0)
+		{
+			perror("sr_rt_add");
+			return 1;
+		}
+		lat[2 * i + 1] = bench_now() - t1;
+	}
+	t_churn = bench_now() - t0;
+	bench_stop = 1;
+	pthread_join(reader, NULL);
+
+	qsort(lat, 2 * nflaps, sizeof(double), bench_cmp);
+	printf("%-24s %10.0f updates/s\n", "add+del", 2 * nflaps / t_churn);
+	printf("%-24s %10.2f us p50, %.2f us p99\n", "update latency",
+		   lat[nflaps] * 1e6, lat[(int)(2 * nflaps * 0.99)] * 1e6);
+	printf("%-24s %10.1f Mlookups/s\n", "lookups, no churn", base_lookups / t_base / 1e6);
+	printf("%-24s %10.1f Mlookups/s\n", "lookups, churn", churn_lookups / t_churn / 1e6);
+
+	return 0;
+}
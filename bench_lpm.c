@@ -0,0 +1,427 @@
+/*-----------------------------------------------------------------------------
+ * file:  bench_lpm.c
+ *
+ * Description:
+ *
+ * Route lookup benchmark.  Builds synthetic routing tables whose prefix
+ * lengths follow those of a full BGP table, then runs a uniform and a
+ * Zipf destination stream through the list walk the router used to do,
+ * the lookup behind sr_findLPMentry, the same lookup behind the
+ * destination cache, and burst lookups, and checks that they agree.
+ *
+ * For each table it reports build time and memory, and for each engine
+ * and stream lookups per second and the p50 and p99 ns per lookup.  The
+ * percentiles are over batches of BENCH_BATCH lookups, since a single
+ * lookup is shorter than the clock can time.
+ *
+ * usage: bench_lpm [prefixes] [lookups]
+ *
+ * Without arguments tables of 1k, 10k, 100k and 1M prefixes are run.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_dcache.h"
+
+#define BENCH_LINEAR_MAX 2000      /* the list walk is too slow for more, */
+#define BENCH_LINEAR_VISITS 1e8    /* and for more route visits than this */
+#define BENCH_LOOKUPS    4000000   /* per stream */
+#define BENCH_BATCH      16        /* lookups per latency sample */
+#define BENCH_HOSTS      (1 << 20) /* destinations the Zipf stream draws from */
+#define BENCH_ZIPF_S     1.0
+
+/* Prefix lengths /8 to /32 per 100000 routes, roughly those of a full
+   IPv4 BGP table: over half /24, then /22 and /23, few shorter than /16.
+   Longer than /24 is not announced in BGP but is kept for the tbl8s. */
+static const int bench_len_dist[25] = {
+	2, 2, 5, 10, 30, 50, 100, 100,              /* /8  - /15 */
+	1400, 900, 1500, 2700, 4500, 5000, 12000,   /* /16 - /22 */
+	10000, 61000,                               /* /23 - /24 */
+	100, 100, 80, 80, 100, 120, 21, 100         /* /25 - /32 */
+};
+
+enum { ENG_LINEAR, ENG_LPM, ENG_DCACHE, ENG_SCALAR, ENG_BURST, ENG_COUNT };
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t bench_rand(void)
+{
+	return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+static int bench_len(void)
+{
+	int r = bench_rand() % 100000, len;
+
+	for (len = 8; len < 32 && r >= bench_len_dist[len - 8]; len++)
+		r -= bench_len_dist[len - 8];
+	return len;
+}
+
+/* Random table of n distinct prefixes with BGP-like lengths, no default.
+   Also returns the prefixes in array order, for drawing destinations. */
+static struct sr_rt *bench_table(int n, struct sr_rt ***arr)
+{
+	struct sr_rt *head = NULL, *rt;
+	uint64_t *seen, key;
+	uint32_t nseen = 1, h;
+	int i, len;
+
+	while (nseen < 2 * (uint32_t)n)
+		nseen <<= 1;
+	seen = calloc(nseen, sizeof(uint64_t));
+	*arr = malloc(n * sizeof(struct sr_rt *));
+
+	for (i = 0; i < n; )
+	{
+		len = bench_len();
+		rt = calloc(1, sizeof(struct sr_rt));
+		rt->mask.s_addr = htonl(~0u << (32 - len));
+		rt->dest.s_addr = htonl(bench_rand()) & rt->mask.s_addr;
+
+		/* same prefix twice would be a multipath route */
+		key = ((uint64_t)rt->dest.s_addr << 8 | len) + 1;
+		for (h = (uint32_t)(key * 0x9e3779b97f4a7c15ull >> 32); seen[h & (nseen - 1)] != 0; h++)
+			if (seen[h & (nseen - 1)] == key)
+				break;
+		if (seen[h & (nseen - 1)] == key)
+		{
+			free(rt);
+			continue;
+		}
+		seen[h & (nseen - 1)] = key;
+
+		rt->gw.s_addr = htonl(bench_rand());
+		rt->weight = 1;
+		sprintf(rt->interface, "eth%d", i % 4);
+		rt->next = head;
+		head = rt;
+		(*arr)[i++] = rt;
+	}
+
+	free(seen);
+	return head;
+}
+
+static uint32_t bench_in_prefix(struct sr_rt *rt)
+{
+	return rt->dest.s_addr | (htonl(bench_rand()) & ~rt->mask.s_addr);
+}
+
+/* Uniform destinations over the whole address space */
+static void bench_uniform(uint32_t *dsts, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dsts[i] = htonl(bench_rand());
+}
+
+/* Zipf destinations: BENCH_HOSTS hosts inside random prefixes of the
+   table, the k-th most popular drawn with weight 1/k^s. */
+static void bench_zipf(uint32_t *dsts, int n, struct sr_rt **arr, int nroutes)
+{
+	uint32_t *hosts = malloc(BENCH_HOSTS * sizeof(uint32_t));
+	double *cdf = malloc(BENCH_HOSTS * sizeof(double)), sum = 0, r;
+	int i, lo, hi, mid;
+
+	for (i = 0; i < BENCH_HOSTS; i++)
+	{
+		hosts[i] = bench_in_prefix(arr[bench_rand() % nroutes]);
+		sum += 1.0 / pow(i + 1, BENCH_ZIPF_S);
+		cdf[i] = sum;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		r = (double)bench_rand() / 4294967296.0 * sum;
+		for (lo = 0, hi = BENCH_HOSTS - 1; lo < hi; )
+		{
+			mid = (lo + hi) / 2;
+			if (cdf[mid] < r)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		dsts[i] = hosts[lo];
+	}
+
+	free(hosts);
+	free(cdf);
+}
+
+struct bench_ctx
+{
+	struct sr_rt *rtable;
+	struct sr_fib *fib;
+	struct sr_dcache dcache;
+	uint32_t gen;
+};
+
+static const char *bench_engine_name(int eng)
+{
+	static char label[32];
+
+	switch (eng)
+	{
+	case ENG_LINEAR:
+		return "list walk";
+	case ENG_LPM:
+		return "sr_findLPMentry";
+	case ENG_DCACHE:
+		return "dcache + lookup";
+	case ENG_SCALAR:
+		return "burst (scalar)";
+	default:
+		sprintf(label, "burst (%s)", sr_fib_burst_impl());
+		return label;
+	}
+}
+
+/* Looks up n destinations with engine eng into out[] */
+static void bench_lookup(struct bench_ctx *c, int eng, const uint32_t *dsts,
+						 int n, struct sr_rt **out)
+{
+	struct sr_dcache_entry *e;
+	nexthop_t nh[SR_FIB_BURST_MAX];
+	int i, j, k, multipath;
+
+	switch (eng)
+	{
+	case ENG_LINEAR:
+		for (i = 0; i < n; i++)
+			out[i] = sr_rt_lookup_linear(c->rtable, dsts[i]);
+		break;
+
+	case ENG_LPM:
+		/* what sr_findLPMentry does once it has the FIB */
+		for (i = 0; i < n; i++)
+			out[i] = sr_fib_lookup_flow(c->fib, dsts[i], dsts[i], NULL);
+		break;
+
+	case ENG_DCACHE:
+		/* the forwarding path: destination cache, then the lookup */
+		for (i = 0; i < n; i++)
+		{
+			e = sr_dcache_lookup(&c->dcache, dsts[i], c->gen);
+			if (e != NULL)
+			{
+				out[i] = e->rt;
+				continue;
+			}
+			out[i] = sr_fib_lookup_flow(c->fib, dsts[i], dsts[i], &multipath);
+			if (out[i] != NULL && !multipath)
+				sr_dcache_insert(&c->dcache, dsts[i], c->gen, out[i], NULL);
+		}
+		break;
+
+	default:
+		for (i = 0; i < n; i += SR_FIB_BURST_MAX)
+		{
+			k = n - i < SR_FIB_BURST_MAX ? n - i : SR_FIB_BURST_MAX;
+			if (eng == ENG_SCALAR)
+				sr_fib_lookup_burst_scalar(c->fib, dsts + i, k, nh);
+			else
+				sr_fib_lookup_burst(c->fib, dsts + i, k, nh);
+			for (j = 0; j < k; j++)
+				out[i + j] = sr_fib_route(c->fib, nh[j]);
+		}
+		break;
+	}
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Smallest time the clock reports for nothing, taken off each sample */
+static double bench_clock_overhead(void)
+{
+	double t0, t, min = 1;
+	int i;
+
+	for (i = 0; i < 1000; i++)
+	{
+		t0 = bench_now();
+		t = bench_now() - t0;
+		if (t < min)
+			min = t;
+	}
+	return min;
+}
+
+static int bench_same(struct sr_rt *a, struct sr_rt *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return a->dest.s_addr == b->dest.s_addr && a->mask.s_addr == b->mask.s_addr;
+}
+
+/* Runs every engine over one stream; ref[] gets the sr_findLPMentry
+   results the others are checked against. */
+static int bench_stream(struct bench_ctx *c, const char *name, const uint32_t *dsts,
+						int n, int nlinear, struct sr_rt **ref, struct sr_rt **out,
+						double *samples, double overhead)
+{
+	double t0, t, sum;
+	int eng, cnt, i, nsamples, hits = 0;
+
+	bench_lookup(c, ENG_LPM, dsts, n, ref);
+	for (i = 0; i < n; i++)
+		hits += ref[i] != NULL;
+	printf("  %s destinations, %.1f%% routed\n", name, 100.0 * hits / n);
+
+	for (eng = 0; eng < ENG_COUNT; eng++)
+	{
+		cnt = eng == ENG_LINEAR ? nlinear : n;
+		if (cnt == 0)
+			continue;
+
+		if (eng == ENG_DCACHE)
+		{
+			sr_dcache_destroy(&c->dcache);
+			sr_dcache_init(&c->dcache);
+		}
+
+		t0 = bench_now();
+		bench_lookup(c, eng, dsts, cnt, out);
+		t = bench_now() - t0;
+
+		for (i = 0; i < cnt; i++)
+		{
+			if (!bench_same(out[i], ref[i]))
+			{
+				fprintf(stderr, "%s: lookup mismatch for %08x\n",
+						bench_engine_name(eng), ntohl(dsts[i]));
+				return -1;
+			}
+		}
+
+		/* -- latency, in batches -- */
+		nsamples = 0;
+		for (i = 0; i + BENCH_BATCH <= cnt; i += BENCH_BATCH)
+		{
+			t0 = bench_now();
+			bench_lookup(c, eng, dsts + i, BENCH_BATCH, out);
+			sum = bench_now() - t0 - overhead;
+			samples[nsamples++] = (sum > 0 ? sum : 0) / BENCH_BATCH;
+		}
+		qsort(samples, nsamples, sizeof(double), bench_cmp_double);
+
+		printf("    %-22s %10.2f Mlookups/s  p50 %8.1f ns  p99 %8.1f ns\n",
+			   bench_engine_name(eng), cnt / t / 1e6,
+			   nsamples ? samples[nsamples / 2] * 1e9 : 0,
+			   nsamples ? samples[nsamples - 1 - nsamples / 100] * 1e9 : 0);
+	}
+
+	return 0;
+}
+
+static int bench_size(int nroutes, int nlookups, double overhead)
+{
+	struct bench_ctx c;
+	struct sr_rt **arr, **ref, **out, *rt;
+	uint32_t *dsts;
+	double *samples, t0, t_build;
+	int nlinear, ret = 0;
+
+	nlinear = BENCH_LINEAR_VISITS / nroutes;
+	if (nlinear > BENCH_LINEAR_MAX)
+		nlinear = BENCH_LINEAR_MAX;
+	if (nlinear > nlookups)
+		nlinear = nlookups;
+
+	srand(1);
+	c.rtable = bench_table(nroutes, &arr);
+	dsts = malloc(nlookups * sizeof(uint32_t));
+	ref = malloc(nlookups * sizeof(struct sr_rt *));
+	out = malloc(nlookups * sizeof(struct sr_rt *));
+	samples = malloc((nlookups / BENCH_BATCH + 1) * sizeof(double));
+
+	t0 = bench_now();
+	c.fib = sr_fib_build(c.rtable);
+	t_build = bench_now() - t0;
+	if (c.fib == NULL || dsts == NULL || ref == NULL || out == NULL || samples == NULL ||
+		sr_dcache_init(&c.dcache) != 0)
+	{
+		fprintf(stderr, "out of memory\n");
+		ret = -1;
+		goto done;
+	}
+	c.gen = c.fib->version + 1;
+
+	printf("routes %d, tbl8 groups %u, build %.3f s, FIB %.1f MB, list %.1f MB\n",
+		   nroutes, c.fib->tbl8_used, t_build, sr_fib_memory(c.fib) / 1048576.0,
+		   nroutes * sizeof(struct sr_rt) / 1048576.0);
+
+	bench_uniform(dsts, nlookups);
+	if (bench_stream(&c, "uniform", dsts, nlookups, nlinear, ref, out, samples, overhead) != 0)
+		ret = -1;
+
+	bench_zipf(dsts, nlookups, arr, nroutes);
+	if (ret == 0 &&
+		bench_stream(&c, "zipf", dsts, nlookups, nlinear, ref, out, samples, overhead) != 0)
+		ret = -1;
+
+	sr_dcache_destroy(&c.dcache);
+done:
+	sr_fib_free(c.fib);
+	while (c.rtable != NULL)
+	{
+		rt = c.rtable;
+		c.rtable = rt->next;
+		free(rt);
+	}
+	free(arr);
+	free(dsts);
+	free(ref);
+	free(out);
+	free(samples);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 1000, 10000, 100000, 1000000 };
+	int nroutes = argc > 1 ? atoi(argv[1]) : 0;
+	int nlookups = argc > 2 ? atoi(argv[2]) : BENCH_LOOKUPS;
+	double overhead = bench_clock_overhead();
+	unsigned int i;
+
+	if ((argc > 1 && nroutes <= 0) || nlookups <= 0)
+	{
+		fprintf(stderr, "usage: bench_lpm [prefixes] [lookups]\n");
+		return 1;
+	}
+
+	if (argc > 1)
+		return bench_size(nroutes, nlookups, overhead) != 0;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		if (bench_size(sizes[i], nlookups, overhead) != 0)
+			return 1;
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_adj.c
+ *
+ * Description:
+ *
+ * Adjacency table, see sr_adj.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_adj.h"
+#include "sr_arpcache.h"
+#include "sr_router.h"
+#include "sr_dcache.h"
+
+#define SR_ADJ_INDEX_SZ (2 * SR_ADJ_MAX)
+
+static uint32_t sr_adj_hash(uint32_t gw)
+{
+	return (uint32_t)(gw * 2654435761u) >> 16;
+}
+
+int sr_adj_init(struct sr_adj_table *tab)
+{
+	tab->adj = calloc(SR_ADJ_MAX, sizeof(struct sr_adj));
+	tab->index = calloc(SR_ADJ_INDEX_SZ, sizeof(uint32_t));
+	tab->n = 0;
+	tab->nfree = 0;
+	tab->reclaimed = 0;
+
+	if (tab->adj == NULL || tab->index == NULL)
+	{
+		sr_adj_destroy(tab);
+		return -1;
+	}
+
+	return 0;
+}
+
+void sr_adj_destroy(struct sr_adj_table *tab)
+{
+	free(tab->adj);
+	free(tab->index);
+	tab->adj = NULL;
+	tab->index = NULL;
+	tab->n = 0;
+}
+
+struct sr_adj *sr_adj_find(struct sr_adj_table *tab, uint32_t gw, const char *iface)
+{
+	struct sr_adj *adj;
+	uint32_t h, v;
+
+	for (h = sr_adj_hash(gw); (v = tab->index[h & (SR_ADJ_INDEX_SZ - 1)]) != 0; h++)
+	{
+		adj = &tab->adj[v - 1];
+		if (adj->gw == gw && strncmp(adj->ifc->name, iface, sr_IFACE_NAMELEN) == 0)
+			return adj;
+	}
+
+	return NULL;
+}
+
+/* Links slot i into the index under the hash of its gw */
+static void sr_adj_link(struct sr_adj_table *tab, uint32_t i)
+{
+	uint32_t h;
+
+	for (h = sr_adj_hash(tab->adj[i].gw); tab->index[h & (SR_ADJ_INDEX_SZ - 1)] != 0; h++)
+		;
+	__atomic_store_n(&tab->index[h & (SR_ADJ_INDEX_SZ - 1)], i + 1, __ATOMIC_RELEASE);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_adj_reclaim(struct sr_instance *sr)
+ * Scope:  Local
+ *
+ * Frees the adjacencies the sweep has expired, which no packet went
+ * through for a whole ARP lifetime, and builds the index again from the
+ * rest.  The destination cache is emptied since its entries may point
+ * at a freed slot.  While the index is rebuilt the ARP thread may miss
+ * an adjacency in sr_adj_used, which costs at most a refresh probe.
+ * Returns the number freed.
+ *
+ *---------------------------------------------------------------------*/
+static uint32_t sr_adj_reclaim(struct sr_instance *sr)
+{
+	struct sr_adj_table *tab = &(sr->adj);
+	time_t now = time(NULL);
+	uint32_t i, freed = 0;
+
+	if (now == tab->reclaimed)
+		return 0;
+	tab->reclaimed = now;
+
+	for (i = 0; i < tab->n; i++)
+	{
+		if (tab->adj[i].gw != 0 && !sr_adj_resolved(&tab->adj[i]))
+		{
+			__atomic_store_n(&tab->adj[i].gw, 0, __ATOMIC_RELAXED);
+			freed++;
+		}
+	}
+	if (freed == 0)
+		return 0;
+
+	for (i = 0; i < SR_ADJ_INDEX_SZ; i++)
+		__atomic_store_n(&tab->index[i], 0, __ATOMIC_RELAXED);
+	for (i = 0; i < tab->n; i++)
+		if (tab->adj[i].gw != 0)
+			sr_adj_link(tab, i);
+
+	sr_dcache_flush(&(sr->dcache));
+	tab->nfree += freed;
+	return freed;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_adj_get(struct sr_instance *sr, uint32_t gw, const char *iface)
+ * Scope:  Global
+ *
+ * A new adjacency takes the next slot never used, or once all have
+ * been, a slot freed by sr_adj_reclaim.  It is filled in before the
+ * count and the index slot that make it visible to the ARP thread.
+ *
+ *---------------------------------------------------------------------*/
+struct sr_adj *sr_adj_get(struct sr_instance *sr, uint32_t gw, const char *iface)
+{
+	struct sr_adj_table *tab = &(sr->adj);
+	struct sr_adj *adj;
+	struct sr_if *ifc;
+	uint32_t i;
+
+	if ((adj = sr_adj_find(tab, gw, iface)) != NULL)
+		return adj;
+
+	if (gw == 0 || (ifc = sr_get_interface(sr, iface)) == NULL)
+		return NULL;
+
+	if (tab->n < SR_ADJ_MAX)
+		i = tab->n;
+	else if (tab->nfree == 0 && sr_adj_reclaim(sr) == 0)
+		return NULL;
+	else
+	{
+		for (i = 0; tab->adj[i].gw != 0; i++)
+			;
+		tab->nfree--;
+	}
+
+	adj = &tab->adj[i];
+	adj->ifc = ifc;
+	adj->resolved = 0;
+	memset(adj->hdr.ether_dhost, 0, ETHER_ADDR_LEN);
+	memcpy(adj->hdr.ether_shost, ifc->addr, ETHER_ADDR_LEN);
+	adj->hdr.ether_type = htons(ethertype_ip);
+	adj->used = 0;
+	__atomic_store_n(&adj->gw, gw, __ATOMIC_RELAXED);
+
+	if (i == tab->n)
+		__atomic_store_n(&tab->n, i + 1, __ATOMIC_RELEASE);
+	sr_adj_link(tab, i);
+	return adj;
+}
+
+void sr_adj_set_mac(struct sr_adj *adj, const unsigned char *mac)
+{
+	memcpy(adj->hdr.ether_dhost, mac, ETHER_ADDR_LEN);
+	adj->added = time(NULL);
+	__atomic_store_n(&adj->resolved, 1, __ATOMIC_RELEASE);
+}
+
+void sr_adj_resolve(struct sr_adj_table *tab, uint32_t ip, const unsigned char *mac)
+{
+	uint32_t h, v;
+
+	for (h = sr_adj_hash(ip); (v = tab->index[h & (SR_ADJ_INDEX_SZ - 1)]) != 0; h++)
+		if (tab->adj[v - 1].gw == ip)
+			sr_adj_set_mac(&tab->adj[v - 1], mac);
+}
+
+int sr_adj_used(struct sr_adj_table *tab, uint32_t ip)
+{
+	uint32_t h, v;
+	int used = 0;
+
+	for (h = sr_adj_hash(ip); (v = __atomic_load_n(&tab->index[h & (SR_ADJ_INDEX_SZ - 1)], __ATOMIC_ACQUIRE)) != 0; h++)
+		if (tab->adj[v - 1].gw == ip && __atomic_exchange_n(&tab->adj[v - 1].used, 0, __ATOMIC_RELAXED))
+			used = 1;
+
+	return used;
+}
+
+void sr_adj_sweep(struct sr_adj_table *tab, time_t now)
+{
+	uint32_t i, n = __atomic_load_n(&tab->n, __ATOMIC_ACQUIRE);
+	struct sr_adj *adj;
+
+	for (i = 0; i < n; i++)
+	{
+		adj = &tab->adj[i];
+		if (sr_adj_resolved(adj) && difftime(now, adj->added) > SR_ARPCACHE_TO)
+			__atomic_store_n(&adj->resolved, 0, __ATOMIC_RELEASE);
+	}
+}
@@ -0,0 +1,87 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_adj.h
+ *
+ * Description:
+ *
+ * Adjacency table.  An adjacency is a next hop the router sends to: the
+ * gateway of a route, or the destination itself for a directly connected
+ * one, together with the egress interface and the Ethernet header that
+ * frames sent to it get.  Every destination behind a gateway shares its
+ * adjacency, so a gateway is ARPed for once and forwarding to it is a
+ * copy of the prebuilt header.
+ *
+ * Adjacencies are made and resolved by the packet thread only, and made
+ * only for a next hop that has answered ARP, so hosts that never answer
+ * take no room.  The ARP thread expires them through sr_adj_sweep, which
+ * only ever clears the resolved flag, so a reader needs no lock: it
+ * checks the flag, then copies the header.  When the table is full the
+ * packet thread reclaims the adjacencies the sweep has expired, at most
+ * once a second, and empties the destination cache, whose entries point
+ * at them.  A slot with gw 0 is free.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ADJ_H
+#define SR_ADJ_H
+
+#include <time.h>
+
+#include "sr_if.h"
+#include "sr_protocol.h"
+
+#define SR_ADJ_MAX 1024         /* power of two; next hops, not hosts */
+
+struct sr_instance;
+
+struct sr_adj {
+    uint32_t gw;                /* next hop IP in network byte order */
+    struct sr_if *ifc;          /* egress interface */
+    int resolved;               /* hdr holds the next hop's MAC */
+    time_t added;               /* when it was resolved */
+    int used;                   /* sent through since sr_adj_used asked */
+    struct sr_ethernet_hdr hdr; /* header of frames to the next hop */
+};
+
+struct sr_adj_table {
+    struct sr_adj *adj;         /* SR_ADJ_MAX entries, never moved */
+    uint32_t *index;            /* hash of gw to adjacency + 1 */
+    uint32_t n;                 /* slots ever used */
+    uint32_t nfree;             /* of those, freed by a reclaim */
+    time_t reclaimed;           /* last attempt, see sr_adj_get */
+};
+
+#define sr_adj_resolved(a) __atomic_load_n(&(a)->resolved, __ATOMIC_ACQUIRE)
+
+/* Marks a packet sent through a.  Stores only when the flag was clear,
+   so a busy adjacency does not keep dirtying its cache line. */
+#define sr_adj_touch(a) \
+    do { \
+        if (!__atomic_load_n(&(a)->used, __ATOMIC_RELAXED)) \
+            __atomic_store_n(&(a)->used, 1, __ATOMIC_RELAXED); \
+    } while (0)
+
+int  sr_adj_init(struct sr_adj_table *tab);
+void sr_adj_destroy(struct sr_adj_table *tab);
+
+/* Adjacency of next hop gw out of the named interface, or NULL */
+struct sr_adj *sr_adj_find(struct sr_adj_table *tab, uint32_t gw, const char *iface);
+
+/* Adjacency of next hop gw out of the named interface, made unresolved
+   on first use; call once gw has resolved.  Returns NULL when the table
+   is full or the interface is unknown. */
+struct sr_adj *sr_adj_get(struct sr_instance *sr, uint32_t gw, const char *iface);
+
+/* Records the MAC of a next hop: for one adjacency, or for every
+   adjacency of ip after an ARP reply. */
+void sr_adj_set_mac(struct sr_adj *adj, const unsigned char *mac);
+void sr_adj_resolve(struct sr_adj_table *tab, uint32_t ip, const unsigned char *mac);
+
+/* Returns whether a packet was sent through an adjacency of ip since
+   the last call, and clears the flags.  Safe from any thread. */
+int  sr_adj_used(struct sr_adj_table *tab, uint32_t ip);
+
+/* Unresolves adjacencies resolved more than SR_ARPCACHE_TO seconds
+   before now.  Called from the ARP thread. */
+void sr_adj_sweep(struct sr_adj_table *tab, time_t now);
+
+#endif
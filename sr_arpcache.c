@@ -1,4 +1,7 @@
 #include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -11,177 +14,815 @@
 #include "sr_if.h"
 #include "sr_protocol.h"
 #include "sr_rt.h"
+#include "sr_rcu.h"
+#include "sr_adj.h"
+
+/* Work on the request queue decided under the lock and done after it is
+   dropped, so nothing is sent while forwarding may be waiting on the
+   lock. */
+struct sr_arpwork {
+    struct sr_arpreq *dead;         /* given up and unlinked, or NULL */
+    uint32_t ip;                    /* else send an ARP request for ip */
+    int ifindex;                    /* out of ifindex, -1 to route to ip */
+    int unicast;                    /* to mac rather than broadcast */
+    unsigned char mac[ETHER_ADDR_LEN];
+    struct sr_arpwork *next;
+};
+
+/* Refresh and expiry of the entry of ip inserted at added.  Entries
+   move between slots, so the timer names its entry rather than being
+   part of it; it does nothing if the entry went or was refreshed
+   meanwhile.  Nodes come from cache->expiry_pool.
+
+   The timer fires SR_ARPCACHE_PROBES times from SR_ARPCACHE_REFRESH of
+   the lifetime on, each time sending a unicast request if the entry was
+   used, so a neighbor in use answers and is refreshed before it expires;
+   it fires a last time at the end of the lifetime to expire it. */
+struct sr_arpexpiry {
+    struct sr_timer timer;
+    uint64_t born;                  /* ms it was inserted */
+    uint32_t ip;
+    uint32_t added;
+    int phase;                      /* probes done */
+    int probed;                     /* a probe went out, keep probing */
+};
+
+/* Warm-up of the cache at start, see sr_arpcache_warm */
+struct sr_arpwarm {
+    struct sr_timer timer;          /* paces the requests */
+    uint64_t start;                 /* ms the first request went out */
+    uint64_t last;                  /* ms the last address resolved */
+    int n;
+    int sent;                       /* addresses asked for so far */
+    int resolved;
+    int settled;                    /* resolved or given up on */
+    uint32_t *ip;
+    int *ifindex;                   /* per address, to ask on */
+    uint8_t *done;                  /* per address, settled */
+};
+
+/* Objects carved per malloc by the pools of the cache */
+#define SR_ARPCACHE_POOL_CHUNK 64
+
+static uint64_t sr_arpcache_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Takes the cache lock. Counts how long the caller waited for it and,
+   for the outermost hold of the recursive lock, from when it is held. */
+static void sr_arpcache_lock(struct sr_arpcache *cache)
+{
+    uint64_t start, wait;
+
+    if (pthread_mutex_trylock(&(cache->lock)) != 0)
+    {
+        start = sr_arpcache_ns();
+        pthread_mutex_lock(&(cache->lock));
+        wait = sr_arpcache_ns() - start;
+        cache->stats.contended++;
+        cache->stats.wait_ns += wait;
+        if (wait > cache->stats.wait_max_ns)
+        { cache->stats.wait_max_ns = wait; }
+    }
+
+    if (cache->depth++ == 0)
+    {
+        cache->stats.acquired++;
+        cache->held_since = sr_arpcache_ns();
+    }
+}
+
+static void sr_arpcache_unlock(struct sr_arpcache *cache)
+{
+    uint64_t hold;
+
+    if (--cache->depth == 0)
+    {
+        hold = sr_arpcache_ns() - cache->held_since;
+        cache->stats.hold_ns += hold;
+        if (hold > cache->stats.hold_max_ns)
+        { cache->stats.hold_max_ns = hold; }
+    }
+
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/* Arms t on the cache's wheel, waking the timer thread if it would
+   sleep past expires. Call with the lock held. */
+static void sr_arpcache_arm(struct sr_arpcache *cache, struct sr_timer *t, uint64_t expires)
+{
+    sr_timer_add(&(cache->wheel), t, expires);
+
+    if (expires < cache->wake_at)
+    {
+        cache->wake_at = expires;
+        pthread_mutex_lock(&(cache->wake_lock));
+        cache->kicked = 1;
+        pthread_cond_signal(&(cache->wake));
+        pthread_mutex_unlock(&(cache->wake_lock));
+    }
+}
+
+/* Bucket of the request index holding requests for ip */
+static struct sr_arpreq **sr_arpreq_bucket(struct sr_arpcache *cache, uint32_t ip)
+{
+    return &(cache->requests[((uint32_t)(ip * 2654435761u) >> 16) & (SR_ARPREQ_HASH - 1)]);
+}
+
+/* Notes that ip of the warm-up, if it is one, resolved or was given up
+   on, and reports the warm-up once every address has. Call with the
+   lock held. */
+static void sr_arpwarm_settle(struct sr_arpcache *cache, uint32_t ip, int resolved)
+{
+    struct sr_arpwarm *warm = cache->warm;
+    int i;
+
+    if (warm == NULL)
+    { return; }
+
+    for (i = 0; i < warm->n && warm->ip[i] != ip; i++)
+        ;
+    if (i == warm->n || warm->done[i])
+    { return; }
+
+    warm->done[i] = 1;
+    warm->settled++;
+    if (resolved)
+    {
+        warm->resolved++;
+        warm->last = sr_timer_now();
+    }
+    if (warm->settled < warm->n)
+    { return; }
+
+    printf("ARP warm-up: %d of %d next hops resolved in %llu ms\n",
+           warm->resolved, warm->n,
+           warm->resolved ? (unsigned long long)(warm->last - warm->start) : 0ULL);
+    fflush(stdout);
+
+    sr_timer_del(&(cache->wheel), &(warm->timer));
+    cache->warm = NULL;
+    free(warm->ip);
+    free(warm->ifindex);
+    free(warm->done);
+    free(warm);
+}
+
+/* Takes req off the request queue. Call with the lock held. */
+static void sr_arpreq_unlink(struct sr_arpcache *cache, struct sr_arpreq *entry)
+{
+    struct sr_arpreq **pp;
+
+    for (pp = sr_arpreq_bucket(cache, entry->ip); *pp != NULL; pp = &((*pp)->next))
+    {
+        if (*pp == entry)
+        {
+            *pp = entry->next;
+            break;
+        }
+    }
+}
+
+/* Returns req and its packets to the pools. It must be off the queue.
+   Call with the lock held. */
+static void sr_arpreq_free(struct sr_arpcache *cache, struct sr_arpreq *entry)
+{
+    struct sr_packet *pkt, *nxt;
+
+    for (pkt = entry->packets; pkt; pkt = nxt)
+    {
+        nxt = pkt->next;
+        if (pkt->pkt.buf != pkt->data)
+            free(pkt->pkt.buf);
+        sr_slab_free(&(cache->pkt_pool), pkt);
+        cache->queued--;
+    }
+
+    sr_slab_free(&(cache->req_pool), entry);
+}
+
+/* Appends work for after the lock is dropped. Call with the lock held. */
+static void sr_arpcache_queue_work(struct sr_arpcache *cache, struct sr_arpwork *work)
+{
+    *(cache->work_tail) = work;
+    cache->work_tail = &(work->next);
+}
+
+/* The bucket of interface ifindex topped up to now, NULL if it is not
+   paced. Call with the lock held. */
+static struct sr_arprate *sr_arprate_get(struct sr_arpcache *cache, int ifindex, uint64_t now)
+{
+    struct sr_arprate *rate;
+    uint64_t tokens;
+
+    if (ifindex < 0 || ifindex >= SR_ARPRATE_IFS)
+    { return NULL; }
+
+    rate = &(cache->rate[ifindex]);
+    if (now > rate->stamp)
+    {
+        tokens = rate->tokens + (now - rate->stamp) * SR_ARPRATE;
+        rate->tokens = tokens > SR_ARPRATE_BURST * 1000 ? SR_ARPRATE_BURST * 1000 : tokens;
+        rate->stamp = now;
+    }
+    return rate;
+}
+
+/* Arms the timer of rate for when its next token is due. */
+static void sr_arprate_arm(struct sr_arpcache *cache, struct sr_arprate *rate)
+{
+    sr_arpcache_arm(cache, &(rate->timer),
+                    rate->stamp + (1000 - rate->tokens + SR_ARPRATE - 1) / SR_ARPRATE);
+}
+
+/* Takes req off the deferred list of its interface. Call with the lock
+   held. */
+static void sr_arprate_undefer(struct sr_arpcache *cache, struct sr_arpreq *req)
+{
+    struct sr_arpreq **pp;
+
+    for (pp = &(cache->rate[req->ifindex].deferred); *pp != req; pp = &((*pp)->next_waiting))
+        ;
+    *pp = req->next_waiting;
+    req->next_waiting = NULL;
+    req->waiting = 0;
+}
+
+/* Decides what req needs now and appends it to the cache's work list:
+   a request, counted and followed by a retransmission timer, or giving
+   up after SR_ARPREQ_TRIES, for which req leaves the queue. Call with
+   the lock held. */
+static void sr_arpcache_decide(struct sr_arpcache *cache, struct sr_arpreq *req)
+{
+    struct sr_arpwork *work;
+    struct sr_arprate *rate;
+    uint64_t now = sr_timer_now();
+
+    /* out of memory, try again on the next tick of the interval */
+    if ((work = calloc(1, sizeof(struct sr_arpwork))) == NULL)
+    {
+        sr_arpcache_arm(cache, &(req->timer), now + SR_ARPREQ_INTERVAL);
+        return;
+    }
+
+    if (req->times_sent >= SR_ARPREQ_TRIES)
+    {
+        sr_arpreq_unlink(cache, req);
+        sr_arpwarm_settle(cache, req->ip, 0);
+        work->dead = req;
+    }
+    else if ((rate = sr_arprate_get(cache, req->ifindex, now)) != NULL && rate->tokens < 1000)
+    {
+        /* no token, wait for one; the request is not sent, nor due */
+        free(work);
+        req->next_waiting = rate->deferred;
+        rate->deferred = req;
+        req->waiting = 1;
+        cache->deferred++;
+        if (!sr_timer_pending(&(rate->timer)))
+        { sr_arprate_arm(cache, rate); }
+        return;
+    }
+    else
+    {
+        /* the target is a next hop, ask on the interface the waiting
+           packets leave by */
+        if (rate != NULL)
+        { rate->tokens -= 1000; }
+        work->ip = req->ip;
+        work->ifindex = req->ifindex;
+
+        req->sent = time(NULL);
+        req->times_sent++;
+        sr_arpcache_arm(cache, &(req->timer), now + SR_ARPREQ_INTERVAL);
+    }
+
+    sr_arpcache_queue_work(cache, work);
+}
+
+/* Retransmission timer of a request, see sr_arpcache_decide */
+static void sr_arpreq_retry(void *ctx, struct sr_timer *t)
+{
+    sr_arpcache_decide(ctx, t->arg);
+}
 
 /*
-  This function gets called every second. For each request sent out, we keep
-  checking whether we should resend an request or destroy the arp request.
-  See the comments in the header file for an idea of what it should look like.
+  Token timer of an interface. Requests that waited out the whole retry
+  schedule are given up on unsent, as they would have been had every
+  request gone out unanswered. The rest go while there are tokens, those
+  with the most packets queued first; under an address sweep that is
+  the next hops carrying real traffic, not the addresses of the sweep.
 */
-
-void sr_arpcache_sweepreqs(struct sr_instance *sr)
+static void sr_arprate_refill(void *ctx, struct sr_timer *t)
 {
-    struct sr_arpcache *cache = &(sr->cache); /* cache */
-    struct sr_arpreq *req, *next;             /* requests */
+    struct sr_arpcache *cache = ctx;
+    struct sr_arprate *rate = t->arg;
+    struct sr_arpreq *req, *next, *best;
+    uint64_t now = sr_timer_now();
+
+    for (req = rate->deferred; req != NULL; req = next)
+    {
+        next = req->next_waiting;
+        if (now - req->born >= (uint64_t)SR_ARPREQ_TRIES * SR_ARPREQ_INTERVAL)
+        {
+            sr_arprate_undefer(cache, req);
+            req->times_sent = SR_ARPREQ_TRIES;
+            cache->suppressed++;
+            sr_arpcache_decide(cache, req);
+        }
+    }
 
-    /* call sr_arpcache_handle_arpreq() to every request entry */
-    for (req = cache->requests; req != NULL; req = next)
+    sr_arprate_get(cache, rate - cache->rate, now);
+    while (rate->deferred != NULL && rate->tokens >= 1000)
     {
-        next = req->next;
-        sr_arpcache_handle_arpreq(sr, req);
+        for (best = req = rate->deferred; req != NULL; req = req->next_waiting)
+        {
+            if (req->queued > best->queued)
+            { best = req; }
+        }
+        sr_arprate_undefer(cache, best);
+        sr_arpcache_decide(cache, best);
     }
+
+    if (rate->deferred != NULL)
+    { sr_arprate_arm(cache, rate); }
 }
 
-void sr_arpcache_handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req)
+/* Takes the work decided so far. Call with the lock held. */
+static struct sr_arpwork *sr_arpcache_take_work(struct sr_arpcache *cache)
+{
+    struct sr_arpwork *work = cache->work;
+
+    cache->work = NULL;
+    cache->work_tail = &(cache->work);
+    return work;
+}
+
+/* Answers the packets of a request given up on with ICMP host
+   unreachable, then frees the request. */
+static void sr_arpcache_giveup(struct sr_instance *sr, struct sr_arpreq *req)
 {
-    /*
-        We provide local variables used in the reference solution.
-        You can add or ignore local variables.
-    */
     struct sr_arpcache *cache = &(sr->cache); /* cache */
     struct sr_packet *pck;                    /* packet */
     uint8_t *buf;                             /* raw Ethernet frame */
     unsigned int len;                         /* length of buf */
     struct sr_ethernet_hdr *e_hdr;            /* Ethernet header */
     struct sr_ip_hdr *i_hdr0, *i_hdr;         /* IP headers */
-    struct sr_arp_hdr *a_hdr;                 /* ARP header */
     struct sr_icmp_t3_hdr *ict3_hdr;          /* ICMP type3 header */
     struct sr_rt *rtentry;                    /* routing table entry */
     struct sr_if *ifc;                        /* router interface */
-    struct sr_arpentry *entry;                /* ARP table entry */
 
-    time_t curtime = time(NULL); /* current time */
+    /* answer whatever else is sent to it for a while at once */
+    sr_ncache_insert(&(sr->ncache), req->ip, SR_NCACHE_DEAD, 0);
 
-    if (difftime(curtime, req->sent) > 1.0)
+    for (pck = req->packets; pck != NULL; pck = pck->next)
     {
-
-        /* 5 failures accumulated, discard */
-        if (req->times_sent >= 5)
+        i_hdr0 = (struct sr_ip_hdr *) (sr_pkt_frame(&(pck->pkt)) + sizeof *e_hdr);
+
+        len = sizeof *e_hdr + sizeof *i_hdr + sizeof *ict3_hdr;
+        buf = malloc(len);
+        e_hdr = (struct sr_ethernet_hdr *) buf;
+        i_hdr = (struct sr_ip_hdr *) (buf + sizeof *e_hdr);
+        ict3_hdr = (struct sr_icmp_t3_hdr *) (buf + sizeof *e_hdr + sizeof *i_hdr);
+
+        e_hdr->ether_type = htons(ethertype_ip);
+        i_hdr->ip_hl = sizeof *i_hdr / 4;
+        i_hdr->ip_v = 4;
+        i_hdr->ip_tos = 0;
+        i_hdr->ip_len = htons(sizeof *i_hdr + sizeof *ict3_hdr);
+        i_hdr->ip_id = i_hdr0->ip_id;
+        i_hdr->ip_off = htons(IP_DF);
+        i_hdr->ip_ttl = INIT_TTL;
+        i_hdr->ip_p = ip_protocol_icmp;
+        i_hdr->ip_dst = i_hdr0->ip_src;
+
+        ict3_hdr->icmp_type = 3;
+        ict3_hdr->icmp_code = 1;
+        ict3_hdr->unused = 0;
+        ict3_hdr->next_mtu = 0;
+        memcpy(ict3_hdr->data, i_hdr0, ICMP_DATA_SIZE);
+        ict3_hdr->icmp_sum = 0;
+        ict3_hdr->icmp_sum = cksum(ict3_hdr, sizeof *ict3_hdr);
+
+        rtentry = sr_findLPMentry(sr, i_hdr0->ip_src, 0, NULL);
+        if (rtentry != NULL)
         {
-            /**************** fill in code here *****************/
-            for (pck = req->packets; pck != NULL; pck = pck->next)
+            ifc = sr_get_interface(sr, rtentry->interface);
+
+            i_hdr->ip_src = ifc->ip;
+            i_hdr->ip_sum = 0;
+            i_hdr->ip_sum = cksum(i_hdr, sizeof *i_hdr);
+
+            memcpy(e_hdr->ether_shost, ifc->addr, ETHER_ADDR_LEN);
+            if (sr_arpcache_lookup_mac(cache, i_hdr0->ip_src, e_hdr->ether_dhost))
             {
-                i_hdr0 = (struct sr_ip_hdr *) (pck->buf + sizeof *e_hdr);
-
-                len = sizeof *e_hdr + sizeof *i_hdr + sizeof *ict3_hdr;
-                buf = malloc(len);
-                e_hdr = (struct sr_ethernet_hdr *) buf;
-                i_hdr = (struct sr_ip_hdr *) (buf + sizeof *e_hdr);
-                ict3_hdr = (struct sr_icmp_t3_hdr *) (buf + sizeof *e_hdr + sizeof *i_hdr);
-
-                e_hdr->ether_type = htons(ethertype_ip);
-                i_hdr->ip_hl = sizeof *i_hdr / 4;
-                i_hdr->ip_v = 4;
-                i_hdr->ip_tos = 0;
-                i_hdr->ip_len = htons(sizeof *i_hdr + sizeof *ict3_hdr);
-                i_hdr->ip_id = i_hdr0->ip_id;
-                i_hdr->ip_off = htons(IP_DF);
-                i_hdr->ip_ttl = INIT_TTL;
-                i_hdr->ip_p = ip_protocol_icmp;
-                i_hdr->ip_dst = i_hdr0->ip_src;
-
-                ict3_hdr->icmp_type = 3;
-                ict3_hdr->icmp_code = 1;
-                ict3_hdr->unused = 0;
-                ict3_hdr->next_mtu = 0;
-                memcpy(ict3_hdr->data, i_hdr0, ICMP_DATA_SIZE);
-                ict3_hdr->icmp_sum = 0;
-                ict3_hdr->icmp_sum = cksum(ict3_hdr, sizeof *ict3_hdr);
-
-                rtentry = sr_findLPMentry(sr->routing_table, i_hdr0->ip_src);
-                if (rtentry != NULL)
-                {
-                    ifc = sr_get_interface(sr, rtentry->interface);
-
-                    i_hdr->ip_src = ifc->ip;
-                    i_hdr->ip_sum = 0;
-                    i_hdr->ip_sum = cksum(i_hdr, sizeof *i_hdr);
-
-                    memcpy(e_hdr->ether_shost, ifc->addr, ETHER_ADDR_LEN);
-                    entry = sr_arpcache_lookup(cache, i_hdr0->ip_src);
-                    if (entry != NULL)
-                    {
-                        memcpy(e_hdr->ether_dhost, entry->mac, ETHER_ADDR_LEN);
-                        free(entry);
-                        sr_send_packet(sr, buf, len, rtentry->interface);
-                    }
-                    else
-                    {
-                        sr_arpcache_handle_arpreq(sr, sr_arpcache_queuereq(cache, i_hdr->ip_dst, buf, len, rtentry->interface));
-                    }
-                }
-                free(buf);
+                sr_send_packet(sr, buf, len, rtentry->interface);
+            }
+            else
+            {
+                sr_arpcache_handle_arpreq(sr, sr_arpcache_queuereq(cache, i_hdr->ip_dst, buf, len, ifc->index));
             }
-            /****************************************************/
-            sr_arpreq_destroy(cache, req);
         }
+        free(buf);
+    }
+
+    sr_arpcache_lock(cache);
+    sr_arpreq_free(cache, req);
+    sr_arpcache_unlock(cache);
+}
 
+/* Sends an ARP request for ip out of interface ifindex: broadcast, or
+   to mac if not NULL to check a known neighbor. */
+static void sr_arpcache_send_request(struct sr_instance *sr, uint32_t ip, int ifindex,
+                                     const unsigned char *mac)
+{
+    uint8_t buf[sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr)];
+    struct sr_ethernet_hdr *e_hdr = (struct sr_ethernet_hdr *) buf;
+    struct sr_arp_hdr *a_hdr = (struct sr_arp_hdr *) (buf + sizeof *e_hdr);
+    struct sr_rt *rtentry;
+    struct sr_if *ifc;
+
+    if (ifindex >= 0)
+        ifc = sr_get_interface_by_index(sr, ifindex);
+    else
+    {
+        rtentry = sr_findLPMentry(sr, ip, 0, NULL);
+        ifc = rtentry ? sr_get_interface(sr, rtentry->interface) : NULL;
+    }
+    if (ifc == NULL)
+        return;
+
+    e_hdr->ether_type = htons(ethertype_arp);
+    memcpy(e_hdr->ether_shost, ifc->addr, ETHER_ADDR_LEN);
+    if (mac != NULL)
+        memcpy(e_hdr->ether_dhost, mac, ETHER_ADDR_LEN);
+    else
+        memset(e_hdr->ether_dhost, 0xff, ETHER_ADDR_LEN);
+
+    a_hdr->ar_hrd = htons(arp_hrd_ethernet);
+    a_hdr->ar_pro = htons(ethertype_ip);
+    a_hdr->ar_hln = ETHER_ADDR_LEN;
+    a_hdr->ar_pln = 4;
+    a_hdr->ar_op = htons(arp_op_request);
+    memcpy(a_hdr->ar_sha, ifc->addr, ETHER_ADDR_LEN);
+    a_hdr->ar_sip = ifc->ip;
+    if (mac != NULL)
+        memcpy(a_hdr->ar_tha, mac, ETHER_ADDR_LEN);
+    else
+        memset(a_hdr->ar_tha, 0xff, ETHER_ADDR_LEN);
+    a_hdr->ar_tip = ip;
+
+    sr_send_packet(sr, buf, sizeof(buf), ifc->name);
+}
+
+/* Does the work decided under the lock, without it, and frees the list. */
+static void sr_arpcache_work(struct sr_instance *sr, struct sr_arpwork *work)
+{
+    struct sr_arpwork *next;
+
+    for (; work != NULL; work = next)
+    {
+        next = work->next;
+        if (work->dead != NULL)
+            sr_arpcache_giveup(sr, work->dead);
         else
-        {
-            /**************** fill in code here *****************/
-            rtentry = sr_findLPMentry(sr->routing_table, req->ip);
-            ifc = sr_get_interface(sr, rtentry->interface);
+            sr_arpcache_send_request(sr, work->ip, work->ifindex, work->unicast ? work->mac : NULL);
+        free(work);
+    }
+}
 
-            len = sizeof *e_hdr + sizeof *a_hdr;
-            buf = malloc(len);
-            e_hdr = (struct sr_ethernet_hdr *) buf;
-            a_hdr = (struct sr_arp_hdr *) (buf + sizeof *e_hdr);
+/* Sends the first ARP request for req, as sr_arpcache_queuereq decided
+   it. Retransmissions and giving up run from its timer on the ARP
+   thread. */
+void sr_arpcache_handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req)
+{
+    struct sr_arpcache *cache = &(sr->cache); /* cache */
+    struct sr_arpwork *work;
 
-            e_hdr->ether_type = htons(ethertype_arp);
-            memcpy(e_hdr->ether_shost, ifc->addr, ETHER_ADDR_LEN);
-            memset(e_hdr->ether_dhost, 0xff, ETHER_ADDR_LEN);
-
-            a_hdr->ar_hrd = htons(arp_hrd_ethernet);
-            a_hdr->ar_pro = htons(ethertype_ip);
-            a_hdr->ar_hln = ETHER_ADDR_LEN;
-            a_hdr->ar_pln = 4;
-            a_hdr->ar_op = htons(arp_op_request);
-            memcpy(a_hdr->ar_sha, ifc->addr, ETHER_ADDR_LEN);
-            a_hdr->ar_sip = ifc->ip;
-            memset(a_hdr->ar_tha, 0xff, ETHER_ADDR_LEN);
-            a_hdr->ar_tip = req->ip;
-
-            req->sent = curtime;
-            req->times_sent++;
-
-            sr_send_packet(sr, buf, len, ifc->name);
-            free(buf);
-            /****************************************************/
+    if (req == NULL)
+        return;
+
+    /* the first send was decided by sr_arpcache_queuereq under its lock;
+       the ARP thread may have given up on req and freed it since, so req
+       is not read here */
+    sr_arpcache_lock(cache);
+    work = sr_arpcache_take_work(cache);
+    sr_arpcache_unlock(cache);
+
+    sr_arpcache_work(sr, work);
+}
+
+/* You should not need to touch the rest of this code. */
+
+/* Home slot of ip.  Multiplicative hash, the high bits are the well mixed
+   ones. */
+static uint32_t sr_arptable_home(const struct sr_arptable *t, uint32_t ip)
+{
+    return ((uint32_t)(ip * 2654435761u) >> 16) & t->mask;
+}
+
+/* Slot holding ip, or -1. Call with the lock held. */
+static long sr_arpcache_find(struct sr_arpcache *cache, uint32_t ip)
+{
+    struct sr_arptable *t = cache->table;
+    uint32_t i;
+
+    if (ip == 0)
+    { return -1; }
+
+    for (i = sr_arptable_home(t, ip); t->slot[i].ip != 0; i = (i + 1) & t->mask)
+    {
+        if (t->slot[i].ip == ip)
+        { return i; }
+    }
+
+    return -1;
+}
+
+/* Frees slot i, moving later entries of its probe run back so lookups
+   never have to step over holes. Call with the lock held. */
+static void sr_arpcache_remove(struct sr_arpcache *cache, uint32_t i)
+{
+    struct sr_arptable *t = cache->table;
+    uint32_t j, home;
+
+    for (j = (i + 1) & t->mask; t->slot[j].ip != 0; j = (j + 1) & t->mask)
+    {
+        /* an entry may move back to i unless its home lies in (i, j] */
+        home = sr_arptable_home(t, t->slot[j].ip);
+        if (((j - home) & t->mask) >= ((j - i) & t->mask))
+        {
+            t->slot[i] = t->slot[j];
+            i = j;
         }
     }
+
+    memset(&(t->slot[i]), 0, sizeof(struct sr_arpslot));
+    cache->count--;
+}
+
+/* Marks the start and end of a change to the slots for lockless
+   readers, see struct sr_arpcache. Call with the lock held. */
+static void sr_arpcache_write_begin(struct sr_arpcache *cache)
+{
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sr_arpcache_write_end(struct sr_arpcache *cache)
+{
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+static struct sr_arptable *sr_arptable_alloc(uint32_t n)
+{
+    struct sr_arptable *t;
+
+    t = calloc(1, sizeof(struct sr_arptable) + (n - 1) * sizeof(struct sr_arpslot));
+    if (t != NULL)
+    { t->mask = n - 1; }
+    return t;
+}
+
+/* Doubles the table. Call with the lock held, inside a write. The old
+   table goes on the retired list. Returns 0 on success. */
+static int sr_arpcache_grow(struct sr_arpcache *cache)
+{
+    struct sr_arptable *old = cache->table, *t;
+    uint32_t i, j;
+
+    if ((t = sr_arptable_alloc(2 * (old->mask + 1))) == NULL)
+    { return -1; }
+
+    for (i = 0; i <= old->mask; i++)
+    {
+        if (old->slot[i].ip == 0)
+        { continue; }
+        for (j = sr_arptable_home(t, old->slot[i].ip); t->slot[j].ip != 0; j = (j + 1) & t->mask)
+            ;
+        t->slot[j] = old->slot[i];
+    }
+
+    sr_rcu_assign_pointer(cache->table, t);
+    old->next = cache->retired;
+    cache->retired = old;
+    return 0;
 }
 
-/* You should not need to touch the rest of this code. */
+/* Frees a slot by CLOCK over the SR_ARPCACHE_EVICT_SCAN entries from
+   the home slot of ip on: entries looked up since last passed get a
+   second chance. The pass is local rather than a hand going round the
+   table, which would empty the slots behind it and crowd the rest into
+   long probe runs. Call with the lock held. */
+static void sr_arpcache_evict(struct sr_arpcache *cache, uint32_t ip)
+{
+    struct sr_arptable *t = cache->table;
+    uint32_t i, victim = 0;
+    int seen = 0;
 
-/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip)
+    for (i = sr_arptable_home(t, ip); seen < SR_ARPCACHE_EVICT_SCAN; i = (i + 1) & t->mask)
+    {
+        if (t->slot[i].ip == 0)
+        { continue; }
+        if (seen++ == 0)
+        { victim = i; }
+        if (!t->slot[i].ref)
+        {
+            victim = i;
+            break;
+        }
+        t->slot[i].ref = 0;
+    }
+
+    sr_arpcache_remove(cache, victim);
+    cache->evictions++;
+}
+
+/* When phase of exp is due, probes from SR_ARPCACHE_REFRESH of the
+   lifetime on and expiry at its end */
+static uint64_t sr_arpexpiry_due(struct sr_arpexpiry *exp)
 {
-    pthread_mutex_lock(&(cache->lock));
+    double at = SR_ARPCACHE_REFRESH +
+                (1.0 - SR_ARPCACHE_REFRESH) * exp->phase / SR_ARPCACHE_PROBES;
 
-    struct sr_arpentry *entry = NULL, *copy = NULL;
+    return exp->born + (uint64_t)(SR_ARPCACHE_TO * 1000 * at);
+}
 
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++)
+/* Refresh and expiry timer of an entry, see struct sr_arpexpiry */
+static void sr_arpcache_expire(void *ctx, struct sr_timer *t)
+{
+    struct sr_arpcache *cache = ctx;
+    struct sr_arpexpiry *exp = t->arg;
+    struct sr_arpslot *slot;
+    struct sr_arpwork *work;
+    int used;
+    long i;
+
+    if ((i = sr_arpcache_find(cache, exp->ip)) < 0 || cache->table->slot[i].added != exp->added)
+    {
+        sr_slab_free(&(cache->expiry_pool), exp);
+        return;
+    }
+    slot = &(cache->table->slot[i]);
+
+    if (exp->phase < SR_ARPCACHE_PROBES)
     {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip))
+        /* forwarding through an adjacency leaves the slot alone, so ask
+           the adjacencies too */
+        used = __atomic_exchange_n(&(slot->used), 0, __ATOMIC_RELAXED);
+        if (cache->adj != NULL && sr_adj_used(cache->adj, exp->ip))
+        { used = 1; }
+
+        /* once probed keep probing, the answer refreshes the entry and
+           retires this timer */
+        if ((used || exp->probed) && (work = calloc(1, sizeof(struct sr_arpwork))) != NULL)
         {
-            entry = &(cache->entries[i]);
+            work->ip = exp->ip;
+            work->ifindex = -1;
+            work->unicast = 1;
+            memcpy(work->mac, slot->mac, ETHER_ADDR_LEN);
+            sr_arpcache_queue_work(cache, work);
+            exp->probed = 1;
+            cache->refreshes++;
         }
+
+        exp->phase++;
+        sr_arpcache_arm(cache, &(exp->timer), sr_arpexpiry_due(exp));
+        return;
     }
 
+    sr_arpcache_write_begin(cache);
+    sr_arpcache_remove(cache, i);
+    sr_arpcache_write_end(cache);
+
+    sr_slab_free(&(cache->expiry_pool), exp);
+}
+
+/* Arms the refresh and expiry of the entry of ip inserted at added, born
+   ms on the sr_timer_now clock. Call with the lock held. */
+static void sr_arpcache_arm_expiry(struct sr_arpcache *cache, uint32_t ip, uint32_t added,
+                                   uint64_t born)
+{
+    struct sr_arpexpiry *exp;
+
+    /* without a timer the entry lives until evicted or refreshed */
+    if ((exp = sr_slab_alloc(&(cache->expiry_pool))) == NULL)
+    { return; }
+
+    sr_timer_init(&(exp->timer), sr_arpcache_expire, exp);
+    exp->born = born;
+    exp->ip = ip;
+    exp->added = added;
+    exp->phase = 0;
+    exp->probed = 0;
+    sr_arpcache_arm(cache, &(exp->timer), sr_arpexpiry_due(exp));
+}
+
+/* Makes a request for ip at the head of bucket, NULL if the pool is
+   exhausted. Call with the lock held. */
+static struct sr_arpreq *sr_arpreq_new(struct sr_arpcache *cache,
+                                       struct sr_arpreq **bucket, uint32_t ip)
+{
+    struct sr_arpreq *req;
+
+    if ((req = sr_slab_alloc(&(cache->req_pool))) == NULL)
+    {
+        cache->drops_reqs++;
+        return NULL;
+    }
+    memset(req, 0, sizeof(struct sr_arpreq));
+    req->ip = ip;
+    req->ifindex = -1;
+    req->born = sr_timer_now();
+    sr_timer_init(&(req->timer), sr_arpreq_retry, req);
+    req->next = *bucket;
+    *bucket = req;
+    return req;
+}
+
+/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
+   You must free the returned structure if it is not NULL. */
+struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip)
+{
+    struct sr_arpentry *copy = NULL;
+    struct sr_arpslot *slot;
+    long i;
+
+    sr_arpcache_lock(cache);
+
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
-    if (entry)
+    if ((i = sr_arpcache_find(cache, ip)) >= 0)
     {
+        slot = &(cache->table->slot[i]);
+        slot->ref = 1;
+        slot->used = 1;
         copy = (struct sr_arpentry *)malloc(sizeof(struct sr_arpentry));
-        memcpy(copy, entry, sizeof(struct sr_arpentry));
+        memcpy(copy->mac, slot->mac, ETHER_ADDR_LEN);
+        copy->ip = slot->ip;
+        copy->added = slot->added;
+        copy->valid = 1;
     }
 
-    pthread_mutex_unlock(&(cache->lock));
+    sr_arpcache_unlock(cache);
 
     return copy;
 }
 
+/*
+  Lockless lookup for the forwarding path. The probe runs on whatever the
+  table looks like and the result only counts if seq shows no writer was
+  active meanwhile; a torn read is retried, never used. The retry loop is
+  short since writers hold the slots for a few hundred nanoseconds, apart
+  from the rare growth of the table.
+*/
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip,
+                           unsigned char *mac)
+{
+    struct sr_arptable *t;
+    struct sr_arpslot *slot;
+    uint32_t seq, i, sip;
+    int found;
+
+    if (ip == 0)
+    { return 0; }
+
+    do
+    {
+        seq = __atomic_load_n(&(cache->seq), __ATOMIC_ACQUIRE);
+        found = 0;
+        if (seq & 1)
+        { continue; }
+
+        t = sr_rcu_dereference(cache->table);
+        for (i = sr_arptable_home(t, ip); ; i = (i + 1) & t->mask)
+        {
+            slot = &(t->slot[i]);
+            sip = __atomic_load_n(&(slot->ip), __ATOMIC_RELAXED);
+            if (sip == 0)
+            { break; }
+            if (sip == ip)
+            {
+                memcpy(mac, slot->mac, ETHER_ADDR_LEN);
+                if (!__atomic_load_n(&(slot->ref), __ATOMIC_RELAXED))
+                { __atomic_store_n(&(slot->ref), 1, __ATOMIC_RELAXED); }
+                if (!__atomic_load_n(&(slot->used), __ATOMIC_RELAXED))
+                { __atomic_store_n(&(slot->used), 1, __ATOMIC_RELAXED); }
+                found = 1;
+                break;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&(cache->seq), __ATOMIC_RELAXED) != seq);
+
+    return found;
+}
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
    that corresponds to this ARP request. You should free the passed *packet.
@@ -192,12 +833,15 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet, /* borrowed */
                                        unsigned int packet_len,
-                                       char *iface)
+                                       int ifindex)
 {
-    pthread_mutex_lock(&(cache->lock));
+    struct sr_arpreq **bucket, *req;
+    struct sr_packet *new_pkt;
+
+    sr_arpcache_lock(cache);
 
-    struct sr_arpreq *req, *tmp;
-    for (req = cache->requests; req != NULL; req = req->next)
+    bucket = sr_arpreq_bucket(cache, ip);
+    for (req = *bucket; req != NULL; req = req->next)
     {
         if (req->ip == ip)
         {
@@ -206,43 +850,98 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
     }
 
     /* If the IP wasn't found, add it */
-    if (!req)
+    if (!req && (req = sr_arpreq_new(cache, bucket, ip)) == NULL)
     {
-        req = (struct sr_arpreq *)calloc(1, sizeof(struct sr_arpreq));
-        req->ip = ip;
-        req->next = NULL;
-        if(cache->requests==NULL){
-            cache->requests=req;
-        }
-        else{
-            for(tmp=cache->requests;tmp!=NULL;tmp=tmp->next){
-                if(tmp->next==NULL){
-                    tmp->next=req;
-                    break;
-                }
-            }
-        }
+        sr_arpcache_unlock(cache);
+        return NULL;
     }
 
-    /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface)
+    /* Add the packet to the end of the list of packets for this request,
+       unless its queue or all of them are full */
+    if (packet && packet_len && ifindex >= 0)
     {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
-
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-        new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+        if (req->ifindex < 0)
+        { req->ifindex = ifindex; }
+        if (req->queued >= SR_ARPREQ_QLEN)
+        { cache->drops_qlen++; }
+        else if (cache->queued >= SR_ARPREQ_QUEUED_MAX ||
+                 (new_pkt = sr_slab_alloc(&(cache->pkt_pool))) == NULL)
+        { cache->drops_queued++; }
+        else
+        {
+            new_pkt->pkt.buf = packet_len <= SR_PACKET_BUFSZ ? new_pkt->data :
+                               malloc(SR_PKT_HEADROOM + packet_len);
+            if (new_pkt->pkt.buf == NULL)
+            {
+                sr_slab_free(&(cache->pkt_pool), new_pkt);
+                cache->drops_queued++;
+            }
+            else
+            {
+                new_pkt->pkt.off = SR_PKT_HEADROOM;
+                new_pkt->pkt.len = packet_len;
+                memcpy(sr_pkt_frame(&(new_pkt->pkt)), packet, packet_len);
+                new_pkt->ifindex = ifindex;
+                new_pkt->next = NULL;
+                if (req->last != NULL)
+                { req->last->next = new_pkt; }
+                else
+                { req->packets = new_pkt; }
+                req->last = new_pkt;
+                req->queued++;
+                cache->queued++;
+            }
+        }
     }
 
-    pthread_mutex_unlock(&(cache->lock));
+    /* a new request is sent at once, see sr_arpcache_handle_arpreq */
+    if (!sr_timer_pending(&(req->timer)) && !req->waiting)
+    { sr_arpcache_decide(cache, req); }
+
+    sr_arpcache_unlock(cache);
 
     return req;
 }
 
+/* Maps ip to mac as learned at added, on the time() clock, and born, on
+   the sr_timer_now clock. Call with the lock held. */
+static void sr_arpcache_put(struct sr_arpcache *cache, unsigned char *mac, uint32_t ip,
+                            uint32_t added, uint64_t born)
+{
+    struct sr_arptable *t;
+    struct sr_arpslot *slot;
+    long i;
+
+    if (ip == 0)
+    { return; }
+
+    /* a new mapping may need room: grow while the table may, then evict */
+    sr_arpcache_write_begin(cache);
+    if ((i = sr_arpcache_find(cache, ip)) < 0)
+    {
+        if ((cache->count + 1) * 4 > (cache->table->mask + 1) * 3 &&
+            (cache->table->mask + 1 == SR_ARPCACHE_MAX || sr_arpcache_grow(cache) != 0))
+        { sr_arpcache_evict(cache, ip); }
+
+        t = cache->table;
+        for (i = sr_arptable_home(t, ip); t->slot[i].ip != 0; i = (i + 1) & t->mask)
+            ;
+        t->slot[i].ip = ip;
+        t->slot[i].ref = 0;
+        t->slot[i].used = 0;
+        cache->count++;
+    }
+
+    /* a new slot reads 0; within the same second the timer armed
+       already stands */
+    slot = &(cache->table->slot[i]);
+    memcpy(slot->mac, mac, ETHER_ADDR_LEN);
+    if (slot->added != added)
+    { sr_arpcache_arm_expiry(cache, ip, added, born); }
+    slot->added = added;
+    sr_arpcache_write_end(cache);
+}
+
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
@@ -251,122 +950,465 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
                                      uint32_t ip)
 {
-    pthread_mutex_lock(&(cache->lock));
+    sr_arpcache_lock(cache);
 
-    struct sr_arpreq *req, *prev = NULL, *next = NULL;
-    for (req = cache->requests; req != NULL; req = req->next)
+    struct sr_arpreq **pp, *req;
+    for (pp = sr_arpreq_bucket(cache, ip); (req = *pp) != NULL; pp = &(req->next))
     {
         if (req->ip == ip)
         {
-            if (prev)
-            {
-                next = req->next;
-                prev->next = next;
-            }
-            else
-            {
-                next = req->next;
-                cache->requests = next;
-            }
-
+            *pp = req->next;
+            sr_timer_del(&(cache->wheel), &(req->timer));
+            if (req->waiting)
+            { sr_arprate_undefer(cache, req); }
             break;
         }
-        prev = req;
     }
 
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++)
+    sr_arpcache_put(cache, mac, ip, time(NULL), sr_timer_now());
+    sr_arpwarm_settle(cache, ip, 1);
+
+    sr_arpcache_unlock(cache);
+
+    return req;
+}
+
+/*
+  Takes a mapping from an ARP packet that did not answer a request of
+  ours. Anyone on the segment can send one, so it is trusted less than
+  a reply: it never changes the MAC of an entry, only learns a new one
+  when create is set and the table has room without evicting, and
+  leaves entries younger than SR_ARPSNOOP_FRESH alone so a chatty host
+  does not rearm its timer on every packet. A MAC that really changed
+  shows when the refresh of the old one goes unanswered.
+*/
+int sr_arpcache_snoop(struct sr_arpcache *cache, unsigned char *mac,
+                      uint32_t ip, int create, struct sr_arpreq **req)
+{
+    struct sr_arpslot *slot;
+    int taken = 0;
+    long i;
+
+    *req = NULL;
+    sr_arpcache_lock(cache);
+
+    if ((i = sr_arpcache_find(cache, ip)) >= 0)
     {
-        if (!(cache->entries[i].valid))
-            break;
+        slot = &(cache->table->slot[i]);
+        if (memcmp(slot->mac, mac, ETHER_ADDR_LEN) != 0)
+        { cache->snoop_conflicts++; }
+        else if (time(NULL) - (time_t)slot->added < SR_ARPSNOOP_FRESH)
+        { cache->snoop_skipped++; }
+        else
+        { taken = 1; }
+    }
+    else if (create)
+    {
+        if ((cache->count + 1) * 4 > (cache->table->mask + 1) * 3 &&
+            cache->table->mask + 1 == SR_ARPCACHE_MAX)
+        { cache->snoop_skipped++; }
+        else
+        { taken = 1; }
     }
 
-    if (i != SR_ARPCACHE_SZ)
+    if (taken)
     {
-        memcpy(cache->entries[i].mac, mac, 6);
-        cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
-        cache->entries[i].valid = 1;
+        *req = sr_arpcache_insert(cache, mac, ip);
+        cache->snooped++;
     }
 
-    pthread_mutex_unlock(&(cache->lock));
+    sr_arpcache_unlock(cache);
 
-    return req;
+    return taken;
 }
 
-/* Frees all memory associated with this arp request entry. If this arp request
-   entry is on the arp request queue, it is removed from the queue. */
-void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry)
+/* Warm-up timer, asks for the next address, see sr_arpcache_warm */
+static void sr_arpwarm_next(void *ctx, struct sr_timer *t)
 {
-    pthread_mutex_lock(&(cache->lock));
+    struct sr_arpcache *cache = ctx;
+    struct sr_arpwarm *warm = t->arg;
+    struct sr_arpreq **bucket, *req;
+    int ifindex = warm->ifindex[warm->sent];
+    uint32_t ip = warm->ip[warm->sent++];
 
-    if (entry)
+    if (warm->sent < warm->n)
+    { sr_arpcache_arm(cache, &(warm->timer), sr_timer_now() + SR_ARPWARM_GAP); }
+
+    /* already known, or asked for by traffic that came first */
+    if (sr_arpcache_find(cache, ip) >= 0)
     {
-        struct sr_arpreq *req, *prev = NULL, *next = NULL;
-        for (req = cache->requests; req != NULL; req = req->next)
-        {
-            if (req == entry)
-            {
-                if (prev)
-                {
-                    next = req->next;
-                    prev->next = next;
-                }
-                else
-                {
-                    next = req->next;
-                    cache->requests = next;
-                }
+        sr_arpwarm_settle(cache, ip, 1);
+        return;
+    }
+    bucket = sr_arpreq_bucket(cache, ip);
+    for (req = *bucket; req != NULL && req->ip != ip; req = req->next)
+        ;
+    if (req != NULL)
+    { return; }
 
-                break;
-            }
-            prev = req;
-        }
+    if ((req = sr_arpreq_new(cache, bucket, ip)) != NULL)
+    {
+        req->ifindex = ifindex;
+        sr_arpcache_decide(cache, req);
+    }
+    else
+    { sr_arpwarm_settle(cache, ip, 0); }
+}
 
-        struct sr_packet *pkt, *nxt;
+/*
+  Warms the cache before traffic needs it. The requests are ordinary
+  ones without packets, sent from the timer thread one every
+  SR_ARPWARM_GAP ms so a long list does not burst onto the links, and
+  retried and given up on like any other. Packets that arrive first
+  simply join the request of their next hop.
+*/
+int sr_arpcache_warm(struct sr_arpcache *cache, const uint32_t *ip,
+                     const int *ifindex, int n)
+{
+    struct sr_arpwarm *warm;
 
-        for (pkt = entry->packets; pkt; pkt = nxt)
+    if (n <= 0)
+    { return 0; }
+
+    if ((warm = calloc(1, sizeof(struct sr_arpwarm))) == NULL ||
+        (warm->ip = malloc(n * sizeof(uint32_t))) == NULL ||
+        (warm->ifindex = malloc(n * sizeof(int))) == NULL ||
+        (warm->done = calloc(n, 1)) == NULL)
+    {
+        if (warm != NULL)
         {
-            nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+            free(warm->ip);
+            free(warm->ifindex);
+            free(warm);
         }
+        return -1;
+    }
+    memcpy(warm->ip, ip, n * sizeof(uint32_t));
+    memcpy(warm->ifindex, ifindex, n * sizeof(int));
+    warm->n = n;
+    sr_timer_init(&(warm->timer), sr_arpwarm_next, warm);
 
-        free(entry);
+    sr_arpcache_lock(cache);
+    if (cache->warm != NULL)
+    {
+        sr_arpcache_unlock(cache);
+        free(warm->ip);
+        free(warm->ifindex);
+        free(warm->done);
+        free(warm);
+        return -1;
     }
+    cache->warm = warm;
+    warm->start = sr_timer_now();
+    sr_arpcache_arm(cache, &(warm->timer), warm->start);
+    sr_arpcache_unlock(cache);
 
-    pthread_mutex_unlock(&(cache->lock));
+    return 0;
+}
+
+/* Frees all memory associated with this arp request entry. If this arp request
+   entry is on the arp request queue, it is removed from the queue. */
+void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry)
+{
+    sr_arpcache_lock(cache);
+
+    if (entry)
+    {
+        sr_arpreq_unlink(cache, entry);
+        sr_timer_del(&(cache->wheel), &(entry->timer));
+        if (entry->waiting)
+        { sr_arprate_undefer(cache, entry); }
+        sr_arpreq_free(cache, entry);
+    }
+
+    sr_arpcache_unlock(cache);
 }
 
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache)
 {
-    fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
+    sr_arpcache_lock(cache);
+
+    fprintf(stderr, "\nMAC            IP         ADDED                      REF\n");
     fprintf(stderr, "-----------------------------------------------------------\n");
 
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++)
+    uint32_t i;
+    for (i = 0; i <= cache->table->mask; i++)
     {
-        struct sr_arpentry *cur = &(cache->entries[i]);
+        struct sr_arpslot *cur = &(cache->table->slot[i]);
         unsigned char *mac = cur->mac;
-        fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
+        time_t added = cur->added;
+        if (cur->ip == 0)
+            continue;
+        fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&added), cur->ref);
     }
 
-    fprintf(stderr, "\n");
+    fprintf(stderr, "%u of %u slots used, %lu evictions\n\n", cache->count, cache->table->mask + 1, cache->evictions);
+
+    sr_arpcache_unlock(cache);
+}
+
+/* Prints lock wait and hold times, timer counts and queue drops. Reads the counters without the lock,
+   they only need to be roughly right. */
+void sr_arpcache_dump_stats(struct sr_arpcache *cache)
+{
+    struct sr_arplockstats *st = &(cache->stats);
+
+    fprintf(stderr, "arp cache lock: %lu holds, %lu contended, "
+            "wait %.1f us avg when contended %.1f us max, hold %.1f us avg %.1f us max\n",
+            st->acquired, st->contended,
+            st->contended ? st->wait_ns / 1e3 / st->contended : 0.0, st->wait_max_ns / 1e3,
+            st->acquired ? st->hold_ns / 1e3 / st->acquired : 0.0, st->hold_max_ns / 1e3);
+    fprintf(stderr, "arp timers: %lu pending, %lu fired\n",
+            cache->wheel.pending, cache->wheel.fired);
+    fprintf(stderr, "arp queues: %lu requests, %u packets, dropped %lu over %d per request, "
+            "%lu over %d in all, %lu with no request\n",
+            cache->req_pool.in_use, cache->queued, cache->drops_qlen, SR_ARPREQ_QLEN,
+            cache->drops_queued, SR_ARPREQ_QUEUED_MAX, cache->drops_reqs);
+    fprintf(stderr, "arp rate: %lu requests deferred, %lu suppressed, "
+            "%d a second and %d at once per interface\n",
+            cache->deferred, cache->suppressed, SR_ARPRATE, SR_ARPRATE_BURST);
+    fprintf(stderr, "arp refresh: %lu unicast requests for entries in use\n",
+            cache->refreshes);
+    fprintf(stderr, "arp snooping: %lu learned or refreshed, %lu conflicting, %lu skipped\n",
+            cache->snooped, cache->snoop_conflicts, cache->snoop_skipped);
+}
+
+/* Checksum of the records of a checkpoint */
+static uint64_t sr_arpsnap_checksum(const struct sr_arpsnap_rec *rec, uint32_t n)
+{
+    const unsigned char *p = (const unsigned char *)rec;
+    uint64_t h = 0xcbf29ce484222325ull;
+    size_t i;
+
+    for (i = 0; i < (size_t)n * sizeof(struct sr_arpsnap_rec); i++)
+    { h = (h ^ p[i]) * 0x100000001b3ull; }
+
+    return h;
+}
+
+/*
+  Writes the entries to a temporary file and renames it into place, so a
+  restart never reads a half written checkpoint. The entries are copied
+  out under the lock and written after it is dropped.
+*/
+int sr_arpcache_save(struct sr_arpcache *cache, const char *filename)
+{
+    struct sr_arpsnap_hdr hdr;
+    struct sr_arpsnap_rec *rec;
+    struct sr_arptable *t;
+    const char *p;
+    size_t len;
+    ssize_t ret;
+    char *tmp;
+    uint32_t i, n = 0;
+    int fd, err;
+
+    sr_arpcache_lock(cache);
+    t = cache->table;
+    if ((rec = calloc(cache->count ? cache->count : 1, sizeof(struct sr_arpsnap_rec))) == NULL)
+    {
+        sr_arpcache_unlock(cache);
+        return -1;
+    }
+    for (i = 0; i <= t->mask && n < cache->count; i++)
+    {
+        if (t->slot[i].ip == 0)
+        { continue; }
+        rec[n].ip = t->slot[i].ip;
+        rec[n].added = t->slot[i].added;
+        memcpy(rec[n].mac, t->slot[i].mac, ETHER_ADDR_LEN);
+        n++;
+    }
+    sr_arpcache_unlock(cache);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SR_ARPSNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = SR_ARPSNAP_VERSION;
+    hdr.byte_order = 0x01020304;
+    hdr.count = n;
+    hdr.saved = time(NULL);
+    hdr.checksum = sr_arpsnap_checksum(rec, n);
+
+    if ((tmp = malloc(strlen(filename) + 5)) == NULL)
+    {
+        free(rec);
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", filename);
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        free(rec);
+        free(tmp);
+        return -1;
+    }
+
+    /* header then records, retrying short and interrupted writes */
+    for (i = 0; i < 2; i++)
+    {
+        p = i == 0 ? (const char *)&hdr : (const char *)rec;
+        len = i == 0 ? sizeof(hdr) : (size_t)n * sizeof(struct sr_arpsnap_rec);
+        while (len > 0)
+        {
+            if ((ret = write(fd, p, len)) < 0)
+            {
+                if (errno == EINTR)
+                { continue; }
+                break;
+            }
+            p += ret;
+            len -= ret;
+        }
+        if (len > 0)
+        { break; }
+    }
+
+    if (i < 2 || fsync(fd) != 0 || close(fd) != 0 || rename(tmp, filename) != 0)
+    {
+        err = errno;
+        close(fd);
+        unlink(tmp);
+        free(rec);
+        free(tmp);
+        errno = err;
+        return -1;
+    }
+
+    free(rec);
+    free(tmp);
+    return 0;
+}
+
+/*
+  Restores the entries of a checkpoint still within their lifetime. An
+  entry keeps the time() it was learned at, and its timer is armed as
+  though it had been running since, so it refreshes and expires when it
+  would have had the router not restarted. One from the future, the
+  clock having been set back, counts as learned now.
+*/
+int sr_arpcache_load(struct sr_arpcache *cache, const char *filename)
+{
+    struct sr_arpsnap_hdr hdr;
+    struct sr_arpsnap_rec *rec = NULL;
+    const char *err = NULL;
+    struct stat st;
+    uint64_t born, now_ms;
+    time_t now, age;
+    uint32_t i, added;
+    int fd, n = 0;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "rb")) == NULL)
+    {
+        if (errno != ENOENT)
+        { perror(filename); }
+        return -1;
+    }
+    fd = fileno(fp);
+
+    if (fstat(fd, &st) != 0 || fread(&hdr, sizeof(hdr), 1, fp) != 1)
+    { err = "not an ARP checkpoint, too short"; }
+    else if (memcmp(hdr.magic, SR_ARPSNAP_MAGIC, sizeof(hdr.magic)) != 0)
+    { err = "not an ARP checkpoint"; }
+    else if (hdr.version != SR_ARPSNAP_VERSION || hdr.byte_order != 0x01020304)
+    { err = "checkpoint written by an incompatible build"; }
+    else if ((uint64_t)st.st_size != sizeof(hdr) + (uint64_t)hdr.count * sizeof(struct sr_arpsnap_rec))
+    { err = "checkpoint truncated or corrupt"; }
+    else if ((rec = malloc(hdr.count ? (size_t)hdr.count * sizeof(struct sr_arpsnap_rec) : 1)) == NULL ||
+             fread(rec, sizeof(struct sr_arpsnap_rec), hdr.count, fp) != hdr.count)
+    { err = "checkpoint unreadable"; }
+    else if (sr_arpsnap_checksum(rec, hdr.count) != hdr.checksum)
+    { err = "checkpoint checksum mismatch"; }
+    fclose(fp);
+
+    if (err != NULL)
+    {
+        fprintf(stderr, "%s: %s\n", filename, err);
+        free(rec);
+        return -1;
+    }
+
+    now = time(NULL);
+    now_ms = sr_timer_now();
+
+    sr_arpcache_lock(cache);
+    for (i = 0; i < hdr.count; i++)
+    {
+        added = rec[i].added;
+        age = now - (time_t)added;
+        if (age < 0)
+        {
+            added = now;
+            age = 0;
+        }
+        if (rec[i].ip == 0 || age >= (time_t)SR_ARPCACHE_TO)
+        { continue; }
+
+        born = now_ms > (uint64_t)age * 1000 ? now_ms - (uint64_t)age * 1000 : 0;
+        sr_arpcache_put(cache, rec[i].mac, rec[i].ip, added, born);
+        n++;
+    }
+    sr_arpcache_unlock(cache);
+
+    free(rec);
+    return n;
 }
 
 /* Initialize table + table lock. Returns 0 on success. */
 int sr_arpcache_init(struct sr_arpcache *cache)
 {
-    /* Seed RNG to kick out a random entry if all entries full. */
-    srand(time(NULL));
+    int i;
 
     /* Invalidate all entries */
-    memset(cache->entries, 0, sizeof(cache->entries));
-    cache->requests = NULL;
+    cache->table = sr_arptable_alloc(SR_ARPCACHE_SZ);
+    if (cache->table == NULL)
+        return -1;
+    cache->retired = NULL;
+    cache->seq = 0;
+    cache->count = 0;
+    cache->evictions = 0;
+    memset(cache->requests, 0, sizeof(cache->requests));
+    sr_slab_init(&(cache->req_pool), sizeof(struct sr_arpreq), SR_ARPCACHE_POOL_CHUNK, SR_ARPREQ_MAX);
+    sr_slab_init(&(cache->pkt_pool), sizeof(struct sr_packet), SR_ARPCACHE_POOL_CHUNK, 0);
+    cache->drops_qlen = 0;
+    cache->drops_queued = 0;
+    cache->drops_reqs = 0;
+    cache->queued = 0;
+    for (i = 0; i < SR_ARPRATE_IFS; i++)
+    {
+        cache->rate[i].stamp = sr_timer_now();
+        cache->rate[i].tokens = SR_ARPRATE_BURST * 1000;
+        cache->rate[i].deferred = NULL;
+        sr_timer_init(&(cache->rate[i].timer), sr_arprate_refill, &(cache->rate[i]));
+    }
+    cache->deferred = 0;
+    cache->suppressed = 0;
+    cache->adj = NULL;
+    cache->refreshes = 0;
+    cache->snooped = 0;
+    cache->snoop_conflicts = 0;
+    cache->snoop_skipped = 0;
+    cache->warm = NULL;
+    cache->snap = NULL;
+    cache->depth = 0;
+    cache->held_since = 0;
+    memset(&(cache->stats), 0, sizeof(cache->stats));
+    cache->work = NULL;
+    cache->work_tail = &(cache->work);
+    sr_timer_wheel_init(&(cache->wheel), cache, sr_timer_now());
+    sr_slab_init(&(cache->expiry_pool), sizeof(struct sr_arpexpiry), SR_ARPCACHE_POOL_CHUNK, 0);
+
+    /* the timer thread sleeps on a monotonic clock, like the wheel's */
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(cache->wake), &cattr);
+    pthread_condattr_destroy(&cattr);
+    pthread_mutex_init(&(cache->wake_lock), NULL);
+    cache->kicked = 0;
+    cache->stop = 0;
+    cache->wake_at = SR_TIMER_NEVER;
 
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
@@ -379,37 +1421,165 @@ int sr_arpcache_init(struct sr_arpcache *cache)
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache)
 {
+    struct sr_arptable *t, *next;
+    struct sr_arpreq *req;
+    struct sr_packet *pkt;
+    int i;
+
+    for (t = cache->retired; t != NULL; t = next)
+    {
+        next = t->next;
+        free(t);
+    }
+    free(cache->table);
+    cache->table = NULL;
+    cache->retired = NULL;
+
+    if (cache->warm != NULL)
+    {
+        free(cache->warm->ip);
+        free(cache->warm->ifindex);
+        free(cache->warm->done);
+        free(cache->warm);
+        cache->warm = NULL;
+    }
+
+    /* the pools free their objects, only frames too large for a packet
+       were allocated apart */
+    for (i = 0; i < SR_ARPREQ_HASH; i++)
+    {
+        for (req = cache->requests[i]; req != NULL; req = req->next)
+        {
+            for (pkt = req->packets; pkt != NULL; pkt = pkt->next)
+            {
+                if (pkt->pkt.buf != pkt->data)
+                    free(pkt->pkt.buf);
+            }
+        }
+        cache->requests[i] = NULL;
+    }
+    sr_slab_destroy(&(cache->req_pool));
+    sr_slab_destroy(&(cache->pkt_pool));
+    sr_slab_destroy(&(cache->expiry_pool));
+    pthread_cond_destroy(&(cache->wake));
+    pthread_mutex_destroy(&(cache->wake_lock));
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
+/* Sleeps until the monotonic ms time until, or until a timer is armed
+   before it. */
+static int sr_arpcache_sleep(struct sr_arpcache *cache, uint64_t until)
+{
+    struct timespec ts;
+    int stop;
+
+    ts.tv_sec = until / 1000;
+    ts.tv_nsec = (until % 1000) * 1000000;
+
+    pthread_mutex_lock(&(cache->wake_lock));
+    while (!cache->kicked && !cache->stop &&
+           pthread_cond_timedwait(&(cache->wake), &(cache->wake_lock), &ts) != ETIMEDOUT)
+        ;
+    cache->kicked = 0;
+    stop = cache->stop;
+    pthread_mutex_unlock(&(cache->wake_lock));
+
+    return stop;
+}
+
+/* The first caller joins the thread, any other waits for it to. */
+void sr_arpcache_stop(struct sr_arpcache *cache)
+{
+    pthread_mutex_lock(&(cache->wake_lock));
+    if (cache->stop == 0)
+    {
+        cache->stop = 1;
+        pthread_cond_signal(&(cache->wake));
+        pthread_mutex_unlock(&(cache->wake_lock));
+
+        pthread_join(cache->thread, NULL);
+
+        pthread_mutex_lock(&(cache->wake_lock));
+        cache->stop = 2;
+        pthread_cond_broadcast(&(cache->wake));
+    }
+    while (cache->stop != 2)
+    { pthread_cond_wait(&(cache->wake), &(cache->wake_lock)); }
+    pthread_mutex_unlock(&(cache->wake_lock));
+}
+
+/* Timer thread of the ARP cache. Runs the wheel, which expires entries
+   SR_ARPCACHE_TO seconds after they were added and retransmits and
+   gives up on requests, then sends what the timers decided with the
+   lock dropped. Sleeps until the next timer is due, or for at most a
+   second, which is how often the adjacency and negative caches are
+   swept. Exits when woken by sr_arpcache_stop. */
 void *sr_arpcache_timeout(void *sr_ptr)
 {
     struct sr_instance *sr = sr_ptr;
     struct sr_arpcache *cache = &(sr->cache);
+    struct sr_arptable *retired, *next;
+    struct sr_arpwork *work;
+    uint64_t now, wake, swept = 0, saved;
+
+    /* the timers look up routes; stay offline while sleeping so FIB
+       updates never wait on this thread */
+    sr_rcu_register_thread();
+    saved = sr_timer_now();
 
     while (1)
     {
-        sleep(1.0);
+        now = sr_timer_now();
+        if (now - swept >= 1000)
+        {
+            sr_adj_sweep(&(sr->adj), time(NULL));
+            sr_ncache_sweep(&(sr->ncache), time(NULL));
+            swept = now;
+        }
+        if (cache->snap != NULL && now - saved >= SR_ARPSNAP_INTERVAL)
+        {
+            /* file I/O, offline so FIB updates do not wait on the disk */
+            sr_rcu_thread_offline();
+            if (sr_arpcache_save(cache, cache->snap) != 0)
+            { perror(cache->snap); }
+            sr_rcu_thread_online();
+            saved = now;
+        }
 
-        pthread_mutex_lock(&(cache->lock));
+        sr_arpcache_lock(cache);
+
+        sr_timer_run(&(cache->wheel), now);
+        work = sr_arpcache_take_work(cache);
+
+        wake = sr_timer_next(&(cache->wheel));
+        if (wake > swept + 1000)
+        { wake = swept + 1000; }
+        cache->wake_at = wake;
 
-        time_t curtime = time(NULL);
+        retired = cache->retired;
+        cache->retired = NULL;
 
-        int i;
-        for (i = 0; i < SR_ARPCACHE_SZ; i++)
+        sr_arpcache_unlock(cache);
+
+        sr_arpcache_work(sr, work);
+
+        /* tables replaced by growth, once no reader can be probing them */
+        if (retired != NULL)
         {
-            if ((cache->entries[i].valid) && (difftime(curtime, cache->entries[i].added) > SR_ARPCACHE_TO))
+            sr_rcu_synchronize();
+            for (; retired != NULL; retired = next)
             {
-                cache->entries[i].valid = 0;
+                next = retired->next;
+                free(retired);
             }
         }
 
-        sr_arpcache_sweepreqs(sr);
-
-        pthread_mutex_unlock(&(cache->lock));
+        sr_rcu_thread_offline();
+        if (sr_arpcache_sleep(cache, wake))
+        { break; }
+        sr_rcu_thread_online();
     }
 
+    sr_rcu_unregister_thread();
     return NULL;
 }
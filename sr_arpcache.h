@@ -61,6 +61,19 @@
    Since handle_arpreq as defined in the comments above could destroy your
    current request, make sure to save the next pointer before calling
    handle_arpreq when traversing through the ARP requests linked list.
+
+   --
+
+   This router does without the sweep: each request carries a timer on
+   the cache's wheel (sr_timer.h) that fires when the next request is
+   due, and each entry an expiry timer, so the cost follows what is due
+   rather than the size of the table.
+
+   Broadcasts are paced per interface by a token bucket of SR_ARPRATE
+   requests a second and SR_ARPRATE_BURST at once.  A request with no
+   token left waits on its interface, and as tokens come back the
+   requests with the most packets queued go first; one that waits out
+   the whole retry schedule is given up on without being sent.
  */
 
 #ifndef SR_ARPCACHE_H
@@ -71,15 +84,39 @@
 #include <pthread.h>
 #include "sr_if.h"
 #include "sr_utils.h"
+#include "sr_timer.h"
+#include "sr_slab.h"
+#include "sr_pkt.h"
 
-#define SR_ARPCACHE_SZ    100  
+#define SR_ARPCACHE_SZ    128      /* initial slots, a power of two */
+#define SR_ARPCACHE_MAX   65536    /* slots the table grows to at most */
+#define SR_ARPCACHE_EVICT_SCAN 8   /* entries CLOCK looks at to evict one */
 #define SR_ARPCACHE_TO    15.0
-
+#define SR_ARPCACHE_REFRESH 0.75   /* of SR_ARPCACHE_TO, when a used entry is
+                                      asked for again */
+#define SR_ARPCACHE_PROBES 2       /* unicast requests before it expires */
+#define SR_ARPWARM_GAP     5        /* ms between warm-up requests */
+#define SR_ARPSNOOP_FRESH  (SR_ARPCACHE_TO / 2)  /* seconds an entry is left
+                                                    alone by snooping */
+#define SR_ARPREQ_INTERVAL 1000    /* ms between ARP requests for an IP */
+#define SR_ARPREQ_TRIES   5        /* requests before giving up */
+#define SR_ARPREQ_HASH    1024     /* buckets of the request index, power of two */
+#define SR_ARPREQ_MAX     1024     /* requests pending at most */
+#define SR_ARPREQ_QLEN    32       /* packets queued on a request at most */
+#define SR_ARPREQ_QUEUED_MAX 4096  /* packets queued on all requests at most */
+#define SR_PACKET_BUFSZ   1536     /* frames up to this size are kept inline */
+#define SR_ARPRATE        50       /* requests a second per interface */
+#define SR_ARPRATE_BURST  10       /* requests at once per interface */
+#define SR_ARPRATE_IFS    32       /* interfaces paced, by index */
+
+/* A packet waiting for ARP.  Comes from the cache's packet pool with
+   room for a full Ethernet frame and its headroom; a larger one gets a
+   buffer from malloc. */
 struct sr_packet {
-    uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
-    unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    struct sr_pkt pkt;          /* A raw Ethernet frame, presumably with the dest MAC empty */
+    int ifindex;                /* The outgoing interface, see sr_get_interface_by_index */
     struct sr_packet *next;
+    uint8_t data[SR_PKT_HEADROOM + SR_PACKET_BUFSZ];
 };
 
 struct sr_arpentry {
@@ -89,6 +126,18 @@ struct sr_arpentry {
     int valid;
 };
 
+/* A slot of the table: open addressing on the IP with linear probing,
+   0.0.0.0 marking a free slot.  Kept to 16 bytes so four share a cache
+   line.  The table doubles when 3/4 full; at SR_ARPCACHE_MAX slots a new
+   entry evicts by CLOCK instead, see sr_arpcache_evict. */
+struct sr_arpslot {
+    uint32_t ip;                /* IP addr in network byte order, 0 if free */
+    unsigned char mac[6];
+    uint8_t ref;                /* looked up since CLOCK passed */
+    uint8_t used;               /* looked up since last refreshed */
+    uint32_t added;             /* time() it was inserted */
+};
+
 struct sr_arpreq {
     uint32_t ip;
     time_t sent;                /* Last time this ARP request was sent. You 
@@ -96,19 +145,108 @@ struct sr_arpreq {
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
-    struct sr_arpreq *next;
+    struct sr_packet *packets;  /* List of pkts waiting on this req to finish,
+                                   oldest first */
+    struct sr_packet *last;
+    unsigned int queued;        /* packets on the list */
+    struct sr_timer timer;      /* next request, or giving up */
+    struct sr_arpreq *next;     /* in the bucket of ip */
+    int ifindex;                /* interface it is asked on, -1 to route */
+    uint64_t born;              /* ms it was made */
+    struct sr_arpreq *next_waiting; /* for a token, see struct sr_arprate */
+    int waiting;                /* on the deferred list of its interface */
+};
+
+/* Token bucket of an interface.  Tokens count in thousandths of a
+   request and come back at SR_ARPRATE a second up to SR_ARPRATE_BURST;
+   requests without one wait on deferred, unordered, until timer fires
+   for the next token. */
+struct sr_arprate {
+    uint64_t stamp;             /* ms tokens were last topped up */
+    unsigned int tokens;
+    struct sr_arpreq *deferred;
+    struct sr_timer timer;
+};
+
+/* The slots, allocated together with their size so a reader always sees
+   the two match.  Replaced when the table grows. */
+struct sr_arptable {
+    uint32_t mask;              /* slots - 1 */
+    struct sr_arptable *next;   /* replaced tables waiting to be freed */
+    struct sr_arpslot slot[1];
+};
+
+/* Time spent waiting for and holding the cache lock, in nanoseconds.
+   Holds are counted from the outermost lock of the recursive mutex. */
+struct sr_arplockstats {
+    unsigned long acquired;     /* outermost holds */
+    unsigned long contended;    /* locks that had to wait */
+    uint64_t wait_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_ns;
+    uint64_t hold_max_ns;
 };
 
+struct sr_arpwork;
+struct sr_adj_table;
+struct sr_arpwarm;
+
+/* Writers take the lock.  Readers of sr_arpcache_lookup_mac take
+   nothing: every change to the slots is made inside an odd value of seq,
+   and a reader retries if seq changed while it looked.  A replaced table
+   is freed by the timeout thread after an RCU grace period, so a reader
+   still probing it never touches freed memory. */
 struct sr_arpcache {
-    struct sr_arpentry entries[SR_ARPCACHE_SZ];
-    struct sr_arpreq *requests;
+    struct sr_arptable *table;  /* RCU protected */
+    struct sr_arptable *retired;
+    uint32_t seq;               /* odd while the slots are being changed */
+    uint32_t count;             /* slots in use, at most 3/4 of them */
+    unsigned long evictions;
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
+    int depth;                  /* of the lock, by its holder */
+    uint64_t held_since;
+    struct sr_arplockstats stats;
+
+    /* Pending requests, indexed by hash of the IP, and their packets,
+       all from pools.  Packets beyond SR_ARPREQ_QLEN for a request, or
+       SR_ARPREQ_QUEUED_MAX in all, are dropped and counted. */
+    struct sr_arpreq *requests[SR_ARPREQ_HASH];
+    struct sr_slab req_pool;
+    struct sr_slab pkt_pool;
+    unsigned long drops_qlen;
+    unsigned long drops_queued;
+    unsigned long drops_reqs;   /* no request could be made */
+    unsigned int queued;        /* packets on all requests */
+    struct sr_arprate rate[SR_ARPRATE_IFS];
+    unsigned long deferred;     /* requests that waited for a token */
+    unsigned long suppressed;   /* given up on without being sent */
+
+    /* Entry expiry and request retries, under the lock.  Timers queue
+       what they decide to send on work for the timer thread. */
+    struct sr_timer_wheel wheel;
+    struct sr_arpwork *work, **work_tail;
+    struct sr_slab expiry_pool;
+    struct sr_adj_table *adj;   /* asked whether a neighbor is in use, or NULL */
+    unsigned long refreshes;    /* unicast requests for entries in use */
+    unsigned long snooped;      /* entries learned or refreshed by snooping */
+    unsigned long snoop_conflicts; /* snooped MACs differing from the entry */
+    unsigned long snoop_skipped; /* entries too fresh, or no room */
+    struct sr_arpwarm *warm;    /* warm-up under way, or NULL */
+    const char *snap;           /* checkpointed every SR_ARPSNAP_INTERVAL
+                                   by the timer thread, or NULL */
+    uint64_t wake_at;           /* when the timer thread wakes next */
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+    int kicked;                 /* a timer was armed before wake_at */
+    int stop;                   /* the timer thread is to exit (1) or has (2),
+                                   under wake_lock */
+    pthread_t thread;           /* the timer thread, see sr_arpcache_stop */
 };
 
 
-/* Handle ARP requeset queue. This function is periodically called. */
+/* Handle ARP requeset queue. Sends the first request for req, which may
+   be NULL. */
 void sr_arpcache_handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req);
 
 
@@ -116,18 +254,75 @@ void sr_arpcache_handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req);
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
-/* Adds an ARP request to the ARP request queue. If the request is already on
-   the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+/* Copies the MAC of ip (network byte order) to mac and returns 1, or
+   returns 0 if it is not in the cache.  Takes no lock and allocates
+   nothing; the calling thread must be registered with RCU and online. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip,
+                           unsigned char *mac);
 
-   A pointer to the ARP request is returned; it should be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+/* Adds an ARP request to the ARP request queue. If the request is already on
+   the queue, adds the packet to the end of the list of packets for this
+   sr_arpreq that corresponds to this ARP request. The packet argument should
+   not be freed by the caller. ifindex is the index of the outgoing interface.
+
+   A pointer to the ARP request is returned; it should not be freed. The caller
+   can remove the ARP request from the queue by calling sr_arpreq_destroy.
+   Returns NULL if no request could be made; the packet is then dropped, as it
+   is when the queues are full. The first ARP request of a new request is
+   decided here and sent by sr_arpcache_handle_arpreq. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
                          unsigned int packet_len,
-                         char *iface);
+                         int ifindex);
+
+/* Asks for each of the n addresses in ip (network byte order) in turn,
+   out of the interface of the same index in ifindex, SR_ARPWARM_GAP
+   apart, and prints how long they took to resolve once all have
+   answered or been given up on. Returns 0, -1 if out of memory. */
+int sr_arpcache_warm(struct sr_arpcache *cache, const uint32_t *ip,
+                     const int *ifindex, int n);
+
+/* Checkpoint of the entries (sr_arpcache_save/sr_arpcache_load), so a
+   restart does not begin with an empty cache.  The file is the header
+   followed by count records.  Records keep the time() an entry was
+   learned, so a restore ages them by the wall clock.  Only valid for
+   builds with the same byte order, which byte_order checks. */
+#define SR_ARPSNAP_MAGIC    "SRARPSNP"
+#define SR_ARPSNAP_VERSION  1
+#define SR_ARPSNAP_INTERVAL 30000  /* ms between checkpoints */
+
+struct sr_arpsnap_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        /* 0x01020304 as written */
+    uint32_t count;
+    uint32_t pad;
+    int64_t saved;              /* time() it was written */
+    uint64_t checksum;          /* of the records */
+};
+
+struct sr_arpsnap_rec {
+    uint32_t ip;                /* network byte order */
+    uint32_t added;             /* time() it was learned */
+    unsigned char mac[6];
+    uint8_t pad[2];
+};
+
+/* Writes the entries to filename.  Returns 0 on success, -1 with errno
+   set. */
+int sr_arpcache_save(struct sr_arpcache *cache, const char *filename);
+
+/* Restores the entries of filename that have not expired by now.
+   Returns how many, or -1 if there is no usable checkpoint; the reason
+   is printed unless the file does not exist. */
+int sr_arpcache_load(struct sr_arpcache *cache, const char *filename);
+
+/* Learns ip at mac from a packet we did not ask for, see sr_arpcache_snoop
+   in sr_arpcache.c. Returns 1 and sets *req as sr_arpcache_insert would if
+   the entry was taken, else 0. */
+int sr_arpcache_snoop(struct sr_arpcache *cache, unsigned char *mac,
+                      uint32_t ip, int create, struct sr_arpreq **req);
 
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
@@ -144,13 +339,22 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache);
 
+/* Prints lock wait and hold times, timer counts and queue drops. */
+void sr_arpcache_dump_stats(struct sr_arpcache *cache);
+
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and the timer thread times out cache entries
+   SR_ARPCACHE_TO seconds after they were added. */
 
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
 
+/* Tells the timer thread to exit and waits for it, so nothing it sweeps
+   or looks up is freed under it.  Call before tearing the router down
+   or writing the last checkpoint; may be called from more than one
+   thread. */
+void  sr_arpcache_stop(struct sr_arpcache *cache);
+
 #endif
@@ -0,0 +1,94 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_dcache.c
+ *
+ * Description:
+ *
+ * Destination cache, see sr_dcache.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_dcache.h"
+
+static struct sr_dcache_set *sr_dcache_set(struct sr_dcache *dc, uint32_t ip)
+{
+	/* multiplicative hash, the high bits are the well mixed ones */
+	return &dc->sets[((uint32_t)(ip * 2654435761u)) >> 22 & (SR_DCACHE_SETS - 1)];
+}
+
+int sr_dcache_init(struct sr_dcache *dc)
+{
+	void *sets;
+
+	if (posix_memalign(&sets, 64, SR_DCACHE_SETS * sizeof(struct sr_dcache_set)) != 0)
+		return -1;
+
+	memset(sets, 0, SR_DCACHE_SETS * sizeof(struct sr_dcache_set));
+	dc->sets = sets;
+	dc->victim = 0;
+	dc->hits = 0;
+	dc->misses = 0;
+
+	return 0;
+}
+
+void sr_dcache_destroy(struct sr_dcache *dc)
+{
+	free(dc->sets);
+	dc->sets = NULL;
+}
+
+struct sr_dcache_entry *sr_dcache_lookup(struct sr_dcache *dc, uint32_t ip,
+										 uint32_t gen)
+{
+	struct sr_dcache_set *set = sr_dcache_set(dc, ip);
+	int i;
+
+	for (i = 0; i < SR_DCACHE_WAYS; i++)
+	{
+		if (set->way[i].ip == ip && set->way[i].gen == gen)
+		{
+			dc->hits++;
+			return &set->way[i];
+		}
+	}
+
+	dc->misses++;
+	return NULL;
+}
+
+void sr_dcache_insert(struct sr_dcache *dc, uint32_t ip, uint32_t gen,
+					  struct sr_rt *rt, struct sr_adj *adj)
+{
+	struct sr_dcache_set *set = sr_dcache_set(dc, ip);
+	struct sr_dcache_entry *e = NULL;
+	int i;
+
+	/* same destination or a stale way first, otherwise round robin */
+	for (i = 0; i < SR_DCACHE_WAYS && e == NULL; i++)
+		if (set->way[i].ip == ip || set->way[i].gen != gen)
+			e = &set->way[i];
+	if (e == NULL)
+		e = &set->way[dc->victim++ % SR_DCACHE_WAYS];
+
+	e->ip = ip;
+	e->gen = gen;
+	e->rt = rt;
+	e->adj = adj;
+}
+
+void sr_dcache_flush(struct sr_dcache *dc)
+{
+	memset(dc->sets, 0, SR_DCACHE_SETS * sizeof(struct sr_dcache_set));
+}
+
+void sr_dcache_dump_stats(struct sr_dcache *dc)
+{
+	unsigned long total = dc->hits + dc->misses;
+
+	fprintf(stderr, "destination cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+			dc->hits, dc->misses, total ? 100.0 * dc->hits / total : 0.0);
+}
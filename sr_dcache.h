@@ -0,0 +1,66 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_dcache.h
+ *
+ * Description:
+ *
+ * Destination cache in front of the route lookup.  Maps a destination IP
+ * to everything the forwarding path needs to send to it: the route and
+ * the adjacency of its next hop.  Four way set associative with each set
+ * aligned to a cache line boundary.
+ *
+ * Entries are tagged with the FIB version they were resolved against,
+ * which only grows, so any routing table change makes every older entry
+ * miss.  Next hop MACs live in the adjacency and are checked on use.
+ * Only the thread that handles packets uses the cache, so it takes no
+ * lock.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_DCACHE_H
+#define SR_DCACHE_H
+
+#include "sr_adj.h"
+
+#define SR_DCACHE_SETS 1024     /* power of two */
+#define SR_DCACHE_WAYS 4
+
+struct sr_rt;
+
+struct sr_dcache_entry {
+    uint32_t ip;                /* IP addr in network byte order */
+    uint32_t gen;               /* 0 if unused */
+    struct sr_rt *rt;
+    struct sr_adj *adj;
+};
+
+struct sr_dcache_set {
+    struct sr_dcache_entry way[SR_DCACHE_WAYS];
+} __attribute__ ((aligned (64)));
+
+struct sr_dcache {
+    struct sr_dcache_set *sets;
+    unsigned int victim;        /* replacement cursor */
+    unsigned long hits;
+    unsigned long misses;
+};
+
+int  sr_dcache_init(struct sr_dcache *dc);
+void sr_dcache_destroy(struct sr_dcache *dc);
+
+/* Returns the entry for ip if it was resolved at generation gen, else
+   NULL.  The entry may be overwritten by the next insert. */
+struct sr_dcache_entry *sr_dcache_lookup(struct sr_dcache *dc, uint32_t ip,
+                                         uint32_t gen);
+
+/* Records the resolution of ip made at generation gen. */
+void sr_dcache_insert(struct sr_dcache *dc, uint32_t ip, uint32_t gen,
+                      struct sr_rt *rt, struct sr_adj *adj);
+
+/* Empties the cache, when the adjacencies its entries point at are
+   reclaimed. */
+void sr_dcache_flush(struct sr_dcache *dc);
+
+/* Prints hit and miss counters. */
+void sr_dcache_dump_stats(struct sr_dcache *dc);
+
+#endif
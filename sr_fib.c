@@ -0,0 +1,1434 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.c
+ *
+ * Description:
+ *
+ * DIR-24-8 compiled forwarding table.  See sr_fib.h for the entry layout.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_fib.h"
+#include "sr_rcu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SR_FIB_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_masklen(uint32_t mask)
+ * Scope:  Local
+ *
+ * Prefix length of a netmask in network byte order.  Non contiguous masks
+ * are treated as their leading run of ones.
+ *
+ *---------------------------------------------------------------------*/
+static int sr_fib_masklen(uint32_t mask)
+{
+	int len = 0;
+
+	mask = ntohl(mask);
+	while (len < 32 && (mask & (0x80000000u >> len)))
+		len++;
+
+	return len;
+}
+
+/* Update side state of a FIB, see sr_fib_add/sr_fib_del.  Readers never
+   look at it. */
+
+#define SR_FIB_RT_LIVE     0
+#define SR_FIB_RT_RETIRED  1    /* deleted, readers may still hold it */
+#define SR_FIB_RT_FREE     2
+
+#define SR_FIB_IDX_TOMB    0xffffffffu
+#define SR_FIB_RECLAIM_MIN 64   /* retired slots worth a grace period */
+
+struct sr_fib_ctl
+{
+	uint32_t routes_cap;
+	unsigned char *state;       /* SR_FIB_RT_* per route slot */
+	uint32_t *index;            /* (prefix, len) to route + 1, 0 if empty */
+	uint32_t index_mask;
+	uint32_t index_used;        /* live entries and tombstones */
+	uint32_t index_live;
+	uint32_t *free_rt, nfree_rt;
+	uint32_t *retired_rt, nretired_rt;
+	uint32_t *free8, nfree8;
+	uint32_t *retired8, nretired8;
+};
+
+static void sr_fib_grace(struct sr_fib *fib);
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_tbl8_grow(struct sr_fib *fib)
+ * Scope:  Local
+ *
+ * Doubles the tbl8 array.  While the FIB is only being built it is
+ * simply realloc'd.  Once it takes updates readers may be using it, so
+ * the copy is published and the old array freed after a grace period.
+ *
+ *---------------------------------------------------------------------*/
+static int sr_fib_tbl8_grow(struct sr_fib *fib)
+{
+	struct sr_fib_ctl *ctl = fib->ctl;
+	uint32_t *tbl8, *old, *free8, *retired8;
+	uint32_t cap;
+
+	cap = fib->tbl8_cap ? fib->tbl8_cap * 2 : 64;
+	if (cap > SR_FIB_IDX_MASK + 1)
+		return -1;
+
+	if (ctl == NULL)
+	{
+		tbl8 = realloc(fib->tbl8, (size_t)cap * SR_FIB_TBL8_SZ * sizeof(uint32_t));
+		if (tbl8 == NULL)
+			return -1;
+		fib->tbl8 = tbl8;
+		fib->tbl8_cap = cap;
+		return 0;
+	}
+
+	free8 = realloc(ctl->free8, cap * sizeof(uint32_t));
+	if (free8 != NULL)
+		ctl->free8 = free8;
+	retired8 = realloc(ctl->retired8, cap * sizeof(uint32_t));
+	if (retired8 != NULL)
+		ctl->retired8 = retired8;
+	tbl8 = malloc((size_t)cap * SR_FIB_TBL8_SZ * sizeof(uint32_t));
+	if (free8 == NULL || retired8 == NULL || tbl8 == NULL)
+	{
+		free(tbl8);
+		return -1;
+	}
+
+	memcpy(tbl8, fib->tbl8, (size_t)fib->tbl8_used * SR_FIB_TBL8_SZ * sizeof(uint32_t));
+	old = fib->tbl8;
+	sr_rcu_assign_pointer(fib->tbl8, tbl8);
+	fib->tbl8_cap = cap;
+	sr_fib_grace(fib);
+	free(old);
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_tbl8_alloc(struct sr_fib *fib, uint32_t fill)
+ * Scope:  Local
+ *
+ * Takes a new tbl8 group, initialised to the entry it replaces in tbl24.
+ * Returns the group index, or -1 on allocation failure.
+ *
+ *---------------------------------------------------------------------*/
+static long sr_fib_tbl8_alloc(struct sr_fib *fib, uint32_t fill)
+{
+	struct sr_fib_ctl *ctl = fib->ctl;
+	uint32_t *grp;
+	uint32_t g;
+	int i;
+
+	if (ctl != NULL && ctl->nfree8 == 0 && ctl->nretired8 >= SR_FIB_RECLAIM_MIN)
+		sr_fib_grace(fib);
+
+	if (ctl != NULL && ctl->nfree8 > 0)
+		g = ctl->free8[--ctl->nfree8];
+	else
+	{
+		if (fib->tbl8_used == fib->tbl8_cap && sr_fib_tbl8_grow(fib) != 0)
+			return -1;
+		g = fib->tbl8_used++;
+	}
+
+	grp = fib->tbl8 + (size_t)g * SR_FIB_TBL8_SZ;
+	for (i = 0; i < SR_FIB_TBL8_SZ; i++)
+		grp[i] = fill;
+
+	return g;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_fill(uint32_t *tbl, uint32_t n, uint32_t ent, int len)
+ * Scope:  Local
+ *
+ * Writes ent over n consecutive entries that are not already covered by
+ * a route at least as long.  Keeping the first route of a given length
+ * matches the old list walk, which returned the first of duplicates.
+ *
+ *---------------------------------------------------------------------*/
+static void sr_fib_fill(uint32_t *tbl, uint32_t n, uint32_t ent, int len)
+{
+	uint32_t i, e;
+
+	for (i = 0; i < n; i++)
+	{
+		e = tbl[i];
+		if (!(e & SR_FIB_VALID) || SR_FIB_DEPTH(e) < (uint32_t)len)
+			__atomic_store_n(&tbl[i], ent, __ATOMIC_RELEASE);
+	}
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_insert(struct sr_fib *fib, uint32_t prefix, int len,
+ *                       uint32_t idx)
+ * Scope:  Local
+ *
+ * Installs route idx for prefix/len (host byte order) into the tables.
+ * Entries are written with release stores so that a FIB taking updates
+ * can be read meanwhile.  Returns 0 on success, -1 on allocation failure.
+ *
+ *---------------------------------------------------------------------*/
+static int sr_fib_insert(struct sr_fib *fib, uint32_t prefix, int len, uint32_t idx)
+{
+	uint32_t ent = SR_FIB_VALID | ((uint32_t)len << SR_FIB_DEPTH_SHIFT) | idx;
+	uint32_t first, n, i, e;
+	long grp;
+
+	if (len <= 24)
+	{
+		first = prefix >> 8;
+		n = 1u << (24 - len);
+		for (i = first; i < first + n; i++)
+		{
+			e = fib->tbl24[i];
+			if (e & SR_FIB_EXT)
+				sr_fib_fill(fib->tbl8 + (size_t)(e & SR_FIB_IDX_MASK) * SR_FIB_TBL8_SZ,
+							SR_FIB_TBL8_SZ, ent, len);
+			else
+				sr_fib_fill(fib->tbl24 + i, 1, ent, len);
+		}
+		return 0;
+	}
+
+	/* /25 to /32 go to a tbl8 group, made on first use */
+	i = prefix >> 8;
+	e = fib->tbl24[i];
+	if (!(e & SR_FIB_EXT))
+	{
+		if ((grp = sr_fib_tbl8_alloc(fib, e)) < 0)
+			return -1;
+		e = SR_FIB_EXT | (uint32_t)grp;
+		__atomic_store_n(&fib->tbl24[i], e, __ATOMIC_RELEASE);
+	}
+
+	first = prefix & 0xff;
+	n = 1u << (32 - len);
+	sr_fib_fill(fib->tbl8 + (size_t)(e & SR_FIB_IDX_MASK) * SR_FIB_TBL8_SZ + first,
+				n, ent, len);
+	return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_nhg_make(struct sr_fib *fib, ...)
+ * Scope:  Local
+ *
+ * Next hop group for routes run[0..n) of one prefix.  A group equal to
+ * one made before is shared rather than stored again; htab is an open
+ * addressing table of group + 1 over fib->nhg, sized for the build.
+ * Returns the group index, or -1 on allocation failure.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib_order
+{
+	int len;
+	uint32_t prefix;
+	uint32_t idx;
+};
+
+static long sr_fib_nhg_make(struct sr_fib *fib, const struct sr_fib_order *run, uint32_t n,
+							uint32_t *htab, uint32_t hmask, uint32_t *cap)
+{
+	struct sr_fib_nhg g, *nhg;
+	const struct sr_rt *rt;
+	const unsigned char *p;
+	uint32_t i, k, total = 0, w, h, v;
+
+	memset(&g, 0, sizeof(g));
+	g.n = n < SR_FIB_NHG_MAX ? n : SR_FIB_NHG_MAX;
+	for (i = 0; i < g.n; i++)
+	{
+		rt = &fib->routes[run[i].idx];
+		g.nh[i].gw = rt->gw;
+		/* up to the NUL only, the rest stays zero for the hash */
+		memcpy(g.nh[i].interface, rt->interface, strlen(rt->interface));
+		g.nh[i].weight = rt->weight ? rt->weight : 1;
+		total += g.nh[i].weight;
+	}
+
+	/* buckets in proportion to the weights, at least one each */
+	for (i = 0; i < g.n; i++)
+	{
+		w = g.nh[i].weight;
+		k = total <= SR_FIB_NHG_SLOTS ? w : (uint32_t)((uint64_t)w * SR_FIB_NHG_SLOTS / total);
+		for (k = k ? k : 1; k > 0 && g.nslots < SR_FIB_NHG_SLOTS; k--)
+			g.slot[g.nslots++] = i;
+	}
+
+	h = 2166136261u;
+	for (p = (const unsigned char *)&g.slot; p < (const unsigned char *)(&g + 1); p++)
+		h = (h ^ *p) * 16777619u;
+	g.hash = h ^ g.n ^ (g.nslots << 8);
+
+	for (; (v = htab[h & hmask]) != 0; h++)
+	{
+		nhg = &fib->nhg[v - 1];
+		if (nhg->hash == g.hash && nhg->n == g.n && nhg->nslots == g.nslots &&
+			memcmp(nhg->slot, g.slot, sizeof(g) - offsetof(struct sr_fib_nhg, slot)) == 0)
+		{
+			nhg->refs++;
+			return v - 1;
+		}
+	}
+
+	if (fib->nnhg == *cap)
+	{
+		*cap = *cap ? *cap * 2 : 16;
+		if ((nhg = realloc(fib->nhg, *cap * sizeof(struct sr_fib_nhg))) == NULL)
+			return -1;
+		fib->nhg = nhg;
+	}
+
+	g.refs = 1;
+	fib->nhg[fib->nnhg] = g;
+	htab[h & hmask] = ++fib->nnhg;
+	return fib->nnhg - 1;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_build(struct sr_rt *rtable)
+ * Scope:  Global
+ *
+ * Compiles the routing table list.  Routes are installed shortest prefix
+ * first so each slot ends up with its longest match.  Routes to the same
+ * prefix sort next to each other, so multipath prefixes are found on the
+ * way.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_order_cmp(const void *a, const void *b)
+{
+	const struct sr_fib_order *x = a, *y = b;
+
+	if (x->len != y->len)
+		return x->len - y->len;
+	if (x->prefix != y->prefix)
+		return (x->prefix > y->prefix) - (x->prefix < y->prefix);
+	return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+struct sr_fib *sr_fib_build(struct sr_rt *rtable)
+{
+	struct sr_fib *fib;
+	struct sr_fib_order *order = NULL;
+	struct sr_rt *rt_walker;
+	uint32_t *htab = NULL;
+	uint32_t n = 0, i, k, run, hsize = 16, nhg_cap = 0;
+	long g;
+
+	for (rt_walker = rtable; rt_walker != NULL; rt_walker = rt_walker->next)
+		n++;
+	if (n > SR_FIB_IDX_MASK)
+		return NULL;
+	while (hsize < n)
+		hsize *= 2;
+
+	fib = calloc(1, sizeof(struct sr_fib));
+	if (fib == NULL)
+		return NULL;
+
+	/* calloc'd so untouched parts of tbl24 stay unbacked */
+	fib->tbl24 = calloc(SR_FIB_TBL24_SZ, sizeof(uint32_t));
+	fib->routes = malloc((n ? n : 1) * sizeof(struct sr_rt));
+	fib->route_nhg = malloc((n ? n : 1) * sizeof(uint32_t));
+	order = malloc((n ? n : 1) * sizeof(struct sr_fib_order));
+	if (fib->tbl24 == NULL || fib->routes == NULL || fib->route_nhg == NULL || order == NULL)
+		goto fail;
+
+	for (rt_walker = rtable, i = 0; rt_walker != NULL; rt_walker = rt_walker->next, i++)
+	{
+		memcpy(&fib->routes[i], rt_walker, sizeof(struct sr_rt));
+		fib->routes[i].next = NULL;
+		fib->route_nhg[i] = SR_FIB_NHG_NONE;
+		order[i].len = sr_fib_masklen(rt_walker->mask.s_addr);
+		order[i].prefix = ntohl(rt_walker->dest.s_addr & rt_walker->mask.s_addr);
+		order[i].idx = i;
+	}
+	fib->nroutes = n;
+
+	qsort(order, n, sizeof(struct sr_fib_order), sr_fib_order_cmp);
+
+	for (i = 0; i < n; i += run)
+	{
+		for (run = 1; i + run < n && order[i + run].len == order[i].len &&
+				 order[i + run].prefix == order[i].prefix; run++)
+			;
+
+		if (run > 1)
+		{
+			if (htab == NULL && (htab = calloc(hsize, sizeof(uint32_t))) == NULL)
+				goto fail;
+			if ((g = sr_fib_nhg_make(fib, order + i, run, htab, hsize - 1, &nhg_cap)) < 0)
+				goto fail;
+			fib->route_nhg[order[i].idx] = g;
+
+			/* the other routes of the prefix live on in the group */
+			for (k = 1; k < run; k++)
+				fib->routes[order[i + k].idx].interface[0] = '\0';
+		}
+
+		if (sr_fib_insert(fib, order[i].prefix, order[i].len, order[i].idx) != 0)
+			goto fail;
+	}
+
+	free(htab);
+	free(order);
+	return fib;
+
+fail:
+	free(htab);
+	free(order);
+	sr_fib_free(fib);
+	return NULL;
+} /* -- sr_fib_build -- */
+
+void sr_fib_free(struct sr_fib *fib)
+{
+	if (fib == NULL)
+		return;
+
+	if (fib->map_base != NULL)
+	{
+		munmap(fib->map_base, fib->map_len);
+		free(fib);
+		return;
+	}
+
+	if (fib->ctl != NULL)
+	{
+		free(fib->ctl->state);
+		free(fib->ctl->index);
+		free(fib->ctl->free_rt);
+		free(fib->ctl->retired_rt);
+		free(fib->ctl->free8);
+		free(fib->ctl->retired8);
+		free(fib->ctl);
+	}
+
+	free(fib->tbl24);
+	free(fib->tbl8);
+	free(fib->routes);
+	free(fib->route_nhg);
+	free(fib->nhg);
+	free(fib);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup(const struct sr_fib *fib, uint32_t ip)
+ * Scope:  Global
+ *
+ * Longest prefix match for ip (network byte order).  The tbl8 and route
+ * arrays are loaded after the entry that refers into them, since an
+ * update may have grown them.
+ *
+ *---------------------------------------------------------------------*/
+struct sr_rt *sr_fib_lookup(const struct sr_fib *fib, uint32_t ip)
+{
+	const uint32_t *tbl8;
+	uint32_t e;
+
+	ip = ntohl(ip);
+	e = __atomic_load_n(&fib->tbl24[ip >> 8], __ATOMIC_ACQUIRE);
+	if (e & SR_FIB_EXT)
+	{
+		tbl8 = sr_rcu_dereference(fib->tbl8);
+		e = __atomic_load_n(&tbl8[(size_t)(e & SR_FIB_IDX_MASK) * SR_FIB_TBL8_SZ + (ip & 0xff)],
+							__ATOMIC_ACQUIRE);
+	}
+
+	if (!(e & SR_FIB_VALID))
+		return NULL;
+
+	return &sr_rcu_dereference(fib->routes)[e & SR_FIB_IDX_MASK];
+}
+
+struct sr_rt *sr_fib_route(const struct sr_fib *fib, nexthop_t nh)
+{
+	if (nh == SR_FIB_NO_ROUTE)
+		return NULL;
+
+	return &sr_rcu_dereference(fib->routes)[nh];
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_flow(const struct sr_fib *fib, uint32_t ip,
+ *                            uint32_t flow, int *multipath)
+ * Scope:  Global
+ *
+ * Longest prefix match, then the bucket of the route's next hop group
+ * the flow hash falls in.  The hash is scaled onto the buckets with a
+ * multiply rather than a modulo.
+ *
+ *---------------------------------------------------------------------*/
+struct sr_rt *sr_fib_lookup_flow(const struct sr_fib *fib, uint32_t ip,
+								 uint32_t flow, int *multipath)
+{
+	const struct sr_fib_nhg *g;
+	const uint32_t *tbl8;
+	uint32_t e, idx, gi;
+
+	if (multipath != NULL)
+		*multipath = 0;
+
+	ip = ntohl(ip);
+	e = __atomic_load_n(&fib->tbl24[ip >> 8], __ATOMIC_ACQUIRE);
+	if (e & SR_FIB_EXT)
+	{
+		tbl8 = sr_rcu_dereference(fib->tbl8);
+		e = __atomic_load_n(&tbl8[(size_t)(e & SR_FIB_IDX_MASK) * SR_FIB_TBL8_SZ + (ip & 0xff)],
+							__ATOMIC_ACQUIRE);
+	}
+
+	if (!(e & SR_FIB_VALID))
+		return NULL;
+
+	idx = e & SR_FIB_IDX_MASK;
+	gi = sr_rcu_dereference(fib->route_nhg)[idx];
+	if (gi == SR_FIB_NHG_NONE)
+		return &sr_rcu_dereference(fib->routes)[idx];
+
+	if (multipath != NULL)
+		*multipath = 1;
+	g = &fib->nhg[gi];
+	return (struct sr_rt *)&g->nh[g->slot[((uint64_t)flow * g->nslots) >> 32]];
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_burst_scalar(...)
+ * Scope:  Global
+ *
+ * Portable burst lookup.  All tbl24 lines of the burst are prefetched
+ * before the first one is read, and tbl8 lines are prefetched as soon as
+ * their group is known, so the misses of a burst overlap instead of
+ * being paid one after the other.
+ *
+ *---------------------------------------------------------------------*/
+void sr_fib_lookup_burst_scalar(const struct sr_fib *fib, const uint32_t *dsts,
+								int n, nexthop_t *out)
+{
+	uint32_t ip[SR_FIB_BURST_MAX];
+	uint32_t e[SR_FIB_BURST_MAX];
+	const uint32_t *tbl8;
+	int i, j, m;
+
+	for (j = 0; j < n; j += m)
+	{
+		m = n - j < SR_FIB_BURST_MAX ? n - j : SR_FIB_BURST_MAX;
+
+		for (i = 0; i < m; i++)
+		{
+			ip[i] = ntohl(dsts[j + i]);
+			__builtin_prefetch(&fib->tbl24[ip[i] >> 8]);
+		}
+
+		for (i = 0; i < m; i++)
+			e[i] = __atomic_load_n(&fib->tbl24[ip[i] >> 8], __ATOMIC_RELAXED);
+
+		/* as in sr_fib_lookup, tbl8 is loaded after the entries */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tbl8 = sr_rcu_dereference(fib->tbl8);
+
+		for (i = 0; i < m; i++)
+			if (e[i] & SR_FIB_EXT)
+				__builtin_prefetch(&tbl8[(size_t)(e[i] & SR_FIB_IDX_MASK) * SR_FIB_TBL8_SZ
+										 + (ip[i] & 0xff)]);
+
+		for (i = 0; i < m; i++)
+		{
+			if (e[i] & SR_FIB_EXT)
+				e[i] = __atomic_load_n(&tbl8[(size_t)(e[i] & SR_FIB_IDX_MASK) * SR_FIB_TBL8_SZ
+											 + (ip[i] & 0xff)], __ATOMIC_RELAXED);
+			out[j + i] = (e[i] & SR_FIB_VALID) ? (e[i] & SR_FIB_IDX_MASK) : SR_FIB_NO_ROUTE;
+		}
+	}
+}
+
+#ifdef SR_FIB_HAVE_AVX2
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_burst_avx2(...)
+ * Scope:  Local
+ *
+ * Eight lookups per iteration: byte swap, one gather from tbl24, and a
+ * masked gather from tbl8 for the lanes that need it.  The next block's
+ * tbl24 lines are prefetched while the current one is gathered.
+ *
+ *---------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static void sr_fib_lookup_burst_avx2(const struct sr_fib *fib, const uint32_t *dsts,
+									 int n, nexthop_t *out)
+{
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+										   3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i valid = _mm256_set1_epi32((int)SR_FIB_VALID);
+	const __m256i ext = _mm256_set1_epi32(SR_FIB_EXT);
+	const __m256i idx = _mm256_set1_epi32(SR_FIB_IDX_MASK);
+	const __m256i low = _mm256_set1_epi32(0xff);
+	const __m256i none = _mm256_set1_epi32((int)SR_FIB_NO_ROUTE);
+	__m256i ip, e, e8, isext, i8;
+	const uint32_t *tbl8;
+	int i, k;
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		if (i + 16 <= n)
+			for (k = 8; k < 16; k++)
+				_mm_prefetch((const char *)&fib->tbl24[ntohl(dsts[i + k]) >> 8], _MM_HINT_T0);
+
+		ip = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(dsts + i)), bswap);
+		e = _mm256_i32gather_epi32((const int *)fib->tbl24, _mm256_srli_epi32(ip, 8), 4);
+
+		isext = _mm256_cmpeq_epi32(_mm256_and_si256(e, ext), ext);
+		if (!_mm256_testz_si256(isext, isext))
+		{
+			/* as in sr_fib_lookup, tbl8 is loaded after the entries: a
+			   group index from a new entry may lie past the old array */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			tbl8 = sr_rcu_dereference(fib->tbl8);
+
+			i8 = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(e, idx), 8),
+								 _mm256_and_si256(ip, low));
+			e8 = _mm256_mask_i32gather_epi32(e, (const int *)tbl8, i8, isext, 4);
+			e = e8;
+		}
+
+		e = _mm256_blendv_epi8(none, _mm256_and_si256(e, idx),
+							   _mm256_cmpeq_epi32(_mm256_and_si256(e, valid), valid));
+		_mm256_storeu_si256((__m256i *)(out + i), e);
+	}
+
+	if (i < n)
+		sr_fib_lookup_burst_scalar(fib, dsts + i, n - i, out + i);
+}
+#endif /* SR_FIB_HAVE_AVX2 */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_burst(...)
+ * Scope:  Global
+ *
+ * Dispatches to the best implementation for this CPU, decided once from
+ * CPUID on first use.
+ *
+ *---------------------------------------------------------------------*/
+
+typedef void (*sr_fib_burst_fn)(const struct sr_fib *, const uint32_t *, int, nexthop_t *);
+
+static sr_fib_burst_fn sr_fib_burst = NULL;
+static const char *sr_fib_burst_name = NULL;
+
+static void sr_fib_burst_select(void)
+{
+#ifdef SR_FIB_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		sr_fib_burst_name = "avx2";
+		sr_fib_burst = sr_fib_lookup_burst_avx2;
+		return;
+	}
+#endif
+	sr_fib_burst_name = "scalar";
+	sr_fib_burst = sr_fib_lookup_burst_scalar;
+}
+
+void sr_fib_lookup_burst(const struct sr_fib *fib, const uint32_t *dsts,
+						 int n, nexthop_t *out)
+{
+	if (sr_fib_burst == NULL)
+		sr_fib_burst_select();
+
+#ifdef SR_FIB_HAVE_AVX2
+	/* the gathers take signed 32 bit indexes */
+	if ((size_t)fib->tbl8_cap * SR_FIB_TBL8_SZ > 0x7fffffff)
+	{
+		sr_fib_lookup_burst_scalar(fib, dsts, n, out);
+		return;
+	}
+#endif
+
+	sr_fib_burst(fib, dsts, n, out);
+}
+
+const char *sr_fib_burst_impl(void)
+{
+	if (sr_fib_burst == NULL)
+		sr_fib_burst_select();
+
+	return sr_fib_burst_name;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_grace(struct sr_fib *fib)
+ * Scope:  Local
+ *
+ * Waits for a grace period, after which nothing retired before the call
+ * can still be referenced by a reader, and moves it to the free lists.
+ * The version is bumped first so that route pointers cached against the
+ * old version (sr_dcache) are not handed out again.
+ *
+ *---------------------------------------------------------------------*/
+static void sr_fib_grace(struct sr_fib *fib)
+{
+	struct sr_fib_ctl *ctl = fib->ctl;
+	uint32_t idx;
+
+	__atomic_add_fetch(&fib->version, 1, __ATOMIC_RELEASE);
+	sr_rcu_synchronize();
+
+	while (ctl->nretired_rt > 0)
+	{
+		idx = ctl->retired_rt[--ctl->nretired_rt];
+		ctl->state[idx] = SR_FIB_RT_FREE;
+		fib->routes[idx].interface[0] = '\0';
+		ctl->free_rt[ctl->nfree_rt++] = idx;
+	}
+
+	while (ctl->nretired8 > 0)
+		ctl->free8[ctl->nfree8++] = ctl->retired8[--ctl->nretired8];
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_route_alloc(struct sr_fib *fib)
+ * Scope:  Local
+ *
+ * Takes a free route slot, growing the route array like tbl8 when none
+ * is left.  Returns the slot, or -1 on allocation failure.
+ *
+ *---------------------------------------------------------------------*/
+static long sr_fib_route_alloc(struct sr_fib *fib)
+{
+	struct sr_fib_ctl *ctl = fib->ctl;
+	struct sr_rt *routes, *old;
+	unsigned char *state;
+	uint32_t *free_rt, *retired_rt, *route_nhg, *old_nhg;
+	uint32_t cap;
+
+	if (ctl->nfree_rt == 0 && ctl->nretired_rt >= SR_FIB_RECLAIM_MIN)
+		sr_fib_grace(fib);
+
+	if (ctl->nfree_rt > 0)
+		return ctl->free_rt[--ctl->nfree_rt];
+
+	if (fib->nroutes == ctl->routes_cap)
+	{
+		cap = ctl->routes_cap ? ctl->routes_cap * 2 : 64;
+		if (cap > SR_FIB_IDX_MASK + 1)
+			return -1;
+
+		state = realloc(ctl->state, cap);
+		if (state != NULL)
+			ctl->state = state;
+		free_rt = realloc(ctl->free_rt, cap * sizeof(uint32_t));
+		if (free_rt != NULL)
+			ctl->free_rt = free_rt;
+		retired_rt = realloc(ctl->retired_rt, cap * sizeof(uint32_t));
+		if (retired_rt != NULL)
+			ctl->retired_rt = retired_rt;
+		routes = malloc((size_t)cap * sizeof(struct sr_rt));
+		route_nhg = malloc((size_t)cap * sizeof(uint32_t));
+		if (state == NULL || free_rt == NULL || retired_rt == NULL || routes == NULL ||
+			route_nhg == NULL)
+		{
+			free(routes);
+			free(route_nhg);
+			return -1;
+		}
+
+		memcpy(routes, fib->routes, (size_t)fib->nroutes * sizeof(struct sr_rt));
+		memcpy(route_nhg, fib->route_nhg, (size_t)fib->nroutes * sizeof(uint32_t));
+		old = fib->routes;
+		old_nhg = fib->route_nhg;
+		sr_rcu_assign_pointer(fib->routes, routes);
+		sr_rcu_assign_pointer(fib->route_nhg, route_nhg);
+		ctl->routes_cap = cap;
+		sr_fib_grace(fib);
+		free(old);
+		free(old_nhg);
+	}
+
+	ctl->state[fib->nroutes] = SR_FIB_RT_FREE;
+	return fib->nroutes++;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_index_*(...)
+ * Scope:  Local
+ *
+ * Open addressing index from (prefix, len) to route slot, so updates
+ * find the route they replace, and the route a deleted prefix falls back
+ * to, without a walk of the routes.  The key is taken from the route
+ * itself.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_fib_lenmask(int len)
+{
+	return len ? ~0u << (32 - len) : 0;
+}
+
+static uint32_t sr_fib_index_hash(uint32_t prefix, int len)
+{
+	uint32_t h = (prefix ^ (uint32_t)len) * 0x9e3779b1u;
+
+	return h ^ (h >> 15);
+}
+
+static uint32_t *sr_fib_index_find(const struct sr_fib *fib, uint32_t prefix, int len)
+{
+	const struct sr_fib_ctl *ctl = fib->ctl;
+	const struct sr_rt *rt;
+	uint32_t h, v;
+
+	for (h = sr_fib_index_hash(prefix, len); (v = ctl->index[h & ctl->index_mask]) != 0; h++)
+	{
+		if (v == SR_FIB_IDX_TOMB)
+			continue;
+		rt = &fib->routes[v - 1];
+		if (sr_fib_masklen(rt->mask.s_addr) == len &&
+			ntohl(rt->dest.s_addr & rt->mask.s_addr) == prefix)
+			return &ctl->index[h & ctl->index_mask];
+	}
+
+	return NULL;
+}
+
+/* Adds a key known not to be present; sr_fib_index_reserve made room */
+static void sr_fib_index_add(struct sr_fib *fib, uint32_t idx)
+{
+	struct sr_fib_ctl *ctl = fib->ctl;
+	const struct sr_rt *rt = &fib->routes[idx];
+	uint32_t h, v;
+
+	h = sr_fib_index_hash(ntohl(rt->dest.s_addr & rt->mask.s_addr), sr_fib_masklen(rt->mask.s_addr));
+	while ((v = ctl->index[h & ctl->index_mask]) != 0 && v != SR_FIB_IDX_TOMB)
+		h++;
+
+	if (v == 0)
+		ctl->index_used++;
+	ctl->index[h & ctl->index_mask] = idx + 1;
+	ctl->index_live++;
+}
+
+/* Makes sure one more key fits at no more than half load, rehashing
+   without the tombstones when it does not */
+static int sr_fib_index_reserve(struct sr_fib *fib)
+{
+	struct sr_fib_ctl *ctl = fib->ctl;
+	uint32_t *old = ctl->index;
+	uint32_t size = 64, old_size = ctl->index ? ctl->index_mask + 1 : 0;
+	uint32_t i;
+
+	if (old != NULL && (ctl->index_used + 1) * 2 <= old_size)
+		return 0;
+
+	while (size < (ctl->index_live + 1) * 4)
+		size *= 2;
+	if ((ctl->index = calloc(size, sizeof(uint32_t))) == NULL)
+	{
+		ctl->index = old;
+		return -1;
+	}
+	ctl->index_mask = size - 1;
+	ctl->index_used = ctl->index_live = 0;
+
+	for (i = 0; i < old_size; i++)
+		if (old[i] != 0 && old[i] != SR_FIB_IDX_TOMB)
+			sr_fib_index_add(fib, old[i] - 1);
+
+	free(old);
+	return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_ctl_init(struct sr_fib *fib)
+ * Scope:  Local
+ *
+ * Sets up the update state of a built FIB.  Of duplicate prefixes only
+ * the first is installed in the tables, the others become free slots.
+ *
+ *---------------------------------------------------------------------*/
+static int sr_fib_ctl_init(struct sr_fib *fib)
+{
+	struct sr_fib_ctl *ctl;
+	const struct sr_rt *rt;
+	uint32_t n = fib->nroutes, i;
+
+	if ((ctl = calloc(1, sizeof(struct sr_fib_ctl))) == NULL)
+		return -1;
+	fib->ctl = ctl;
+
+	ctl->routes_cap = n;
+	ctl->state = malloc(n ? n : 1);
+	ctl->free_rt = malloc((n ? n : 1) * sizeof(uint32_t));
+	ctl->retired_rt = malloc((n ? n : 1) * sizeof(uint32_t));
+	ctl->free8 = malloc((fib->tbl8_cap ? fib->tbl8_cap : 1) * sizeof(uint32_t));
+	ctl->retired8 = malloc((fib->tbl8_cap ? fib->tbl8_cap : 1) * sizeof(uint32_t));
+	ctl->index_live = n;
+	if (ctl->state == NULL || ctl->free_rt == NULL || ctl->retired_rt == NULL ||
+		ctl->free8 == NULL || ctl->retired8 == NULL || sr_fib_index_reserve(fib) != 0)
+		goto fail;
+
+	for (i = 0; i < n; i++)
+	{
+		rt = &fib->routes[i];
+		if (rt->interface[0] == '\0' ||
+			sr_fib_index_find(fib, ntohl(rt->dest.s_addr & rt->mask.s_addr),
+							  sr_fib_masklen(rt->mask.s_addr)) != NULL)
+		{
+			ctl->state[i] = SR_FIB_RT_FREE;
+			ctl->free_rt[ctl->nfree_rt++] = i;
+			continue;
+		}
+		ctl->state[i] = SR_FIB_RT_LIVE;
+		sr_fib_index_add(fib, i);
+	}
+
+	return 0;
+
+fail:
+	free(ctl->state);
+	free(ctl->index);
+	free(ctl->free_rt);
+	free(ctl->retired_rt);
+	free(ctl->free8);
+	free(ctl->retired8);
+	free(ctl);
+	fib->ctl = NULL;
+	return -1;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_repoint(struct sr_fib *fib, uint32_t prefix, int len,
+ *                        uint32_t old, uint32_t ent)
+ * Scope:  Local
+ *
+ * Replaces old by ent in the entries covered by prefix/len.  Entries of
+ * longer prefixes inside the range hold other values and are left as
+ * they are.
+ *
+ *---------------------------------------------------------------------*/
+static void sr_fib_repoint_range(uint32_t *tbl, uint32_t n, uint32_t old, uint32_t ent)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		if (tbl[i] == old)
+			__atomic_store_n(&tbl[i], ent, __ATOMIC_RELEASE);
+}
+
+static void sr_fib_repoint(struct sr_fib *fib, uint32_t prefix, int len,
+						   uint32_t old, uint32_t ent)
+{
+	uint32_t first, n, i, e;
+
+	if (len <= 24)
+	{
+		first = prefix >> 8;
+		n = 1u << (24 - len);
+		for (i = first; i < first + n; i++)
+		{
+			e = fib->tbl24[i];
+			if (e & SR_FIB_EXT)
+				sr_fib_repoint_range(fib->tbl8 + (size_t)(e & SR_FIB_IDX_MASK) * SR_FIB_TBL8_SZ,
+									 SR_FIB_TBL8_SZ, old, ent);
+			else
+				sr_fib_repoint_range(fib->tbl24 + i, 1, old, ent);
+		}
+		return;
+	}
+
+	e = fib->tbl24[prefix >> 8];
+	assert(e & SR_FIB_EXT);
+	sr_fib_repoint_range(fib->tbl8 + (size_t)(e & SR_FIB_IDX_MASK) * SR_FIB_TBL8_SZ
+						 + (prefix & 0xff), 1u << (32 - len), old, ent);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_collapse(struct sr_fib *fib, uint32_t i)
+ * Scope:  Local
+ *
+ * Folds the tbl8 group of tbl24 slot i back into the slot once it holds
+ * no prefix longer than /24; all its entries are then the same.
+ *
+ *---------------------------------------------------------------------*/
+static void sr_fib_collapse(struct sr_fib *fib, uint32_t i)
+{
+	struct sr_fib_ctl *ctl = fib->ctl;
+	uint32_t e = fib->tbl24[i], g, k;
+	const uint32_t *grp;
+
+	if (!(e & SR_FIB_EXT))
+		return;
+
+	g = e & SR_FIB_IDX_MASK;
+	grp = fib->tbl8 + (size_t)g * SR_FIB_TBL8_SZ;
+	for (k = 0; k < SR_FIB_TBL8_SZ; k++)
+		if ((grp[k] & SR_FIB_VALID) && SR_FIB_DEPTH(grp[k]) > 24)
+			return;
+
+	__atomic_store_n(&fib->tbl24[i], grp[0], __ATOMIC_RELEASE);
+	ctl->retired8[ctl->nretired8++] = g;
+}
+
+/* Route slot idx is no longer installed.  Next hop groups only come from
+   sr_fib_build and stay until the FIB is freed, refs just counts users. */
+static void sr_fib_route_retire(struct sr_fib *fib, uint32_t idx)
+{
+	struct sr_fib_ctl *ctl = fib->ctl;
+
+	if (fib->route_nhg[idx] != SR_FIB_NHG_NONE)
+		fib->nhg[fib->route_nhg[idx]].refs--;
+
+	ctl->state[idx] = SR_FIB_RT_RETIRED;
+	ctl->retired_rt[ctl->nretired_rt++] = idx;
+}
+
+#define SR_FIB_ENTRY(len, idx) \
+	(SR_FIB_VALID | ((uint32_t)(len) << SR_FIB_DEPTH_SHIFT) | (idx))
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add(...)
+ * Scope:  Global
+ *
+ * A new route gets a slot of its own and is installed like a route of
+ * the build.  A replacement is written to a fresh slot and the entries
+ * of the old one are repointed, so a reader sees either route whole.
+ *
+ *---------------------------------------------------------------------*/
+int sr_fib_add(struct sr_fib *fib, struct in_addr dest, int len,
+			   struct in_addr gw, const char *iface)
+{
+	struct sr_fib_ctl *ctl;
+	struct sr_rt *rt;
+	uint32_t prefix, *slot, old;
+	long idx;
+
+	assert(fib->map_base == NULL);
+
+	if (len < 0 || len > 32 || iface == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if ((fib->ctl == NULL && sr_fib_ctl_init(fib) != 0) || sr_fib_index_reserve(fib) != 0 ||
+		(idx = sr_fib_route_alloc(fib)) < 0)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	ctl = fib->ctl;
+
+	prefix = ntohl(dest.s_addr) & sr_fib_lenmask(len);
+	rt = &fib->routes[idx];
+	memset(rt, 0, sizeof(struct sr_rt));
+	rt->dest.s_addr = htonl(prefix);
+	rt->mask.s_addr = htonl(sr_fib_lenmask(len));
+	rt->gw = gw;
+	strncpy(rt->interface, iface, sr_IFACE_NAMELEN - 1);
+	rt->weight = 1;
+	fib->route_nhg[idx] = SR_FIB_NHG_NONE;
+
+	if ((slot = sr_fib_index_find(fib, prefix, len)) != NULL)
+	{
+		old = *slot - 1;
+		sr_fib_repoint(fib, prefix, len, SR_FIB_ENTRY(len, old), SR_FIB_ENTRY(len, idx));
+		*slot = idx + 1;
+		sr_fib_route_retire(fib, old);
+	}
+	else
+	{
+		if (sr_fib_insert(fib, prefix, len, idx) != 0)
+		{
+			ctl->free_rt[ctl->nfree_rt++] = idx;
+			errno = ENOMEM;
+			return -1;
+		}
+		sr_fib_index_add(fib, idx);
+	}
+
+	ctl->state[idx] = SR_FIB_RT_LIVE;
+	__atomic_add_fetch(&fib->version, 1, __ATOMIC_RELEASE);
+	return 0;
+} /* -- sr_fib_add -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_del(...)
+ * Scope:  Global
+ *
+ * The entries of the deleted route go to the next shorter prefix that
+ * is installed, found through the index, or become empty.
+ *
+ *---------------------------------------------------------------------*/
+int sr_fib_del(struct sr_fib *fib, struct in_addr dest, int len)
+{
+	struct sr_fib_ctl *ctl;
+	uint32_t prefix, *slot, *parent, idx, ent = 0;
+	int plen;
+
+	assert(fib->map_base == NULL);
+
+	if (len < 0 || len > 32)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (fib->ctl == NULL && sr_fib_ctl_init(fib) != 0)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	ctl = fib->ctl;
+
+	prefix = ntohl(dest.s_addr) & sr_fib_lenmask(len);
+	if ((slot = sr_fib_index_find(fib, prefix, len)) == NULL)
+	{
+		errno = ESRCH;
+		return -1;
+	}
+	idx = *slot - 1;
+
+	for (plen = len - 1; plen >= 0; plen--)
+	{
+		if ((parent = sr_fib_index_find(fib, prefix & sr_fib_lenmask(plen), plen)) != NULL)
+		{
+			ent = SR_FIB_ENTRY(plen, *parent - 1);
+			break;
+		}
+	}
+
+	sr_fib_repoint(fib, prefix, len, SR_FIB_ENTRY(len, idx), ent);
+	if (len > 24)
+		sr_fib_collapse(fib, prefix >> 8);
+
+	*slot = SR_FIB_IDX_TOMB;
+	ctl->index_live--;
+	sr_fib_route_retire(fib, idx);
+
+	__atomic_add_fetch(&fib->version, 1, __ATOMIC_RELEASE);
+	return 0;
+} /* -- sr_fib_del -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_dup(const struct sr_fib *src)
+ * Scope:  Global
+ *
+ * Heap copy of a FIB, typically a mapped snapshot about to be updated.
+ * Only the used parts of tbl24 are written so the rest stays unbacked.
+ *
+ *---------------------------------------------------------------------*/
+struct sr_fib *sr_fib_dup(const struct sr_fib *src)
+{
+	struct sr_fib *fib;
+	uint32_t i;
+
+	if ((fib = calloc(1, sizeof(struct sr_fib))) == NULL)
+		return NULL;
+
+	fib->tbl24 = calloc(SR_FIB_TBL24_SZ, sizeof(uint32_t));
+	fib->tbl8 = malloc((size_t)(src->tbl8_used ? src->tbl8_used : 1) * SR_FIB_TBL8_SZ * sizeof(uint32_t));
+	fib->routes = malloc((src->nroutes ? src->nroutes : 1) * sizeof(struct sr_rt));
+	fib->route_nhg = malloc((src->nroutes ? src->nroutes : 1) * sizeof(uint32_t));
+	fib->nhg = malloc((src->nnhg ? src->nnhg : 1) * sizeof(struct sr_fib_nhg));
+	if (fib->tbl24 == NULL || fib->tbl8 == NULL || fib->routes == NULL ||
+		fib->route_nhg == NULL || fib->nhg == NULL)
+	{
+		sr_fib_free(fib);
+		return NULL;
+	}
+
+	for (i = 0; i < SR_FIB_TBL24_SZ; i++)
+		if (src->tbl24[i] != 0)
+			fib->tbl24[i] = src->tbl24[i];
+	memcpy(fib->tbl8, src->tbl8, (size_t)src->tbl8_used * SR_FIB_TBL8_SZ * sizeof(uint32_t));
+	memcpy(fib->routes, src->routes, (size_t)src->nroutes * sizeof(struct sr_rt));
+	memcpy(fib->route_nhg, src->route_nhg, (size_t)src->nroutes * sizeof(uint32_t));
+	memcpy(fib->nhg, src->nhg, (size_t)src->nnhg * sizeof(struct sr_fib_nhg));
+	for (i = 0; i < src->nroutes; i++)
+		if (!sr_fib_route_live(src, i))
+			fib->routes[i].interface[0] = '\0';
+
+	fib->tbl8_used = fib->tbl8_cap = src->tbl8_used;
+	fib->nroutes = src->nroutes;
+	fib->nnhg = src->nnhg;
+	fib->version = src->version;
+
+	return fib;
+} /* -- sr_fib_dup -- */
+
+int sr_fib_route_live(const struct sr_fib *fib, uint32_t i)
+{
+	if (fib->ctl != NULL)
+		return fib->ctl->state[i] == SR_FIB_RT_LIVE;
+
+	/* built or mapped: only deleted slots have no interface */
+	return fib->routes[i].interface[0] != '\0';
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_checksum(const void *buf, size_t len)
+ * Scope:  Local
+ *
+ * 64 bit multiply/rotate hash over whole words; the snapshot sections
+ * are all multiples of 8 bytes long.
+ *
+ *---------------------------------------------------------------------*/
+static uint64_t sr_fib_checksum(uint64_t h, const void *buf, size_t len)
+{
+	const uint64_t *w = buf;
+	size_t i;
+
+	for (i = 0; i < len / 8; i++)
+	{
+		h = (h ^ w[i]) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+#define SR_FIB_SNAP_ALIGN 4096
+
+static uint64_t sr_fib_snap_align(uint64_t off)
+{
+	return (off + SR_FIB_SNAP_ALIGN - 1) & ~(uint64_t)(SR_FIB_SNAP_ALIGN - 1);
+}
+
+/* Lays out the sections of a snapshot of fib in hdr */
+static void sr_fib_snap_layout(const struct sr_fib *fib, struct sr_fib_snap_hdr *hdr)
+{
+	memset(hdr, 0, sizeof(struct sr_fib_snap_hdr));
+	memcpy(hdr->magic, SR_FIB_SNAP_MAGIC, sizeof(hdr->magic));
+	hdr->version = SR_FIB_SNAP_VERSION;
+	hdr->byte_order = 0x01020304;
+	hdr->rt_size = sizeof(struct sr_rt);
+	hdr->nroutes = fib->nroutes;
+	hdr->tbl8_groups = fib->tbl8_used;
+	hdr->nhg_groups = fib->nnhg;
+	hdr->routes_off = SR_FIB_SNAP_ALIGN;
+	hdr->route_nhg_off = sr_fib_snap_align(hdr->routes_off + (uint64_t)fib->nroutes * sizeof(struct sr_rt));
+	hdr->nhg_off = sr_fib_snap_align(hdr->route_nhg_off + (uint64_t)fib->nroutes * sizeof(uint32_t));
+	hdr->tbl24_off = sr_fib_snap_align(hdr->nhg_off + (uint64_t)fib->nnhg * sizeof(struct sr_fib_nhg));
+	hdr->tbl8_off = hdr->tbl24_off + (uint64_t)SR_FIB_TBL24_SZ * sizeof(uint32_t);
+	hdr->file_len = hdr->tbl8_off + (uint64_t)fib->tbl8_used * SR_FIB_TBL8_SZ * sizeof(uint32_t);
+}
+
+static int sr_fib_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		if ((ret = write(fd, p, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_save(const struct sr_fib *fib, const char *filename)
+ * Scope:  Global
+ *
+ * Writes a snapshot to a temporary file and renames it into place, so a
+ * reader never maps a half written snapshot.
+ *
+ *---------------------------------------------------------------------*/
+int sr_fib_save(const struct sr_fib *fib, const char *filename)
+{
+	struct sr_fib_snap_hdr hdr;
+	struct sr_rt *routes;
+	char page[SR_FIB_SNAP_ALIGN];
+	char *tmp;
+	uint64_t h;
+	size_t routes_len, tbl8_len;
+	uint32_t i;
+	int fd, err;
+
+	sr_fib_snap_layout(fib, &hdr);
+	routes_len = hdr.tbl24_off - hdr.routes_off;
+	tbl8_len = hdr.file_len - hdr.tbl8_off;
+
+	/* routes and next hop sections, zero padded, dead slots cleared */
+	if ((routes = calloc(1, routes_len ? routes_len : 1)) == NULL)
+		return -1;
+	if (fib->nroutes)
+	{
+		memcpy(routes, fib->routes, (size_t)fib->nroutes * sizeof(struct sr_rt));
+		memcpy((char *)routes + (hdr.route_nhg_off - hdr.routes_off), fib->route_nhg,
+			   (size_t)fib->nroutes * sizeof(uint32_t));
+	}
+	if (fib->nnhg)
+		memcpy((char *)routes + (hdr.nhg_off - hdr.routes_off), fib->nhg,
+			   (size_t)fib->nnhg * sizeof(struct sr_fib_nhg));
+	for (i = 0; i < fib->nroutes; i++)
+		if (!sr_fib_route_live(fib, i))
+			memset(&routes[i], 0, sizeof(struct sr_rt));
+
+	h = sr_fib_checksum(0, routes, routes_len);
+	h = sr_fib_checksum(h, fib->tbl24, (size_t)SR_FIB_TBL24_SZ * sizeof(uint32_t));
+	h = sr_fib_checksum(h, fib->tbl8, tbl8_len);
+	hdr.checksum = h;
+
+	tmp = malloc(strlen(filename) + 5);
+	if (tmp == NULL)
+	{
+		free(routes);
+		return -1;
+	}
+	sprintf(tmp, "%s.tmp", filename);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+	{
+		free(routes);
+		free(tmp);
+		return -1;
+	}
+
+	memset(page, 0, sizeof(page));
+	memcpy(page, &hdr, sizeof(hdr));
+	if (sr_fib_write(fd, page, sizeof(page)) != 0 ||
+		sr_fib_write(fd, routes, routes_len) != 0 ||
+		sr_fib_write(fd, fib->tbl24, (size_t)SR_FIB_TBL24_SZ * sizeof(uint32_t)) != 0 ||
+		sr_fib_write(fd, fib->tbl8, tbl8_len) != 0 ||
+		fsync(fd) != 0 || close(fd) != 0 || rename(tmp, filename) != 0)
+	{
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		free(routes);
+		free(tmp);
+		errno = err;
+		return -1;
+	}
+
+	free(routes);
+	free(tmp);
+	return 0;
+} /* -- sr_fib_save -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_map(const char *filename)
+ * Scope:  Global
+ *
+ * Maps a snapshot written by sr_fib_save.
+ *
+ *---------------------------------------------------------------------*/
+struct sr_fib *sr_fib_map(const char *filename)
+{
+	struct sr_fib_snap_hdr hdr, want;
+	struct sr_fib *fib;
+	struct stat st;
+	char *base;
+	const char *err = NULL;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+	{
+		perror(filename);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	if ((size_t)st.st_size < SR_FIB_SNAP_ALIGN)
+	{
+		fprintf(stderr, "%s: not a FIB snapshot, too short\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		perror("mmap");
+		return NULL;
+	}
+	memcpy(&hdr, base, sizeof(hdr));
+
+	/* what a snapshot with these counts must look like */
+	fib = calloc(1, sizeof(struct sr_fib));
+	if (fib == NULL)
+	{
+		munmap(base, st.st_size);
+		return NULL;
+	}
+	fib->nroutes = hdr.nroutes;
+	fib->tbl8_used = hdr.tbl8_groups;
+	fib->nnhg = hdr.nhg_groups;
+	sr_fib_snap_layout(fib, &want);
+
+	if (memcmp(hdr.magic, SR_FIB_SNAP_MAGIC, sizeof(hdr.magic)) != 0)
+		err = "not a FIB snapshot";
+	else if (hdr.version != SR_FIB_SNAP_VERSION)
+		err = "unsupported snapshot version";
+	else if (hdr.byte_order != want.byte_order || hdr.rt_size != want.rt_size)
+		err = "snapshot written by an incompatible build";
+	else if (hdr.nroutes > SR_FIB_IDX_MASK || hdr.tbl8_groups > SR_FIB_IDX_MASK ||
+			 hdr.routes_off != want.routes_off || hdr.route_nhg_off != want.route_nhg_off ||
+			 hdr.nhg_off != want.nhg_off || hdr.tbl24_off != want.tbl24_off ||
+			 hdr.tbl8_off != want.tbl8_off || hdr.file_len != want.file_len ||
+			 hdr.file_len != (uint64_t)st.st_size)
+		err = "snapshot truncated or corrupt";
+	else if (sr_fib_checksum(0, base + SR_FIB_SNAP_ALIGN, hdr.file_len - SR_FIB_SNAP_ALIGN)
+			 != hdr.checksum)
+		err = "snapshot checksum mismatch";
+
+	if (err != NULL)
+	{
+		fprintf(stderr, "%s: %s\n", filename, err);
+		munmap(base, st.st_size);
+		free(fib);
+		return NULL;
+	}
+
+	fib->routes = (struct sr_rt *)(base + hdr.routes_off);
+	fib->route_nhg = (uint32_t *)(base + hdr.route_nhg_off);
+	fib->nhg = (struct sr_fib_nhg *)(base + hdr.nhg_off);
+	fib->tbl24 = (uint32_t *)(base + hdr.tbl24_off);
+	fib->tbl8 = (uint32_t *)(base + hdr.tbl8_off);
+	fib->tbl8_cap = hdr.tbl8_groups;
+	fib->map_base = base;
+	fib->map_len = st.st_size;
+
+	return fib;
+} /* -- sr_fib_map -- */
+
+size_t sr_fib_memory(const struct sr_fib *fib)
+{
+	return sizeof(struct sr_fib)
+		+ (size_t)SR_FIB_TBL24_SZ * sizeof(uint32_t)
+		+ (size_t)fib->tbl8_cap * SR_FIB_TBL8_SZ * sizeof(uint32_t)
+		+ (size_t)(fib->ctl ? fib->ctl->routes_cap : fib->nroutes) * (sizeof(struct sr_rt) + sizeof(uint32_t))
+		+ (size_t)fib->nnhg * sizeof(struct sr_fib_nhg);
+}
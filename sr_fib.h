@@ -0,0 +1,181 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * Compiled forwarding table built from the routing table list.  The
+ * layout is DIR-24-8: a 2^24 entry first level indexed by the top 24 bits
+ * of the destination, and 256 entry second level groups for the /24s that
+ * carry /25 to /32 prefixes.  A lookup is one or two memory accesses no
+ * matter how many routes are installed.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_FIB_H
+#define sr_FIB_H
+
+#ifdef _DARWIN_
+#include <sys/types.h>
+#endif
+
+#include "sr_rt.h"
+
+#define SR_FIB_TBL24_SZ    (1 << 24)
+#define SR_FIB_TBL8_SZ     256
+
+/* Layout of a tbl24/tbl8 entry:
+   bit 31      valid, a route covers this slot
+   bit 30      (tbl24 only) slot points to a tbl8 group
+   bits 24-29  prefix length of the covering route
+   bits 0-23   route index, or tbl8 group index if bit 30 is set */
+#define SR_FIB_VALID       0x80000000u
+#define SR_FIB_EXT         0x40000000u
+#define SR_FIB_DEPTH_SHIFT 24
+#define SR_FIB_DEPTH_MASK  0x3f000000u
+#define SR_FIB_IDX_MASK    0x00ffffffu
+
+#define SR_FIB_DEPTH(e) (((e) & SR_FIB_DEPTH_MASK) >> SR_FIB_DEPTH_SHIFT)
+
+/* Result of a burst lookup: an index into fib->routes, or SR_FIB_NO_ROUTE */
+typedef uint32_t nexthop_t;
+#define SR_FIB_NO_ROUTE    0xffffffffu
+
+/* Largest burst sr_fib_lookup_burst() works on in one go. */
+#define SR_FIB_BURST_MAX   64
+
+/* Multipath.  Routes loaded for the same prefix are its equal cost
+   paths: the first one is installed and the prefix gets a next hop group
+   holding all of them.  A flow hash picks one of the group's buckets,
+   which are handed out in proportion to the weights, so a flow stays on
+   one path.  Identical groups are stored once and shared by all the
+   prefixes that use them. */
+#define SR_FIB_NHG_NONE    0xffffffffu
+#define SR_FIB_NHG_MAX     16   /* next hops of a group, further ones dropped */
+#define SR_FIB_NHG_SLOTS   64   /* flow hash buckets of a group */
+
+struct sr_fib_nhg
+{
+    uint32_t n;                 /* next hops */
+    uint32_t nslots;            /* buckets in use */
+    uint32_t refs;              /* prefixes using the group */
+    uint32_t hash;              /* of the fields below, for sharing */
+    unsigned char slot[SR_FIB_NHG_SLOTS];   /* next hop of each bucket */
+    struct sr_rt nh[SR_FIB_NHG_MAX];        /* gw, interface and weight */
+};
+
+struct sr_fib_ctl;
+
+struct sr_fib
+{
+    uint32_t *tbl24;            /* SR_FIB_TBL24_SZ entries */
+    uint32_t *tbl8;             /* tbl8_cap groups of SR_FIB_TBL8_SZ entries */
+    uint32_t tbl8_used;
+    uint32_t tbl8_cap;
+    struct sr_rt *routes;       /* private copy of the routes, next unused */
+    uint32_t nroutes;           /* route slots in use, see sr_fib_route_live */
+    uint32_t *route_nhg;        /* group of each route, or SR_FIB_NHG_NONE */
+    struct sr_fib_nhg *nhg;     /* next hop groups, made by sr_fib_build */
+    uint32_t nnhg;
+    uint32_t version;           /* bumped on each publish and update */
+    void *map_base;             /* snapshot mapping the tables live in, */
+    size_t map_len;             /* or NULL if they were allocated */
+    struct sr_fib_ctl *ctl;     /* update side state, made on first update */
+};
+
+/* Binary snapshot of a compiled FIB (sr_fib_save/sr_fib_map).  The file
+   is the header followed by the route array, the route to group map, the
+   next hop groups, tbl24 and the used tbl8 groups, each page aligned so
+   they are used straight from the mapping.
+   Routes are stored as struct sr_rt with next cleared, so a snapshot is
+   only valid for builds with the same struct layout and byte order,
+   which rt_size and byte_order check. */
+#define SR_FIB_SNAP_MAGIC   "SRFIBSNP"
+#define SR_FIB_SNAP_VERSION 2
+
+struct sr_fib_snap_hdr
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        /* 0x01020304 as written */
+    uint32_t rt_size;           /* sizeof(struct sr_rt) */
+    uint32_t nroutes;
+    uint32_t tbl8_groups;
+    uint32_t nhg_groups;
+    uint64_t routes_off;
+    uint64_t route_nhg_off;
+    uint64_t nhg_off;
+    uint64_t tbl24_off;
+    uint64_t tbl8_off;
+    uint64_t file_len;
+    uint64_t checksum;          /* of everything after the header page */
+};
+
+/* Compiles the routing table list into a new FIB.  The FIB keeps its own
+   copy of the routes, so the list may be freed afterwards.  Returns NULL
+   on allocation failure. */
+struct sr_fib *sr_fib_build(struct sr_rt *rtable);
+void sr_fib_free(struct sr_fib *fib);
+
+/* A published FIB is read without locks: use sr_rcu_dereference() on
+   sr->fib and do not keep the pointer across a quiescent state.  It is
+   replaced through sr_rt_publish(). */
+
+/* Longest prefix match.  The address is in network byte order.  Returns
+   the matching route owned by the FIB, or NULL.  For a multipath prefix
+   this is the first of its routes. */
+struct sr_rt *sr_fib_lookup(const struct sr_fib *fib, uint32_t ip);
+
+/* Longest prefix match that picks the path of a multipath prefix by the
+   flow hash (see flow_hash()).  The returned next hop of a multipath
+   prefix is shared with other prefixes, only its gw, interface and
+   weight are meaningful.  If multipath is not NULL it is set to whether
+   the choice depended on the flow. */
+struct sr_rt *sr_fib_lookup_flow(const struct sr_fib *fib, uint32_t ip,
+                                 uint32_t flow, int *multipath);
+
+/* Resolves n destinations (network byte order) into out[].  Bursts are
+   prefetched and, where the CPU has AVX2, looked up 8 at a time with
+   gathers.  Any n is accepted; it is processed SR_FIB_BURST_MAX at a time. */
+void sr_fib_lookup_burst(const struct sr_fib *fib, const uint32_t *dsts,
+                         int n, nexthop_t *out);
+void sr_fib_lookup_burst_scalar(const struct sr_fib *fib, const uint32_t *dsts,
+                                int n, nexthop_t *out);
+
+/* Route a burst result refers to, or NULL for SR_FIB_NO_ROUTE. */
+struct sr_rt *sr_fib_route(const struct sr_fib *fib, nexthop_t nh);
+
+/* Name of the burst implementation picked for this CPU. */
+const char *sr_fib_burst_impl(void);
+
+/* Writes fib as a snapshot.  Returns 0 on success, -1 with errno set. */
+int sr_fib_save(const struct sr_fib *fib, const char *filename);
+
+/* Maps a snapshot read only and checks its header and checksum.  The
+   tables are used in place, so the FIB must not be modified.  Prints the
+   reason and returns NULL if the file is unusable. */
+struct sr_fib *sr_fib_map(const char *filename);
+
+/* In place updates of a single route.  prefix is in network byte order
+   and is masked to len; adding a prefix that is already there replaces
+   its route.  Only the tbl24 range or tbl8 block the prefix covers is
+   rewritten, one word at a time, so lookups keep running on the FIB
+   while it changes.  Deleted routes and emptied tbl8 groups are reused
+   only after an RCU grace period.  Updates must be serialised by the
+   caller (sr_rt_add/sr_rt_del hold rt_lock) and are not possible on a
+   mapped FIB; sr_fib_dup makes a heap copy that can be updated.
+   Return 0, or -1 with errno set to EINVAL, ESRCH if the prefix to
+   delete is not there, or ENOMEM.  Routes added this way have a single
+   path; adding over a multipath prefix replaces all of its paths. */
+int sr_fib_add(struct sr_fib *fib, struct in_addr prefix, int len,
+               struct in_addr gw, const char *iface);
+int sr_fib_del(struct sr_fib *fib, struct in_addr prefix, int len);
+struct sr_fib *sr_fib_dup(const struct sr_fib *fib);
+
+/* Whether route slot i (< nroutes) holds an installed route.  Slots of
+   deleted routes stay in the array until they are reused. */
+int sr_fib_route_live(const struct sr_fib *fib, uint32_t i);
+
+/* Bytes of memory held by the FIB. */
+size_t sr_fib_memory(const struct sr_fib *fib);
+
+#endif  /* --  sr_FIB_H -- */
@@ -27,11 +27,15 @@
 
 #ifdef _LINUX_
 #include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
 #endif /* _LINUX_ */
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_rcu.h"
 
 extern char* optarg;
 
@@ -50,6 +54,8 @@ static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static void sr_load_fibsnap_wrap(struct sr_instance* sr, char* fibsnap);
+static void* sr_sigterm_thread(void* sr_ptr);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -61,15 +67,21 @@ int main(int argc, char **argv)
     char *user = 0;
     char *server = DEFAULT_SERVER;
     char *rtable = DEFAULT_RTABLE;
+    char *fibsnap = NULL;
     char *template = NULL;
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    int compress = 0;
+    int snoop = 0;
+    char *arpsnap = NULL;
+    sigset_t sigterm;
+    pthread_t thread;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:R:CAk:l:T:")) != EOF)
     {
         switch (c)
         {
@@ -98,6 +110,18 @@ int main(int argc, char **argv)
             case 'r':
                 rtable = optarg;
                 break;
+            case 'R':
+                fibsnap = optarg;
+                break;
+            case 'C':
+                compress = 1;
+                break;
+            case 'A':
+                snoop = 1;
+                break;
+            case 'k':
+                arpsnap = optarg;
+                break;
             case 'T':
                 template = optarg;
                 break;
@@ -106,11 +130,17 @@ int main(int argc, char **argv)
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.rt_compress = compress;
+    sr.arp_snoop = snoop;
+    sr.arp_snap = arpsnap;
 
-    /* -- set up routing table from file -- */
+    /* -- set up routing table from file, or map a compiled one -- */
     if(template == NULL) {
         sr.template[0] = '\0';
-        sr_load_rt_wrap(&sr, rtable);
+        if(fibsnap)
+            sr_load_fibsnap_wrap(&sr, fibsnap);
+        else
+            sr_load_rt_wrap(&sr, rtable);
     }
     else
         strncpy(sr.template, template, 30);
@@ -151,14 +181,31 @@ int main(int argc, char **argv)
         Debug("Connected to new instantiation of topology template %s\n", template);
         sr_load_rt_wrap(&sr, "rtable.vrhost");
     }
+    else if(fibsnap) {
+        /* mapped before connecting unless we are on a template */
+        if(template != NULL)
+            sr_load_fibsnap_wrap(&sr, fibsnap);
+    }
     else {
       /* Read from specified routing table */
       sr_load_rt_wrap(&sr, rtable);
     }
 
-    /* call router init (for arp subsystem etc.) */
+    /* -- with a checkpoint, SIGTERM is taken by a thread of its own that
+       writes it before exiting; blocked before sr_init starts the others -- */
+    if(arpsnap)
+    {
+        sigemptyset(&sigterm);
+        sigaddset(&sigterm, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &sigterm, NULL);
+    }
+
+    /* call router init (for arp subsystem etc.), restores the checkpoint */
     sr_init(&sr);
 
+    if(arpsnap)
+    { pthread_create(&thread, NULL, sr_sigterm_thread, &sr); }
+
     /* -- whizbang main loop ;-) */
     while( sr_read_from_server(&sr) == 1);
 
@@ -178,6 +225,10 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
+    printf("           [-R compiled routing table (see fibsnap)] \n");
+    printf("           [-C compress routing table] \n");
+    printf("           [-A learn neighbors from their ARP requests] \n");
+    printf("           [-k ARP cache checkpoint file] \n");
     printf("           [-l log file] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
@@ -225,6 +276,26 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    sr_flush_packets(sr);
+    sr_dump_server_stats(sr);
+    free(sr->rx.buf);
+    sr->rx.buf = 0;
+
+    /* -- the ARP thread sweeps the adjacency and negative caches and looks
+       up the FIB, stop it before any of them goes -- */
+    sr_arpcache_stop(&(sr->cache));
+
+    sr_dcache_dump_stats(&(sr->dcache));
+    sr_dcache_destroy(&(sr->dcache));
+    sr_adj_destroy(&(sr->adj));
+    sr_ncache_dump_stats(&(sr->ncache));
+    sr_ncache_destroy(&(sr->ncache));
+    sr_arpcache_dump_stats(&(sr->cache));
+    if(sr->arp_snap && sr_arpcache_save(&(sr->cache), sr->arp_snap) != 0)
+    { perror(sr->arp_snap); }
+
+    sr_rt_unpublish(sr);
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -243,11 +314,17 @@ static void sr_init_instance(struct sr_instance* sr)
     assert(sr);
 
     sr->sockfd = -1;
+    memset(&(sr->rx), 0, sizeof(sr->rx));
+    sr->tx = 0;
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
     sr->routing_table = 0;
+    sr->fib = 0;
+    sr->arp_snoop = 0;
+    sr->arp_snap = 0;
+    pthread_mutex_init(&(sr->rt_lock), 0);
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -268,36 +345,19 @@ static void sr_init_instance(struct sr_instance* sr)
 
 int sr_verify_routing_table(struct sr_instance* sr)
 {
-    struct sr_rt* rt_walker = 0;
-    struct sr_if* if_walker = 0;
-    int ret = 0;
+    struct sr_fib* fib;
+    int ret;
 
     /* -- REQUIRES --*/
     assert(sr);
 
-    if( (sr->if_list == 0) || (sr->routing_table == 0))
-    {
-        return 999; /* doh! */
-    }
-
-    rt_walker = sr->routing_table;
-
-    while(rt_walker)
-    {
-        /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
-        }
-        if(if_walker == 0)
-        { ret++; } /* -- interface not found! -- */
-
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
+    pthread_mutex_lock(&(sr->rt_lock));
+    fib = sr->fib;
+    if( (sr->if_list == 0) || (fib == 0) || (fib->nroutes == 0))
+    { ret = 999; /* doh! */ }
+    else
+    { ret = sr_rt_verify_ifaces(sr, fib); } /* -- one pass, interfaces hashed -- */
+    pthread_mutex_unlock(&(sr->rt_lock));
 
     return ret;
 } /* -- sr_verify_routing_table -- */
@@ -315,3 +375,50 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
     sr_print_routing_table(sr);
     printf("---------------------------------------------\n");
 }
+
+static void sr_load_fibsnap_wrap(struct sr_instance* sr, char* fibsnap) {
+    struct sr_fib* fib;
+    struct timeval start, end;
+
+    gettimeofday(&start, 0);
+    if((fib = sr_fib_map(fibsnap)) == 0) {
+        fprintf(stderr,"Error mapping routing table from file %s\n",
+                fibsnap);
+        exit(1);
+    }
+    sr_rt_publish(sr, 0, fib);
+    gettimeofday(&end, 0);
+
+    printf("Mapped compiled routing table %s: %u routes in %.1f ms\n",
+           fibsnap, fib->nroutes,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_usec - start.tv_usec) / 1e3);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_sigterm_thread(..)
+ * Scope: local
+ *
+ * Waits for SIGTERM, checkpoints the ARP cache and exits.  The ARP thread
+ * is stopped first: it writes periodic checkpoints to the same temporary
+ * file, and must not be running when the process exits.
+ *---------------------------------------------------------------------------*/
+
+static void* sr_sigterm_thread(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigwait(&set, &sig);
+
+    sr_arpcache_stop(&(sr->cache));
+    if(sr_arpcache_save(&(sr->cache), sr->arp_snap) != 0)
+    { perror(sr->arp_snap); }
+    else
+    { printf("ARP checkpoint: saved to %s\n", sr->arp_snap); }
+
+    exit(0);
+    return NULL;
+} /* -- sr_sigterm_thread -- */
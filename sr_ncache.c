@@ -0,0 +1,151 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ncache.c
+ *
+ * Description:
+ *
+ * Negative cache, see sr_ncache.h.
+ *
+ * Layout of an entry:
+ *   bits 32-63  IP address
+ *   bits 30-31  SR_NCACHE_NOROUTE or SR_NCACHE_DEAD, 0 if unused
+ *   bits 16-29  low bits of the FIB version, for SR_NCACHE_NOROUTE
+ *   bits 0-15   expiry, in seconds since nc->epoch modulo 2^16
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_ncache.h"
+
+#define SR_NCACHE_WHAT(e)    ((int)((e) >> 30) & 3)
+#define SR_NCACHE_GEN(e)     ((uint32_t)((e) >> 16) & 0x3fff)
+#define SR_NCACHE_EXPIRES(e) ((uint32_t)(e) & 0xffff)
+
+static uint64_t *sr_ncache_set(struct sr_ncache *nc, uint32_t ip)
+{
+	return &nc->slot[(((uint32_t)(ip * 2654435761u)) >> 24 & (SR_NCACHE_SETS - 1)) *
+					 SR_NCACHE_WAYS];
+}
+
+static uint32_t sr_ncache_clock(struct sr_ncache *nc, time_t now)
+{
+	return (uint32_t)(now - nc->epoch) & 0xffff;
+}
+
+static int sr_ncache_live(uint64_t e, uint32_t clock)
+{
+	return SR_NCACHE_WHAT(e) != SR_NCACHE_NONE &&
+		((SR_NCACHE_EXPIRES(e) - clock) & 0xffff) <= SR_NCACHE_TTL;
+}
+
+int sr_ncache_init(struct sr_ncache *nc)
+{
+	nc->slot = calloc(SR_NCACHE_SETS * SR_NCACHE_WAYS, sizeof(uint64_t));
+	if (nc->slot == NULL)
+		return -1;
+
+	nc->epoch = time(NULL);
+	nc->hits = 0;
+	nc->inserts = 0;
+	return 0;
+}
+
+void sr_ncache_destroy(struct sr_ncache *nc)
+{
+	free(nc->slot);
+	nc->slot = NULL;
+}
+
+int sr_ncache_lookup(struct sr_ncache *nc, uint32_t ip, uint32_t gen)
+{
+	uint64_t *set = sr_ncache_set(nc, ip), e;
+	uint32_t clock = sr_ncache_clock(nc, time(NULL));
+	int i;
+
+	for (i = 0; i < SR_NCACHE_WAYS; i++)
+	{
+		e = __atomic_load_n(&set[i], __ATOMIC_RELAXED);
+		if ((uint32_t)(e >> 32) != ip || !sr_ncache_live(e, clock))
+			continue;
+		if (SR_NCACHE_WHAT(e) == SR_NCACHE_NOROUTE && SR_NCACHE_GEN(e) != (gen & 0x3fff))
+			continue;
+
+		nc->hits++;
+		return SR_NCACHE_WHAT(e);
+	}
+
+	return SR_NCACHE_NONE;
+}
+
+void sr_ncache_insert(struct sr_ncache *nc, uint32_t ip, int what, uint32_t gen)
+{
+	uint64_t *set = sr_ncache_set(nc, ip), e, *victim = NULL;
+	uint32_t clock = sr_ncache_clock(nc, time(NULL)), left, min = 0x10000;
+	int i;
+
+	/* same address, else a free way, else the one expiring first */
+	for (i = 0; i < SR_NCACHE_WAYS; i++)
+	{
+		e = __atomic_load_n(&set[i], __ATOMIC_RELAXED);
+		if ((uint32_t)(e >> 32) == ip || !sr_ncache_live(e, clock))
+		{
+			victim = &set[i];
+			break;
+		}
+		left = (SR_NCACHE_EXPIRES(e) - clock) & 0xffff;
+		if (left < min)
+		{
+			min = left;
+			victim = &set[i];
+		}
+	}
+
+	e = (uint64_t)ip << 32 | (uint64_t)(what & 3) << 30 |
+		(uint64_t)(gen & 0x3fff) << 16 | ((clock + SR_NCACHE_TTL) & 0xffff);
+	__atomic_store_n(victim, e, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&nc->inserts, 1, __ATOMIC_RELAXED);
+}
+
+void sr_ncache_forget(struct sr_ncache *nc, uint32_t ip)
+{
+	uint64_t *set = sr_ncache_set(nc, ip), e;
+	int i;
+
+	for (i = 0; i < SR_NCACHE_WAYS; i++)
+	{
+		e = __atomic_load_n(&set[i], __ATOMIC_RELAXED);
+		if (SR_NCACHE_WHAT(e) != SR_NCACHE_NONE && (uint32_t)(e >> 32) == ip)
+			__atomic_compare_exchange_n(&set[i], &e, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ncache_sweep(struct sr_ncache *nc, time_t now)
+ * Scope:  Global
+ *
+ * Expiry times wrap after 2^16 seconds, so an entry left alone that
+ * long would come back to life.  Clearing expired entries every few
+ * seconds rules that out.  The compare and swap leaves an entry alone
+ * if it was replaced meanwhile.
+ *
+ *---------------------------------------------------------------------*/
+void sr_ncache_sweep(struct sr_ncache *nc, time_t now)
+{
+	uint32_t clock = sr_ncache_clock(nc, now);
+	uint64_t e;
+	int i;
+
+	for (i = 0; i < SR_NCACHE_SETS * SR_NCACHE_WAYS; i++)
+	{
+		e = __atomic_load_n(&nc->slot[i], __ATOMIC_RELAXED);
+		if (e != 0 && !sr_ncache_live(e, clock))
+			__atomic_compare_exchange_n(&nc->slot[i], &e, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+void sr_ncache_dump_stats(struct sr_ncache *nc)
+{
+	fprintf(stderr, "negative cache: %lu hits, %lu inserts\n", nc->hits, nc->inserts);
+}
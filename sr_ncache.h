@@ -0,0 +1,62 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ncache.h
+ *
+ * Description:
+ *
+ * Negative cache.  Remembers for SR_NCACHE_TTL seconds that a
+ * destination has no route, or that a next hop did not answer ARP, so
+ * the packets that follow are answered with ICMP unreachable at once
+ * instead of each waiting out the ARP retries or going through the
+ * route lookup again.
+ *
+ * Each entry is one 64 bit word, read and written atomically, so the
+ * packet thread and the ARP thread share the cache without a lock.  A
+ * lost race only loses an entry.  No route entries are tagged with the
+ * low bits of the FIB version and miss after a routing table change;
+ * dead next hop entries are dropped when the next hop answers ARP.  The
+ * ARP thread clears expired entries through sr_ncache_sweep.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_NCACHE_H
+#define SR_NCACHE_H
+
+#include <time.h>
+#include <stdint.h>
+
+#define SR_NCACHE_SETS 256      /* power of two */
+#define SR_NCACHE_WAYS 4
+#define SR_NCACHE_TTL  2        /* seconds */
+
+/* What is known about an address */
+#define SR_NCACHE_NONE    0
+#define SR_NCACHE_NOROUTE 1     /* destination, no route to it */
+#define SR_NCACHE_DEAD    2     /* next hop, ARP for it went unanswered */
+
+struct sr_ncache {
+    uint64_t *slot;             /* SR_NCACHE_SETS * SR_NCACHE_WAYS */
+    time_t epoch;               /* expiry times count from here */
+    unsigned long hits;
+    unsigned long inserts;
+};
+
+int  sr_ncache_init(struct sr_ncache *nc);
+
+/* Frees the entries.  Nothing may use the cache any more: the ARP thread,
+   which sweeps it and marks dead next hops, must have been stopped with
+   sr_arpcache_stop. */
+void sr_ncache_destroy(struct sr_ncache *nc);
+
+/* Returns SR_NCACHE_NOROUTE or SR_NCACHE_DEAD if ip (network byte order)
+   is in the cache, else SR_NCACHE_NONE.  gen is the current FIB version. */
+int  sr_ncache_lookup(struct sr_ncache *nc, uint32_t ip, uint32_t gen);
+void sr_ncache_insert(struct sr_ncache *nc, uint32_t ip, int what, uint32_t gen);
+void sr_ncache_forget(struct sr_ncache *nc, uint32_t ip);
+
+/* Clears entries that expired by now */
+void sr_ncache_sweep(struct sr_ncache *nc, time_t now);
+
+/* Prints hit and insert counters. */
+void sr_ncache_dump_stats(struct sr_ncache *nc);
+
+#endif
@@ -0,0 +1,550 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ortc.c
+ *
+ * Description:
+ *
+ * ORTC routing table compression, see sr_ortc.h.
+ *
+ * The prefixes go into a binary trie that is then completed so every
+ * node has no child or two.  Next hops are numbered from 1, 0 standing
+ * for no route.  Bottom up, a leaf's set is the next hop it inherits, and
+ * an inner node's set is the intersection of its children's sets, or
+ * their union if that is empty.  Top down, a node takes its parent's
+ * choice if that is in its set and otherwise gets a prefix for any next
+ * hop of its set.  A node above an address without a route has set {0}
+ * so no prefix is made that would cover it.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_ortc.h"
+#include "sr_fib.h"
+
+struct sr_ortc_node
+{
+	uint32_t child[2];          /* node indices, 0 for none */
+	uint32_t nh;                /* next hop of a prefix here, 0 if none */
+	uint32_t nset;
+	uint32_t one;               /* the set if nset is 1 */
+	uint32_t *set;              /* else, sorted */
+};
+
+/* A route with its prefix, sorted by (len, prefix, table order) */
+struct sr_ortc_ref
+{
+	const struct sr_rt *rt;
+	uint32_t prefix;
+	uint32_t len;
+	uint32_t idx;
+};
+
+/* Routes of a prefix, a run of ortc->routes */
+struct sr_ortc_nh
+{
+	uint32_t first;
+	uint32_t n;
+	uint32_t hash;
+};
+
+struct sr_ortc
+{
+	struct sr_ortc_node *node;
+	uint32_t nnodes, cap;
+	struct sr_ortc_ref *routes;
+	struct sr_ortc_nh *nh;          /* next hop i + 1 */
+	uint32_t nnh;
+	struct sr_rt *out, **tail;
+	unsigned int nout;
+	int failed;
+};
+
+static int sr_ortc_masklen(uint32_t mask)
+{
+	int len = 0;
+
+	mask = ntohl(mask);
+	while (len < 32 && (mask & (0x80000000u >> len)))
+		len++;
+
+	return len;
+}
+
+static uint32_t sr_ortc_lenmask(int len)
+{
+	return len ? ~0u << (32 - len) : 0;
+}
+
+static int sr_ortc_ref_cmp(const void *a, const void *b)
+{
+	const struct sr_ortc_ref *x = a, *y = b;
+
+	if (x->len != y->len)
+		return (x->len > y->len) - (x->len < y->len);
+	if (x->prefix != y->prefix)
+		return (x->prefix > y->prefix) - (x->prefix < y->prefix);
+	return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+/* Whether two routes forward the same way.  The weight only counts when
+   the route is one of several paths. */
+static int sr_ortc_route_eq(const struct sr_rt *a, const struct sr_rt *b, int multipath)
+{
+	return a->gw.s_addr == b->gw.s_addr &&
+		strncmp(a->interface, b->interface, sr_IFACE_NAMELEN) == 0 &&
+		(!multipath || a->weight == b->weight);
+}
+
+static uint32_t sr_ortc_nh_hash(struct sr_ortc *o, uint32_t first, uint32_t n)
+{
+	const struct sr_rt *rt;
+	const unsigned char *p;
+	uint32_t h = 2166136261u ^ n, i;
+
+	for (i = 0; i < n; i++)
+	{
+		rt = o->routes[first + i].rt;
+		h = (h ^ rt->gw.s_addr) * 16777619u;
+		for (p = (const unsigned char *)rt->interface;
+			 p < (const unsigned char *)rt->interface + sr_IFACE_NAMELEN && *p; p++)
+			h = (h ^ *p) * 16777619u;
+		if (n > 1)
+			h = (h ^ rt->weight) * 16777619u;
+	}
+
+	return h;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_nh_id(struct sr_ortc *o, uint32_t *htab, uint32_t hmask,
+ *                       uint32_t first, uint32_t n)
+ * Scope:  Local
+ *
+ * Number of the next hop made of routes[first..first+n), the same for
+ * every prefix that forwards the same way.
+ *
+ *---------------------------------------------------------------------*/
+static uint32_t sr_ortc_nh_id(struct sr_ortc *o, uint32_t *htab, uint32_t hmask,
+							  uint32_t first, uint32_t n)
+{
+	struct sr_ortc_nh *nh;
+	uint32_t h = sr_ortc_nh_hash(o, first, n), v, i;
+
+	for (; (v = htab[h & hmask]) != 0; h++)
+	{
+		nh = &o->nh[v - 1];
+		if (nh->n != n)
+			continue;
+		for (i = 0; i < n; i++)
+			if (!sr_ortc_route_eq(o->routes[nh->first + i].rt, o->routes[first + i].rt, n > 1))
+				break;
+		if (i == n)
+			return v;
+	}
+
+	nh = &o->nh[o->nnh];
+	nh->first = first;
+	nh->n = n;
+	nh->hash = h;
+	htab[h & hmask] = ++o->nnh;
+	return o->nnh;
+}
+
+static uint32_t sr_ortc_node_new(struct sr_ortc *o)
+{
+	struct sr_ortc_node *node;
+
+	if (o->nnodes == o->cap)
+	{
+		o->cap *= 2;
+		if ((node = realloc(o->node, o->cap * sizeof(struct sr_ortc_node))) == NULL)
+		{
+			o->failed = 1;
+			return 0;
+		}
+		o->node = node;
+	}
+
+	memset(&o->node[o->nnodes], 0, sizeof(struct sr_ortc_node));
+	return o->nnodes++;
+}
+
+static void sr_ortc_insert(struct sr_ortc *o, uint32_t prefix, int len, uint32_t nh)
+{
+	uint32_t v = 0, c;
+	int d, bit;
+
+	for (d = 0; d < len; d++)
+	{
+		bit = (prefix >> (31 - d)) & 1;
+		if ((c = o->node[v].child[bit]) == 0)
+		{
+			if ((c = sr_ortc_node_new(o)) == 0)
+				return;
+			o->node[v].child[bit] = c;
+		}
+		v = c;
+	}
+
+	/* the first routes of a prefix win, as in sr_fib_build */
+	if (o->node[v].nh == 0)
+		o->node[v].nh = nh;
+}
+
+static const uint32_t *sr_ortc_set(const struct sr_ortc_node *node)
+{
+	return node->nset == 1 ? &node->one : node->set;
+}
+
+static int sr_ortc_in_set(const struct sr_ortc_node *node, uint32_t nh)
+{
+	const uint32_t *s = sr_ortc_set(node);
+	uint32_t i;
+
+	for (i = 0; i < node->nset; i++)
+		if (s[i] == nh)
+			return 1;
+	return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_merge(struct sr_ortc *o, uint32_t v)
+ * Scope:  Local
+ *
+ * Set of inner node v from its children's: their intersection, else
+ * their union, cut at SR_ORTC_SET_MAX.  Any part of either is still a
+ * correct choice, it may just cost more prefixes further down.
+ *
+ *---------------------------------------------------------------------*/
+static void sr_ortc_merge(struct sr_ortc *o, uint32_t v)
+{
+	struct sr_ortc_node *node = &o->node[v];
+	const struct sr_ortc_node *l = &o->node[node->child[0]], *r = &o->node[node->child[1]];
+	const uint32_t *a = sr_ortc_set(l), *b = sr_ortc_set(r);
+	uint32_t tmp[2 * SR_ORTC_SET_MAX], n = 0, i, j;
+
+	for (i = j = 0; i < l->nset && j < r->nset; )
+	{
+		if (a[i] == b[j])
+		{
+			tmp[n++] = a[i];
+			i++;
+			j++;
+		}
+		else if (a[i] < b[j])
+			i++;
+		else
+			j++;
+	}
+
+	if (n == 0)
+	{
+		for (i = j = 0; (i < l->nset || j < r->nset) && n < SR_ORTC_SET_MAX; )
+		{
+			if (j == r->nset || (i < l->nset && a[i] < b[j]))
+				tmp[n++] = a[i++];
+			else if (i == l->nset || b[j] < a[i])
+				tmp[n++] = b[j++];
+			else
+			{
+				tmp[n++] = a[i++];
+				j++;
+			}
+		}
+	}
+
+	node->nset = n;
+	if (n > 1 && (node->set = malloc(n * sizeof(uint32_t))) != NULL)
+		memcpy(node->set, tmp, n * sizeof(uint32_t));
+	else
+	{
+		/* out of memory just loses the other choices */
+		node->nset = 1;
+		node->one = tmp[0];
+	}
+}
+
+/* Bottom up pass: returns whether an address below v has no route */
+static int sr_ortc_sets(struct sr_ortc *o, uint32_t v, uint32_t inherited)
+{
+	struct sr_ortc_node *node = &o->node[v];
+	int hole;
+
+	if (node->nh != 0)
+		inherited = node->nh;
+
+	if (node->child[0] == 0)
+	{
+		node->nset = 1;
+		node->one = inherited;
+		return inherited == 0;
+	}
+
+	hole = sr_ortc_sets(o, node->child[0], inherited);
+	hole |= sr_ortc_sets(o, node->child[1], inherited);
+	if (hole)
+	{
+		node->nset = 1;
+		node->one = 0;
+	}
+	else
+		sr_ortc_merge(o, v);
+
+	return hole;
+}
+
+static void sr_ortc_emit(struct sr_ortc *o, uint32_t prefix, int len, uint32_t nh)
+{
+	const struct sr_ortc_nh *h = &o->nh[nh - 1];
+	struct sr_rt *rt;
+	uint32_t i;
+
+	for (i = 0; i < h->n; i++)
+	{
+		if ((rt = malloc(sizeof(struct sr_rt))) == NULL)
+		{
+			o->failed = 1;
+			return;
+		}
+		memcpy(rt, o->routes[h->first + i].rt, sizeof(struct sr_rt));
+		rt->dest.s_addr = htonl(prefix);
+		rt->mask.s_addr = htonl(sr_ortc_lenmask(len));
+		rt->next = NULL;
+		*o->tail = rt;
+		o->tail = &rt->next;
+		o->nout++;
+	}
+}
+
+/* Top down pass */
+static void sr_ortc_choose(struct sr_ortc *o, uint32_t v, uint32_t prefix, int len,
+						   uint32_t chosen)
+{
+	struct sr_ortc_node *node = &o->node[v];
+
+	if (!sr_ortc_in_set(node, chosen))
+	{
+		chosen = sr_ortc_set(node)[0];
+		sr_ortc_emit(o, prefix, len, chosen);
+	}
+	if (node->nset > 1)
+		free(node->set);
+
+	if (node->child[0] != 0)
+	{
+		sr_ortc_choose(o, node->child[0], prefix, len + 1, chosen);
+		sr_ortc_choose(o, node->child[1], prefix | (0x80000000u >> len), len + 1, chosen);
+	}
+}
+
+struct sr_rt *sr_ortc_compress(const struct sr_rt *rtable, struct sr_ortc_stats *st)
+{
+	struct sr_ortc o;
+	const struct sr_rt *rt;
+	struct sr_rt *next;
+	uint32_t *htab = NULL, hsize = 16, n = 0, i, run, v, nh;
+
+	memset(&o, 0, sizeof(o));
+	o.tail = &o.out;
+
+	for (rt = rtable; rt != NULL; rt = rt->next)
+		n++;
+	while (hsize < 2 * n)
+		hsize *= 2;
+
+	o.cap = 2 * n + 16;
+	o.node = malloc(o.cap * sizeof(struct sr_ortc_node));
+	o.routes = malloc((n ? n : 1) * sizeof(struct sr_ortc_ref));
+	o.nh = malloc((n ? n : 1) * sizeof(struct sr_ortc_nh));
+	htab = calloc(hsize, sizeof(uint32_t));
+	if (o.node == NULL || o.routes == NULL || o.nh == NULL || htab == NULL)
+	{
+		o.failed = 1;
+		goto out;
+	}
+
+	/* -- number the next hops and build the trie -- */
+	for (rt = rtable, i = 0; rt != NULL; rt = rt->next, i++)
+	{
+		o.routes[i].rt = rt;
+		o.routes[i].len = sr_ortc_masklen(rt->mask.s_addr);
+		o.routes[i].prefix = ntohl(rt->dest.s_addr) & sr_ortc_lenmask(o.routes[i].len);
+		o.routes[i].idx = i;
+	}
+	qsort(o.routes, n, sizeof(struct sr_ortc_ref), sr_ortc_ref_cmp);
+
+	sr_ortc_node_new(&o);
+	for (i = 0; i < n && !o.failed; i += run)
+	{
+		for (run = 1; i + run < n && o.routes[i + run].len == o.routes[i].len &&
+				 o.routes[i + run].prefix == o.routes[i].prefix; run++)
+			;
+		nh = sr_ortc_nh_id(&o, htab, hsize - 1, i, run);
+		sr_ortc_insert(&o, o.routes[i].prefix, o.routes[i].len, nh);
+	}
+
+	/* -- complete the trie, new nodes are leaves so one pass does -- */
+	for (v = 0; v < o.nnodes && !o.failed; v++)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			if (o.node[v].child[i] == 0 && o.node[v].child[!i] != 0)
+			{
+				nh = sr_ortc_node_new(&o);
+				o.node[v].child[i] = nh;
+			}
+		}
+	}
+
+	if (!o.failed)
+	{
+		sr_ortc_sets(&o, 0, 0);
+		sr_ortc_choose(&o, 0, 0, 0, 0);
+	}
+
+out:
+	free(htab);
+	free(o.node);
+	free(o.routes);
+	free(o.nh);
+
+	if (o.failed)
+	{
+		for (; o.out != NULL; o.out = next)
+		{
+			next = o.out->next;
+			free(o.out);
+		}
+		return NULL;
+	}
+
+	if (st != NULL)
+	{
+		st->routes_in = n;
+		st->routes_out = o.nout;
+		st->bytes_in = n * sizeof(struct sr_rt);
+		st->bytes_out = o.nout * sizeof(struct sr_rt);
+	}
+	return o.out;
+}
+
+/* Whether a and b forward to the same route or next hop group */
+static int sr_ortc_same(const struct sr_fib *fa, const struct sr_rt *a,
+						const struct sr_fib *fb, const struct sr_rt *b)
+{
+	const struct sr_fib_nhg *ga, *gb;
+	uint32_t na, nb, i;
+
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	na = fa->route_nhg[a - fa->routes];
+	nb = fb->route_nhg[b - fb->routes];
+	if (na == SR_FIB_NHG_NONE || nb == SR_FIB_NHG_NONE)
+		return na == nb && sr_ortc_route_eq(a, b, 0);
+
+	ga = &fa->nhg[na];
+	gb = &fb->nhg[nb];
+	if (ga->n != gb->n || ga->nslots != gb->nslots ||
+		memcmp(ga->slot, gb->slot, ga->nslots) != 0)
+		return 0;
+	for (i = 0; i < ga->n; i++)
+		if (!sr_ortc_route_eq(&ga->nh[i], &gb->nh[i], 1))
+			return 0;
+	return 1;
+}
+
+static int sr_ortc_u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Adds the first address of each prefix and the one after it to pts */
+static uint32_t sr_ortc_points(const struct sr_rt *rt, uint32_t *pts, uint32_t n)
+{
+	uint32_t start;
+	int len;
+
+	for (; rt != NULL; rt = rt->next)
+	{
+		len = sr_ortc_masklen(rt->mask.s_addr);
+		start = ntohl(rt->dest.s_addr) & sr_ortc_lenmask(len);
+		pts[n++] = start;
+		if (len > 0 && (start | ~sr_ortc_lenmask(len)) != 0xffffffffu)
+			pts[n++] = (start | ~sr_ortc_lenmask(len)) + 1;
+	}
+
+	return n;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ortc_verify(struct sr_rt *rtable, const struct sr_fib *fib,
+ *                        struct sr_ortc_stats *st)
+ * Scope:  Global
+ *
+ * The longest match only changes where some prefix starts or ends, so
+ * two tables that agree at all those points agree everywhere.
+ *
+ *---------------------------------------------------------------------*/
+int sr_ortc_verify(struct sr_rt *rtable, const struct sr_fib *fib,
+				   struct sr_ortc_stats *st)
+{
+	struct sr_fib *ref;
+	const struct sr_rt *rt;
+	uint32_t *pts, n = 1, i, ip;
+	int ret = 0;
+
+	for (rt = rtable; rt != NULL; rt = rt->next)
+		n += 2;
+	for (i = 0; i < fib->nroutes; i++)
+		n += 2;
+
+	ref = sr_fib_build(rtable);
+	pts = malloc(n * sizeof(uint32_t));
+	if (ref == NULL || pts == NULL)
+	{
+		fprintf(stderr, "Error checking compressed routing table, out of memory\n");
+		sr_fib_free(ref);
+		free(pts);
+		return -1;
+	}
+
+	pts[0] = 0;
+	n = sr_ortc_points(rtable, pts, 1);
+	for (i = 0; i < fib->nroutes; i++)
+	{
+		/* routes in a FIB have next cleared */
+		if (sr_fib_route_live(fib, i))
+			n = sr_ortc_points(&fib->routes[i], pts, n);
+	}
+	qsort(pts, n, sizeof(uint32_t), sr_ortc_u32_cmp);
+
+	for (i = 0; i < n && ret == 0; i++)
+	{
+		if (i > 0 && pts[i] == pts[i - 1])
+			continue;
+		ip = htonl(pts[i]);
+		if (!sr_ortc_same(ref, sr_fib_lookup(ref, ip), fib, sr_fib_lookup(fib, ip)))
+		{
+			fprintf(stderr, "Compressed routing table differs at %s\n",
+					inet_ntoa(*(struct in_addr *)&ip));
+			ret = -1;
+		}
+	}
+
+	if (st != NULL)
+	{
+		st->fib_bytes_in = sr_fib_memory(ref);
+		st->fib_bytes_out = sr_fib_memory(fib);
+	}
+	sr_fib_free(ref);
+	free(pts);
+	return ret;
+}
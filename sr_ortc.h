@@ -0,0 +1,52 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ortc.h
+ *
+ * Description:
+ *
+ * Routing table compression.  Rewrites a routing table into the fewest
+ * prefixes that forward every address the same way, using the ORTC
+ * (optimal routing table constructor) passes over a binary trie of the
+ * prefixes: more specifics with the same next hop as their covering
+ * route disappear, and sibling prefixes sharing a next hop merge.
+ *
+ * A next hop is everything a prefix forwards to: its route, or all of
+ * its routes in order for a multipath prefix.  Addresses without a
+ * route stay without one, since the table cannot express a drop.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_ORTC_H
+#define sr_ORTC_H
+
+#include <stddef.h>
+
+#include "sr_rt.h"
+
+/* Next hops kept per trie node.  More would only find a few more merges
+   on tables with many next hops. */
+#define SR_ORTC_SET_MAX 16
+
+struct sr_fib;
+
+struct sr_ortc_stats
+{
+    unsigned int routes_in;     /* routes of the table given */
+    unsigned int routes_out;    /* routes of the compressed table */
+    size_t bytes_in;            /* of the route lists */
+    size_t bytes_out;
+    size_t fib_bytes_in;        /* of the FIBs, set by sr_ortc_verify */
+    size_t fib_bytes_out;
+};
+
+/* Returns a newly allocated compressed copy of rtable, or NULL if out of
+   memory.  rtable is not changed.  st may be NULL. */
+struct sr_rt *sr_ortc_compress(const struct sr_rt *rtable, struct sr_ortc_stats *st);
+
+/* Checks that fib, built from a compressed table, forwards every address
+   like rtable does, by comparing the two at each point where a prefix of
+   either starts or ends.  Returns 0 if they agree, else prints the first
+   address they differ on and returns -1.  st may be NULL. */
+int sr_ortc_verify(struct sr_rt *rtable, const struct sr_fib *fib,
+                   struct sr_ortc_stats *st);
+
+#endif  /* --  sr_ORTC_H -- */
@@ -0,0 +1,34 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pkt.h
+ *
+ * Description:
+ *
+ * Packet handle.  A frame is handed through the router as the buffer it
+ * lies in, its offset there and its length.  The bytes before the frame
+ * are headroom: when there are at least SR_PKT_HEADROOM of them,
+ * sr_send_pkt writes the VNS header there and sends header and frame as
+ * one run of memory, without a copy.
+ *
+ * A frame from the server has its own VNS header in front of it, so a
+ * packet forwarded from the receive buffer goes out from where it was
+ * read.  Packets queued for ARP are kept with headroom as well.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PKT_H
+#define SR_PKT_H
+
+#include <stdint.h>
+
+#define SR_PKT_HEADROOM 24      /* sizeof(c_packet_header) */
+
+struct sr_pkt {
+    uint8_t *buf;               /* buffer the frame lies in */
+    unsigned int off;           /* frame starts here, headroom before it */
+    unsigned int len;           /* length of the frame */
+};
+
+/* The raw Ethernet frame */
+#define sr_pkt_frame(p) ((p)->buf + (p)->off)
+
+#endif
@@ -0,0 +1,122 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rcu.c
+ *
+ * Description:
+ *
+ * Quiescent state based reclamation, see sr_rcu.h.
+ *
+ * Writers advance a global grace period counter.  Each reader publishes
+ * the counter value it last saw at a quiescent state, or 0 while offline;
+ * a grace period has elapsed once every reader is offline or has caught
+ * up with the new value.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "sr_rcu.h"
+
+struct sr_rcu_reader
+{
+	unsigned long ctr;          /* last grace period seen, 0 when offline */
+	struct sr_rcu_reader *next;
+};
+
+static unsigned long sr_rcu_gp = 1;
+static struct sr_rcu_reader *sr_rcu_readers = NULL;
+static pthread_mutex_t sr_rcu_lock = PTHREAD_MUTEX_INITIALIZER; /* readers list, writers */
+static __thread struct sr_rcu_reader *sr_rcu_self = NULL;
+
+void sr_rcu_register_thread(void)
+{
+	struct sr_rcu_reader *r;
+
+	if (sr_rcu_self != NULL)
+		return;
+
+	r = calloc(1, sizeof(struct sr_rcu_reader));
+	assert(r);
+
+	pthread_mutex_lock(&sr_rcu_lock);
+	r->ctr = __atomic_load_n(&sr_rcu_gp, __ATOMIC_SEQ_CST);
+	r->next = sr_rcu_readers;
+	sr_rcu_readers = r;
+	pthread_mutex_unlock(&sr_rcu_lock);
+
+	sr_rcu_self = r;
+}
+
+void sr_rcu_unregister_thread(void)
+{
+	struct sr_rcu_reader **pr;
+
+	if (sr_rcu_self == NULL)
+		return;
+
+	pthread_mutex_lock(&sr_rcu_lock);
+	for (pr = &sr_rcu_readers; *pr != NULL; pr = &(*pr)->next)
+	{
+		if (*pr == sr_rcu_self)
+		{
+			*pr = sr_rcu_self->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sr_rcu_lock);
+
+	free(sr_rcu_self);
+	sr_rcu_self = NULL;
+}
+
+void sr_rcu_quiescent_state(void)
+{
+	if (sr_rcu_self == NULL)
+		return;
+
+	/* earlier reads must not be reordered past the announcement */
+	__atomic_store_n(&sr_rcu_self->ctr, __atomic_load_n(&sr_rcu_gp, __ATOMIC_SEQ_CST),
+					 __ATOMIC_SEQ_CST);
+}
+
+void sr_rcu_thread_offline(void)
+{
+	if (sr_rcu_self == NULL)
+		return;
+
+	__atomic_store_n(&sr_rcu_self->ctr, 0, __ATOMIC_SEQ_CST);
+}
+
+void sr_rcu_thread_online(void)
+{
+	if (sr_rcu_self == NULL)
+		return;
+
+	/* later reads must not be reordered before this */
+	__atomic_store_n(&sr_rcu_self->ctr, __atomic_load_n(&sr_rcu_gp, __ATOMIC_SEQ_CST),
+					 __ATOMIC_SEQ_CST);
+}
+
+void sr_rcu_synchronize(void)
+{
+	struct sr_rcu_reader *r;
+	unsigned long gp, ctr;
+
+	pthread_mutex_lock(&sr_rcu_lock);
+
+	gp = __atomic_add_fetch(&sr_rcu_gp, 1, __ATOMIC_SEQ_CST);
+
+	for (r = sr_rcu_readers; r != NULL; r = r->next)
+	{
+		/* the caller is not inside a read side section */
+		if (r == sr_rcu_self)
+			continue;
+
+		while ((ctr = __atomic_load_n(&r->ctr, __ATOMIC_SEQ_CST)) != 0 && ctr < gp)
+			sched_yield();
+	}
+
+	pthread_mutex_unlock(&sr_rcu_lock);
+}
@@ -0,0 +1,37 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rcu.h
+ *
+ * Description:
+ *
+ * Quiescent state based reclamation for data the forwarding path reads
+ * without locks (the compiled FIB).  Reader threads register themselves
+ * and announce quiescent states; a writer publishes a new version with
+ * one atomic pointer store, calls sr_rcu_synchronize() and may then free
+ * the old version, since no reader can still hold a reference to it.
+ *
+ * A registered thread is online while it may hold references.  It must
+ * go offline before blocking (sleep, recv) so writers never wait on it;
+ * going offline is itself a quiescent state.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_RCU_H
+#define SR_RCU_H
+
+/* Publish/read a pointer protected by RCU. */
+#define sr_rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define sr_rcu_dereference(p)       __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define sr_rcu_xchg_pointer(p, v)   __atomic_exchange_n(&(p), (v), __ATOMIC_ACQ_REL)
+
+/* Reader side.  All of these are no-ops on unregistered threads. */
+void sr_rcu_register_thread(void);
+void sr_rcu_unregister_thread(void);
+void sr_rcu_quiescent_state(void);
+void sr_rcu_thread_offline(void);
+void sr_rcu_thread_online(void);
+
+/* Writer side.  Waits until every other registered thread has been
+   through a quiescent state or offline since the call started. */
+void sr_rcu_synchronize(void);
+
+#endif /* SR_RCU_H */
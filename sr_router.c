@@ -18,11 +18,127 @@
 
 #include "sr_if.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_rcu.h"
 #include "sr_router.h"
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 
+/* Next hops gathered for the warm-up, with a hash of those seen so far */
+struct sr_warmset {
+	uint32_t *seen;				/* open addressing, 0 for a free slot */
+	uint32_t mask;				/* slots - 1 */
+	uint32_t *ip;
+	int *ifindex;
+	int n;
+};
+
+/* Adds the next hop of one path of the prefix dest/mask, if it has one
+   and it is not in the set yet. */
+static void sr_warm_path(struct sr_instance *sr, struct sr_warmset *set,
+						 const struct sr_rt *path, uint32_t dest, uint32_t mask)
+{
+	struct sr_if *ifc;
+	uint32_t nexthop, h;
+
+	if (path->gw.s_addr != 0)
+		nexthop = path->gw.s_addr;
+	else if (mask == 0xffffffff)
+		nexthop = dest;
+	else
+		return;
+	if (nexthop == 0)
+		return;
+
+	h = nexthop * 2654435761u;
+	for (h = (h ^ h >> 16) & set->mask; set->seen[h] != 0; h = (h + 1) & set->mask)
+	{
+		if (set->seen[h] == nexthop)
+			return;
+	}
+
+	if ((ifc = sr_get_interface(sr, path->interface)) == NULL)
+		return;
+	set->seen[h] = nexthop;
+	set->ip[set->n] = nexthop;
+	set->ifindex[set->n++] = ifc->index;
+}
+
+/*---------------------------------------------------------------------
+* Method: sr_warm_nexthops(struct sr_instance *sr)
+* Scope:  Local
+*
+* Asks the ARP cache to resolve every next hop of the published FIB
+* before traffic needs it: each gateway, of every path of a multipath
+* prefix too, and each directly connected host route.  Connected subnets
+* without a gateway have no one address to ask for and are left to
+* traffic.  The FIB is walked rather than sr->routing_table, which is
+* empty for a FIB mapped from a snapshot and not kept in step with
+* sr_rt_add and sr_rt_del.
+*
+*---------------------------------------------------------------------*/
+static void sr_warm_nexthops(struct sr_instance *sr)
+{
+	struct sr_warmset set;
+	struct sr_fib *fib;
+	const struct sr_fib_nhg *nhg;
+	uint32_t i, k, paths = 0, slots;
+
+	memset(&set, 0, sizeof(set));
+
+	pthread_mutex_lock(&(sr->rt_lock)); /* no updates while walking */
+	fib = sr->fib;
+	if (fib == NULL)
+	{
+		pthread_mutex_unlock(&(sr->rt_lock));
+		return;
+	}
+
+	for (i = 0; i < fib->nroutes; i++)
+	{
+		if (sr_fib_route_live(fib, i))
+			paths += fib->route_nhg[i] == SR_FIB_NHG_NONE ? 1 : fib->nhg[fib->route_nhg[i]].n;
+	}
+
+	for (slots = 16; slots < 2 * paths; slots <<= 1)
+		;
+	set.mask = slots - 1;
+	set.seen = calloc(slots, sizeof(uint32_t));
+	set.ip = malloc((paths ? paths : 1) * sizeof(uint32_t));
+	set.ifindex = malloc((paths ? paths : 1) * sizeof(int));
+
+	for (i = 0; set.seen != NULL && set.ip != NULL && set.ifindex != NULL && i < fib->nroutes; i++)
+	{
+		if (!sr_fib_route_live(fib, i))
+			continue;
+
+		if (fib->route_nhg[i] == SR_FIB_NHG_NONE)
+		{
+			sr_warm_path(sr, &set, &fib->routes[i], fib->routes[i].dest.s_addr,
+						 fib->routes[i].mask.s_addr);
+			continue;
+		}
+
+		nhg = &fib->nhg[fib->route_nhg[i]];
+		for (k = 0; k < nhg->n; k++)
+			sr_warm_path(sr, &set, &nhg->nh[k], fib->routes[i].dest.s_addr,
+						 fib->routes[i].mask.s_addr);
+	}
+
+	pthread_mutex_unlock(&(sr->rt_lock));
+
+	if (set.n > 0)
+	{
+		printf("ARP warm-up: asking for %d next hops\n", set.n);
+		if (sr_arpcache_warm(&(sr->cache), set.ip, set.ifindex, set.n) != 0)
+			fprintf(stderr, "Error starting ARP warm-up\n");
+	}
+	free(set.seen);
+	free(set.ip);
+	free(set.ifindex);
+}
+
 /*---------------------------------------------------------------------
 * Method: sr_init(void)
 * Scope:  Global
@@ -32,21 +148,41 @@
 *---------------------------------------------------------------------*/
 void sr_init(struct sr_instance *sr)
 {
+	int n;
+
 	/* REQUIRES */
 	assert(sr);
 
 	/* Initialize cache and cache cleanup thread */
 	sr_arpcache_init(&(sr->cache));
+	if (sr_dcache_init(&(sr->dcache)) != 0 || sr_adj_init(&(sr->adj)) != 0 ||
+		sr_ncache_init(&(sr->ncache)) != 0)
+	{
+		fprintf(stderr, "Error allocating destination cache\n");
+		exit(1);
+	}
+	sr->cache.adj = &(sr->adj);
+
+	/* entries learned before a restart, still within their lifetime */
+	if (sr->arp_snap != NULL)
+	{
+		if ((n = sr_arpcache_load(&(sr->cache), sr->arp_snap)) >= 0)
+			printf("ARP checkpoint: restored %d entries from %s\n", n, sr->arp_snap);
+		sr->cache.snap = sr->arp_snap;
+	}
 
 	pthread_attr_init(&(sr->attr));
 	pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
 	pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
 	pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-	pthread_t thread;
 
-	pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+	/* this thread reads the FIB while handling packets */
+	sr_rcu_register_thread();
+
+	pthread_create(&(sr->cache.thread), &(sr->attr), sr_arpcache_timeout, sr);
 
 	/* Add initialization code here! */
+	sr_warm_nexthops(sr);
 
 } /* -- sr_init -- */
 
@@ -82,13 +218,221 @@ int ip_black_list(struct sr_ip_hdr *iph)
 	/****************************************************/
 }
 /*---------------------------------------------------------------------
-* Method: sr_handlepacket(uint8_t* p,char* interface)
+* Method: sr_dcache_gen(struct sr_instance *sr)
+* Scope:  Local
+*
+* Current destination cache generation.  Read it before resolving a
+* destination, so a concurrent route change makes the result stale
+* rather than cached.
+*
+*---------------------------------------------------------------------*/
+static uint32_t sr_dcache_gen(struct sr_instance *sr)
+{
+	struct sr_fib *fib = sr_rcu_dereference(sr->fib);
+
+	return fib ? __atomic_load_n(&fib->version, __ATOMIC_ACQUIRE) : 0;
+}
+
+/*---------------------------------------------------------------------
+* Method: sr_send_unreachable(struct sr_instance *sr, struct sr_ip_hdr *i_hdr0,
+*                             uint8_t code, char *interface)
+* Scope:  Local
+*
+* Answers the IP packet i_hdr0 that arrived on interface with an ICMP
+* destination unreachable of the given code, sent back out of that
+* interface.  The reply is built on the stack.
+*
+*---------------------------------------------------------------------*/
+static void sr_send_unreachable(struct sr_instance *sr, struct sr_ip_hdr *i_hdr0,
+								uint8_t code, char *interface)
+{
+	uint8_t buf[sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr) +
+				sizeof(struct sr_icmp_t3_hdr)];
+	struct sr_ethernet_hdr *e_hdr = (struct sr_ethernet_hdr *)buf;
+	struct sr_ip_hdr *i_hdr = (struct sr_ip_hdr *)(buf + sizeof *e_hdr);
+	struct sr_icmp_t3_hdr *ict3_hdr = (struct sr_icmp_t3_hdr *)(buf + sizeof *e_hdr + sizeof *i_hdr);
+	struct sr_if *ifc = sr_get_interface(sr, interface);
+	struct sr_arpreq *arpreq;
+
+	memcpy(e_hdr->ether_shost, ifc->addr, ETHER_ADDR_LEN);
+	e_hdr->ether_type = htons(ethertype_ip);
+
+	i_hdr->ip_hl = sizeof *i_hdr / 4;
+	i_hdr->ip_v = 4;
+	i_hdr->ip_tos = 0;
+	i_hdr->ip_len = htons(sizeof *i_hdr + sizeof *ict3_hdr);
+	i_hdr->ip_id = i_hdr0->ip_id;
+	i_hdr->ip_off = htons(IP_DF);
+	i_hdr->ip_ttl = INIT_TTL;
+	i_hdr->ip_p = ip_protocol_icmp;
+	i_hdr->ip_src = ifc->ip;
+	i_hdr->ip_dst = i_hdr0->ip_src;
+	i_hdr->ip_sum = 0;
+	i_hdr->ip_sum = cksum(i_hdr, sizeof *i_hdr);
+
+	ict3_hdr->icmp_type = 3;
+	ict3_hdr->icmp_code = code;
+	ict3_hdr->unused = 0;
+	ict3_hdr->next_mtu = 0;
+	memcpy(ict3_hdr->data, i_hdr0, ICMP_DATA_SIZE);
+	ict3_hdr->icmp_sum = 0;
+	ict3_hdr->icmp_sum = cksum(ict3_hdr, sizeof *ict3_hdr);
+
+	if (sr_arpcache_lookup_mac(&(sr->cache), i_hdr->ip_dst, e_hdr->ether_dhost))
+	{
+		sr_send_packet(sr, buf, sizeof(buf), interface);
+	}
+	else
+	{
+		arpreq = sr_arpcache_queuereq(&(sr->cache), i_hdr->ip_dst, buf, sizeof(buf), ifc->index);
+		sr_arpcache_handle_arpreq(sr, arpreq);
+	}
+}
+
+/*---------------------------------------------------------------------
+* Method: sr_send_nexthop(struct sr_instance *sr, struct sr_pkt *pkt,
+*                         struct sr_rt *rtentry, uint32_t ip_dst)
+* Scope:  Local
+*
+* Sends the IP packet in the frame of pkt to the next hop of rtentry:
+* its gateway, or ip_dst itself for a route without one.  The frame gets
+* the header of the next hop's adjacency and goes out where it lies;
+* while that is unresolved the packet waits for ARP on the next hop.  A
+* next hop gets its adjacency once it is in the ARP cache, so a sweep
+* of a connected subnet does not fill the table with hosts that never
+* answer.  Returns the adjacency the packet was sent through, or NULL if
+* it was queued or the table is full.
+*
+*---------------------------------------------------------------------*/
+static struct sr_adj *sr_send_nexthop(struct sr_instance *sr, struct sr_pkt *pkt,
+									  struct sr_rt *rtentry, uint32_t ip_dst)
+{
+	struct sr_ethernet_hdr *e_hdr = (struct sr_ethernet_hdr *)sr_pkt_frame(pkt);
+	uint32_t nexthop = rtentry->gw.s_addr ? rtentry->gw.s_addr : ip_dst;
+	struct sr_adj *adj = sr_adj_find(&(sr->adj), nexthop, rtentry->interface);
+	unsigned char mac[ETHER_ADDR_LEN];
+	struct sr_arpreq *arpreq;
+	struct sr_if *ifc;
+	int found;
+
+	found = (adj == NULL || !sr_adj_resolved(adj)) &&
+		sr_arpcache_lookup_mac(&(sr->cache), nexthop, mac);
+	if (adj == NULL && found)
+		adj = sr_adj_get(sr, nexthop, rtentry->interface);
+
+	if (adj != NULL)
+	{
+		ifc = adj->ifc;
+		if (found)
+			sr_adj_set_mac(adj, mac);
+
+		memcpy(e_hdr, &(adj->hdr), sizeof(struct sr_ethernet_hdr));
+		if (sr_adj_resolved(adj))
+		{
+			sr_adj_touch(adj);
+			sr_send_pkt(sr, pkt, adj->ifc->name);
+			return adj;
+		}
+	}
+	else
+	{
+		/* not resolved yet, or adjacency table full: resolve on every packet */
+		ifc = sr_get_interface(sr, rtentry->interface);
+		memcpy(e_hdr->ether_shost, ifc->addr, ETHER_ADDR_LEN);
+		if (found)
+		{
+			memcpy(e_hdr->ether_dhost, mac, ETHER_ADDR_LEN);
+			sr_send_pkt(sr, pkt, rtentry->interface);
+			return NULL;
+		}
+	}
+
+	arpreq = sr_arpcache_queuereq(&(sr->cache), nexthop, sr_pkt_frame(pkt), pkt->len, ifc->index);
+	sr_arpcache_handle_arpreq(sr, arpreq);
+	return NULL;
+}
+
+/* Brings the adjacency of ip up to mac and sends the packets that waited
+   for it in arpreq, which may be NULL. */
+static void sr_arp_resolved(struct sr_instance *sr, uint32_t ip, unsigned char *mac,
+							struct sr_arpreq *arpreq)
+{
+	struct sr_ethernet_hdr *e_hdr;
+	struct sr_packet *en_pck;
+	struct sr_if *ifc;
+
+	sr_adj_resolve(&(sr->adj), ip, mac);
+	sr_ncache_forget(&(sr->ncache), ip);
+	if (arpreq == NULL)
+		return;
+
+	for (en_pck = arpreq->packets; en_pck != NULL; en_pck = en_pck->next)
+	{
+		e_hdr = (struct sr_ethernet_hdr *) sr_pkt_frame(&(en_pck->pkt));
+		memcpy(e_hdr->ether_dhost, mac, ETHER_ADDR_LEN);
+		ifc = sr_get_interface_by_index(sr, en_pck->ifindex);
+		if (ifc != NULL)
+			sr_send_pkt(sr, &(en_pck->pkt), ifc->name);
+	}
+	sr_arpreq_destroy(&(sr->cache), arpreq);
+}
+
+/*---------------------------------------------------------------------
+* Method: sr_arp_snoop(...)
+* Scope:  Local
+*
+* Learns the sender of an ARP request for us, or refreshes it from a
+* gratuitous ARP (create 0), when snooping is on.  Only a sender that
+* looks like a neighbor on ifc is taken: a well formed Ethernet/IPv4
+* packet, a unicast MAC that matches the Ethernet source, a unicast IP
+* that is not ours, and a route back to it out of ifc that would ARP for
+* it directly.  sr_arpcache_snoop then guards the entries themselves.
+*
+*---------------------------------------------------------------------*/
+static void sr_arp_snoop(struct sr_instance *sr, struct sr_ethernet_hdr *e_hdr,
+						 struct sr_arp_hdr *a_hdr, struct sr_if *ifc, int create)
+{
+	static const unsigned char zero[ETHER_ADDR_LEN];
+	uint32_t sip = a_hdr->ar_sip;
+	struct sr_arpreq *arpreq;
+	struct sr_rt *rtentry;
+	struct sr_if *own;
+
+	if (a_hdr->ar_hrd != htons(arp_hrd_ethernet) || a_hdr->ar_pro != htons(ethertype_ip) ||
+		a_hdr->ar_hln != ETHER_ADDR_LEN || a_hdr->ar_pln != 4)
+		return;
+
+	if ((a_hdr->ar_sha[0] & 1) || memcmp(a_hdr->ar_sha, zero, ETHER_ADDR_LEN) == 0 ||
+		memcmp(a_hdr->ar_sha, e_hdr->ether_shost, ETHER_ADDR_LEN) != 0)
+		return;
+
+	if (sip == 0 || sip == 0xffffffff || IN_MULTICAST(ntohl(sip)))
+		return;
+	for (own = sr->if_list; own != NULL; own = own->next)
+	{
+		if (own->ip == sip)
+			return;
+	}
+
+	rtentry = sr_findLPMentry(sr, sip, 0, NULL);
+	if (rtentry == NULL || strcmp(rtentry->interface, ifc->name) != 0 ||
+		(rtentry->gw.s_addr != 0 && rtentry->gw.s_addr != sip))
+		return;
+
+	if (sr_arpcache_snoop(&(sr->cache), a_hdr->ar_sha, sip, create, &arpreq))
+		sr_arp_resolved(sr, sip, a_hdr->ar_sha, arpreq);
+}
+
+/*---------------------------------------------------------------------
+* Method: sr_handlepacket(struct sr_pkt* pkt,char* interface)
 * Scope:  Global
 *
 * This method is called each time the router receives a packet on the
-* interface.  The packet buffer, the packet length and the receiving
-* interface are passed in as parameters. The packet is complete with
-* ethernet headers.
+* interface.  The packet handle, with the buffer, the offset and length
+* of the frame in it, and the receiving interface are passed in as
+* parameters. The packet is complete with ethernet headers.  A frame
+* sent back out, forwarded or answered in place, goes through
+* sr_send_pkt so its headroom takes the VNS header.
 *
 * Note: Both the packet buffer and the character's memory are handled
 * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
@@ -97,14 +441,15 @@ int ip_black_list(struct sr_ip_hdr *iph)
 *
 *---------------------------------------------------------------------*/
 void sr_handlepacket(struct sr_instance *sr,
-					 uint8_t *packet /* lent */,
-					 unsigned int len,
+					 struct sr_pkt *pkt /* lent */,
 					 char *interface /* lent */)
 {
+	uint8_t *packet = sr_pkt_frame(pkt); /* raw Ethernet frame */
+	unsigned int len = pkt->len;		 /* length of packet */
 
 	/* REQUIRES */
 	assert(sr);
-	assert(packet);
+	assert(pkt);
 	assert(interface);
 
     /*
@@ -127,9 +472,12 @@ void sr_handlepacket(struct sr_instance *sr,
 	struct sr_if *ifc;			  /* router interface */
 	uint32_t ipaddr;			  /* IP address */
 	struct sr_rt *rtentry;		  /* routing table entry */
-	struct sr_arpentry *arpentry; /* ARP table entry in ARP cache */
 	struct sr_arpreq *arpreq;	  /* request entry in ARP cache */
-	struct sr_packet *en_pck;	  /* encapsulated packet in ARP cache */
+	struct sr_dcache_entry *dcentry; /* destination cache entry */
+	struct sr_adj *adj;			  /* next hop adjacency */
+	uint32_t gen;				  /* destination cache generation */
+	int multipath = 0;			  /* route has several paths */
+	int known_bad;				  /* what the negative cache knows */
 
 	/* validation */
 	if (len < sizeof(struct sr_ethernet_hdr))
@@ -203,24 +551,9 @@ void sr_handlepacket(struct sr_instance *sr,
 					ic_hdr0->icmp_type = 0x00;
 					ic_hdr0->icmp_sum = 0;
 					ic_hdr0->icmp_sum = cksum(ic_hdr0, len - sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr));
-					rtentry = sr_findLPMentry(sr->routing_table, i_hdr0->ip_dst);
+					rtentry = sr_findLPMentry(sr, i_hdr0->ip_dst, flow_hash((uint8_t *)i_hdr0), NULL);
 					if (rtentry != NULL)
-					{
-						ifc = sr_get_interface(sr, rtentry->interface);
-						memcpy(e_hdr0->ether_shost, ifc->addr, ETHER_ADDR_LEN);
-						arpentry = sr_arpcache_lookup(&(sr->cache), ipaddr);
-						if (arpentry != NULL)
-						{
-							memcpy(e_hdr0->ether_dhost, arpentry->mac, ETHER_ADDR_LEN);
-							free(arpentry);
-							sr_send_packet(sr, packet, len, rtentry->interface);
-						}
-						else
-						{
-							arpreq = sr_arpcache_queuereq(&(sr->cache), ipaddr, packet, len, rtentry->interface);
-							sr_arpcache_handle_arpreq(sr, arpreq);
-						}
-					}
+						sr_send_nexthop(sr, pkt, rtentry, ipaddr);
 
 					/* done */
 					return;
@@ -271,16 +604,13 @@ void sr_handlepacket(struct sr_instance *sr,
 				ict3_hdr->icmp_sum = 0;
 				ict3_hdr->icmp_sum = cksum(ict3_hdr, sizeof *ict3_hdr);
 
-				arpentry = sr_arpcache_lookup(&(sr->cache), i_hdr->ip_dst);
-				if (arpentry != NULL)
+				if (sr_arpcache_lookup_mac(&(sr->cache), i_hdr->ip_dst, e_hdr->ether_dhost))
 				{
-					memcpy(e_hdr->ether_dhost, arpentry->mac, ETHER_ADDR_LEN);
-					free(arpentry);
 					sr_send_packet(sr, new_pck, new_len, interface);
 				}
 				else
 				{
-					arpreq = sr_arpcache_queuereq(&(sr->cache), i_hdr->ip_dst, new_pck, new_len, interface);
+					arpreq = sr_arpcache_queuereq(&(sr->cache), i_hdr->ip_dst, new_pck, new_len, ifc->index);
 					sr_arpcache_handle_arpreq(sr, arpreq);
 				}
 				/*****************************************************/
@@ -293,8 +623,16 @@ void sr_handlepacket(struct sr_instance *sr,
 		/* destined elsewhere, forward */
 		else
 		{
-			/* refer routing table */
-			rtentry = sr_findLPMentry(sr->routing_table, i_hdr0->ip_dst);
+			/* refer destination cache, then routing table */
+			gen = sr_dcache_gen(sr);
+			dcentry = sr_dcache_lookup(&(sr->dcache), i_hdr0->ip_dst, gen);
+			known_bad = dcentry ? SR_NCACHE_NONE : sr_ncache_lookup(&(sr->ncache), i_hdr0->ip_dst, gen);
+			if (dcentry != NULL)
+				rtentry = dcentry->rt;
+			else if (known_bad == SR_NCACHE_NOROUTE)
+				rtentry = NULL;
+			else
+				rtentry = sr_findLPMentry(sr, i_hdr0->ip_dst, flow_hash((uint8_t *)i_hdr0), &multipath);
 
 			/* routing table hit */
 			if (rtentry != NULL)
@@ -335,16 +673,13 @@ void sr_handlepacket(struct sr_instance *sr,
 					ict11_hdr->icmp_sum = 0;
 					ict11_hdr->icmp_sum = cksum(ict11_hdr, sizeof *ict11_hdr);
 
-					arpentry = sr_arpcache_lookup(&(sr->cache), i_hdr->ip_dst);
-					if (arpentry != NULL)
+					if (sr_arpcache_lookup_mac(&(sr->cache), i_hdr->ip_dst, e_hdr->ether_dhost))
 					{
-						memcpy(e_hdr->ether_dhost, arpentry->mac, ETHER_ADDR_LEN);
-						free(arpentry);
 						sr_send_packet(sr, new_pck, new_len, interface);
 					}
 					else
 					{
-						arpreq = sr_arpcache_queuereq(&(sr->cache), i_hdr->ip_dst, new_pck, new_len, interface);
+						arpreq = sr_arpcache_queuereq(&(sr->cache), i_hdr->ip_dst, new_pck, new_len, ifc->index);
 						sr_arpcache_handle_arpreq(sr, arpreq);
 					}
 					/*****************************************************/
@@ -353,25 +688,33 @@ void sr_handlepacket(struct sr_instance *sr,
 				/* TTL not expired */
 				else {
 					/**************** fill in code here *****************/
-					ifc = sr_get_interface(sr, rtentry->interface);
+					/* next hop did not answer ARP a moment ago */
+					if ((dcentry == NULL || !sr_adj_resolved(dcentry->adj)) &&
+						sr_ncache_lookup(&(sr->ncache), rtentry->gw.s_addr ? rtentry->gw.s_addr : i_hdr0->ip_dst,
+										 gen) == SR_NCACHE_DEAD)
+					{
+						sr_send_unreachable(sr, i_hdr0, 1, interface);
+						return;
+					}
 
 					i_hdr0->ip_ttl--;
 					i_hdr0->ip_sum = 0;
 					i_hdr0->ip_sum = cksum(i_hdr0, sizeof(struct sr_ip_hdr));
 
-					memcpy(e_hdr0->ether_shost, ifc->addr, ETHER_ADDR_LEN);
-					arpentry = sr_arpcache_lookup(&(sr->cache), i_hdr0->ip_dst);
-					if (arpentry != NULL)
+					/* resolved before, the frame header is all there is to do */
+					if (dcentry != NULL && sr_adj_resolved(dcentry->adj))
 					{
-						memcpy(e_hdr0->ether_dhost, arpentry->mac, ETHER_ADDR_LEN);
-						free(arpentry);
-						sr_send_packet(sr, packet, len, rtentry->interface);
-					}
-					else
-					{
-						arpreq = sr_arpcache_queuereq(&(sr->cache), i_hdr0->ip_dst, packet, len, rtentry->interface);
-						sr_arpcache_handle_arpreq(sr, arpreq);
+						memcpy(e_hdr0, &(dcentry->adj->hdr), sizeof(struct sr_ethernet_hdr));
+						sr_adj_touch(dcentry->adj);
+						sr_send_pkt(sr, pkt, dcentry->adj->ifc->name);
+						return;
 					}
+
+					adj = sr_send_nexthop(sr, pkt, rtentry, i_hdr0->ip_dst);
+
+					/* the path of a multipath route depends on the flow */
+					if (adj != NULL && dcentry == NULL && !multipath)
+						sr_dcache_insert(&(sr->dcache), i_hdr0->ip_dst, gen, rtentry, adj);
 					/*****************************************************/
 					return;
 				}
@@ -380,51 +723,9 @@ void sr_handlepacket(struct sr_instance *sr,
 			else
 			{
 				/**************** fill in code here *****************/
-				ifc = sr_get_interface(sr, interface);
-
-				new_len = sizeof *e_hdr + sizeof *i_hdr + sizeof *ict3_hdr;
-				new_pck = malloc(new_len);
-
-				e_hdr = (struct sr_ethernet_hdr *) new_pck;
-				i_hdr = (struct sr_ip_hdr *) (new_pck + sizeof *e_hdr);
-				ict3_hdr = (struct sr_icmp_t3_hdr *) (new_pck + sizeof *e_hdr + sizeof *i_hdr);
-
-				memcpy(e_hdr->ether_shost, ifc->addr, ETHER_ADDR_LEN);
-				e_hdr->ether_type = htons(ethertype_ip);
-
-				i_hdr->ip_hl = sizeof *i_hdr / 4;
-				i_hdr->ip_v = 4;
-				i_hdr->ip_tos = 0;
-				i_hdr->ip_len = htons(sizeof *i_hdr + sizeof *ict3_hdr);
-				i_hdr->ip_id = i_hdr0->ip_id;
-				i_hdr->ip_off = htons(IP_DF);
-				i_hdr->ip_ttl = INIT_TTL;
-				i_hdr->ip_p = ip_protocol_icmp;
-				i_hdr->ip_src = ifc->ip;
-				i_hdr->ip_dst = i_hdr0->ip_src;
-				i_hdr->ip_sum = 0;
-				i_hdr->ip_sum = cksum(i_hdr, sizeof *i_hdr);
-
-				ict3_hdr->icmp_type = 3;
-				ict3_hdr->icmp_code = 0;
-				ict3_hdr->unused = 0;
-				ict3_hdr->next_mtu = 0;
-				memcpy(ict3_hdr->data, i_hdr0, ICMP_DATA_SIZE);
-				ict3_hdr->icmp_sum = 0;
-				ict3_hdr->icmp_sum = cksum(ict3_hdr, sizeof *ict3_hdr);
-
-				arpentry = sr_arpcache_lookup(&(sr->cache), i_hdr->ip_dst);
-				if (arpentry != NULL)
-				{
-					memcpy(e_hdr->ether_dhost, arpentry->mac, ETHER_ADDR_LEN);
-					free(arpentry);
-					sr_send_packet(sr, new_pck, new_len, interface);
-				}
-				else
-				{
-					arpreq = sr_arpcache_queuereq(&(sr->cache), i_hdr->ip_dst, new_pck, new_len, interface);
-					sr_arpcache_handle_arpreq(sr, arpreq);
-				}
+				if (!known_bad)
+					sr_ncache_insert(&(sr->ncache), i_hdr0->ip_dst, SR_NCACHE_NOROUTE, gen);
+				sr_send_unreachable(sr, i_hdr0, 0, interface);
 				/*****************************************************/
 				return;
 			}
@@ -440,8 +741,15 @@ void sr_handlepacket(struct sr_instance *sr,
 
 		a_hdr0 = (struct sr_arp_hdr *)(((uint8_t *)e_hdr0) + sizeof(struct sr_ethernet_hdr)); /* a_hdr0 set */
 
-		/* destined to me */
+		/* learn from requests for us and gratuitous ARPs before the
+		   request is turned into the reply */
 		ifc = sr_get_interface(sr, interface);
+		if (sr->arp_snoop && a_hdr0->ar_tip == ifc->ip && a_hdr0->ar_op == htons(arp_op_request))
+			sr_arp_snoop(sr, e_hdr0, a_hdr0, ifc, 1);
+		else if (sr->arp_snoop && a_hdr0->ar_tip == a_hdr0->ar_sip)
+			sr_arp_snoop(sr, e_hdr0, a_hdr0, ifc, 0);
+
+		/* destined to me */
 		if (a_hdr0->ar_tip == ifc->ip)
 		{
 			/* request code */
@@ -457,7 +765,7 @@ void sr_handlepacket(struct sr_instance *sr,
 
 				memcpy(e_hdr0->ether_shost, ifc->addr, ETHER_ADDR_LEN);
 				memcpy(a_hdr0->ar_sha, ifc->addr, ETHER_ADDR_LEN);
-				sr_send_packet(sr, packet, len, interface);
+				sr_send_pkt(sr, pkt, interface);
 				/*****************************************************/
 				return;
 			}
@@ -467,16 +775,7 @@ void sr_handlepacket(struct sr_instance *sr,
 			{
 				/**************** fill in code here *****************/
 				arpreq = sr_arpcache_insert(&(sr->cache), a_hdr0->ar_sha, a_hdr0->ar_sip);
-				if (arpreq != NULL)
-				{
-					for (en_pck = arpreq->packets; en_pck != NULL; en_pck = en_pck->next)
-					{
-						e_hdr = (struct sr_ethernet_hdr *) en_pck->buf;
-						memcpy(e_hdr->ether_dhost, a_hdr0->ar_sha, ETHER_ADDR_LEN);
-						sr_send_packet(sr, en_pck->buf, en_pck->len, en_pck->iface);
-					}
-					sr_arpreq_destroy(&(sr->cache), arpreq);
-				}
+				sr_arp_resolved(sr, a_hdr0->ar_sip, a_hdr0->ar_sha, arpreq);
 				/*****************************************************/
 			}
 
@@ -496,24 +795,26 @@ void sr_handlepacket(struct sr_instance *sr,
 
 } /* end sr_ForwardPacket */
 
-struct sr_rt *sr_findLPMentry(struct sr_rt *rtable, uint32_t ip_dst)
+/*---------------------------------------------------------------------
+* Method: sr_findLPMentry(struct sr_instance *sr, uint32_t ip_dst,
+*                         uint32_t flow, int *multipath)
+* Scope:  Global
+*
+* Longest prefix match for ip_dst (network byte order) against the
+* compiled routing table; flow picks the path of a multipath route, see
+* sr_fib_lookup_flow.  Returns NULL on a miss.  The route belongs to the
+* current FIB and stays valid until the caller's next quiescent state.
+*
+*---------------------------------------------------------------------*/
+struct sr_rt *sr_findLPMentry(struct sr_instance *sr, uint32_t ip_dst,
+							  uint32_t flow, int *multipath)
 {
-	struct sr_rt *entry, *lpmentry = NULL;
-	uint32_t mask, lpmmask = 0;
+	struct sr_fib *fib = sr_rcu_dereference(sr->fib);
 
-	ip_dst = ntohl(ip_dst);
-
-	/* scan routing table */
-	for (entry = rtable; entry != NULL; entry = entry->next)
-	{
-		mask = ntohl(entry->mask.s_addr);
-		/* longest match so far */
-		if ((ip_dst & mask) == (ntohl(entry->dest.s_addr) & mask) && mask > lpmmask)
-		{
-			lpmentry = entry;
-			lpmmask = mask;
-		}
-	}
+	if (multipath != NULL)
+		*multipath = 0;
+	if (fib == NULL)
+		return NULL;
 
-	return lpmentry;
+	return sr_fib_lookup_flow(fib, ip_dst, flow, multipath);
 }
@@ -15,6 +15,8 @@
 
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
+#include "sr_dcache.h"
+#include "sr_ncache.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -29,10 +31,31 @@
 
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
+#define SR_RX_RING (256 * 1024) /* receive buffer of the server connection */
+#define SR_RX_CMD_MAX 10000     /* longest command the server sends */
 
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_fib;
+struct sr_txbatch;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_rxbuf
+ *
+ * What has been read from the server and not yet handled, commands are
+ * handled where they lie; see sr_read_from_server.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_rxbuf
+{
+    uint8_t* buf;       /* SR_RX_RING bytes, allocated on the first read */
+    unsigned int head;  /* start of the first command not yet handled */
+    unsigned int tail;  /* end of what was read */
+    unsigned long reads;    /* recv calls that returned data */
+    unsigned long commands; /* commands handled */
+};
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -44,14 +67,25 @@ struct sr_rt;
 struct sr_instance
 {
     int  sockfd;   /* socket to server */
+    struct sr_rxbuf rx; /* read from it, not yet handled */
+    struct sr_txbatch* tx; /* frames for it, see sr_send_packet */
     char user[32]; /* user name */
     char host[32]; /* host name */ 
     char template[30]; /* template name if any */
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
-    struct sr_rt* routing_table; /* routing table */
+    struct sr_rt* routing_table; /* routing table as loaded */
+    struct sr_fib* fib; /* compiled routing table with later sr_rt_add/del
+                           changes, RCU protected */
+    pthread_mutex_t rt_lock; /* serialises routing table updates */
+    int rt_compress; /* compress routing tables as they are loaded */
+    int arp_snoop; /* learn neighbors from ARP packets we did not ask for */
+    char* arp_snap; /* ARP cache checkpoint, or NULL */
     struct sr_arpcache cache;   /* ARP cache */
+    struct sr_dcache dcache;    /* resolved destinations, packet thread only */
+    struct sr_adj_table adj;    /* next hops and their Ethernet headers */
+    struct sr_ncache ncache;    /* unroutable destinations, dead next hops */
     pthread_attr_t attr;
     FILE* logfile;
 };
@@ -61,13 +95,16 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_pkt(struct sr_instance* , struct sr_pkt* , const char*);
+int sr_flush_packets(struct sr_instance* );
+void sr_dump_server_stats(struct sr_instance* );
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
-void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
-struct sr_rt *sr_findLPMentry(struct sr_rt *, uint32_t);
+void sr_handlepacket(struct sr_instance* , struct sr_pkt* , char* );
+struct sr_rt *sr_findLPMentry(struct sr_instance *, uint32_t, uint32_t, int *);
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
 void sr_set_ether_ip(struct sr_instance* , uint32_t );
@@ -11,76 +11,560 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 
-
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #define __USE_MISC 1 /* force linux to show inet_aton */
 #include <arpa/inet.h>
 
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_ortc.h"
+#include "sr_rcu.h"
 #include "sr_router.h"
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_rt_free(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_free(struct sr_rt* rtable)
+{
+    struct sr_rt* next;
+
+    for( ; rtable; rtable = next)
+    {
+        next = rtable->next;
+        free(rtable);
+    }
+} /* -- sr_rt_free -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_publish(..)
+ * Scope: Global
+ *
+ * Replace the routing table and its compiled FIB.  Lookups keep running
+ * on the old FIB until the new one is swapped in, and the old versions
+ * are freed once every reader has passed a quiescent state.  Both
+ * arguments are taken over by the instance.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_publish_locked(struct sr_instance* sr, struct sr_rt* rtable,
+                                 struct sr_fib* fib)
+{
+    struct sr_rt* old_rtable;
+    struct sr_fib* old_fib;
+
+    fib->version = sr->fib ? sr->fib->version + 1 : 1;
+    old_fib = sr_rcu_xchg_pointer(sr->fib, fib);
+    old_rtable = sr->routing_table;
+    sr->routing_table = rtable;
+
+    sr_rcu_synchronize();
+    sr_fib_free(old_fib);
+    if(old_rtable != rtable)
+    { sr_rt_free(old_rtable); }
+}
+
+void sr_rt_publish(struct sr_instance* sr, struct sr_rt* rtable,
+                   struct sr_fib* fib)
+{
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(fib);
+
+    pthread_mutex_lock(&(sr->rt_lock));
+    sr_rt_publish_locked(sr, rtable, fib);
+    pthread_mutex_unlock(&(sr->rt_lock));
+} /* -- sr_rt_publish -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_unpublish(..)
+ * Scope: Global
+ *
+ * Withdraw the FIB and the routing table at shutdown.  Lookups find no
+ * FIB from then on; the old one is freed after a grace period, like any
+ * replaced version.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_unpublish(struct sr_instance* sr)
+{
+    struct sr_rt* old_rtable;
+    struct sr_fib* old_fib;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    pthread_mutex_lock(&(sr->rt_lock));
+    old_fib = sr_rcu_xchg_pointer(sr->fib, 0);
+    old_rtable = sr->routing_table;
+    sr->routing_table = 0;
+
+    sr_rcu_synchronize();
+    sr_fib_free(old_fib);
+    sr_rt_free(old_rtable);
+    pthread_mutex_unlock(&(sr->rt_lock));
+} /* -- sr_rt_unpublish -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_add(..), sr_rt_del(..)
+ * Scope: Global
+ *
+ * Add (or replace) and remove a single route.  The published FIB is
+ * updated in place, touching only the /24 range or tbl8 block the prefix
+ * covers, so a route flap does not rebuild the table.  A FIB mapped from
+ * a snapshot is read only and is first replaced by a heap copy.  The
+ * list in sr->routing_table is the table as loaded and is not kept in
+ * step; the FIB is what the router uses.
+ *
+ * Return 0, or -1 with errno set (see sr_fib_add, and ENODEV for an
+ * interface the router does not have).
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_writable(struct sr_instance* sr)
+{
+    struct sr_fib* fib = sr->fib;
+    struct sr_fib* copy;
+
+    if(fib && fib->map_base == 0)
+    { return 0; }
+
+    copy = fib ? sr_fib_dup(fib) : sr_fib_build(0);
+    if(copy == 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    sr_rt_publish_locked(sr, sr->routing_table, copy);
+    return 0;
+}
+
+int sr_rt_add(struct sr_instance* sr, struct in_addr prefix, int len,
+              struct in_addr gw, const char* iface)
+{
+    struct sr_if* if_walker;
+    int ret;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(iface);
+
+    if(len < 0 || len > 32 || iface[0] == 0 ||
+       memchr(iface, 0, sr_IFACE_NAMELEN) == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(sr->if_list)
+    {
+        for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+        {
+            if(strncmp(if_walker->name, iface, sr_IFACE_NAMELEN) == 0)
+            { break; }
+        }
+        if(if_walker == 0)
+        {
+            errno = ENODEV;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&(sr->rt_lock));
+    ret = sr_rt_writable(sr);
+    if(ret == 0)
+    { ret = sr_fib_add(sr->fib, prefix, len, gw, iface); }
+    pthread_mutex_unlock(&(sr->rt_lock));
+
+    return ret;
+} /* -- sr_rt_add -- */
+
+int sr_rt_del(struct sr_instance* sr, struct in_addr prefix, int len)
+{
+    int ret;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    pthread_mutex_lock(&(sr->rt_lock));
+    ret = sr_rt_writable(sr);
+    if(ret == 0)
+    { ret = sr_fib_del(sr->fib, prefix, len); }
+    pthread_mutex_unlock(&(sr->rt_lock));
+
+    return ret;
+} /* -- sr_rt_del -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_ifset_init(..), sr_rt_ifset_has(..)
+ * Scope: Local
+ *
+ * Small hash set of the router's interface names, so checking the
+ * interface of every route is one pass over the routes rather than a
+ * walk of the interface list per route.
  *
  *---------------------------------------------------------------------*/
 
+#define SR_RT_IFSET_SZ 512 /* power of two, more than MAXHWENTRIES */
+
+struct sr_rt_ifset
+{
+    struct sr_if* slot[SR_RT_IFSET_SZ];
+};
+
+static uint32_t sr_rt_ifhash(const char* name)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for(i = 0; i < sr_IFACE_NAMELEN && name[i]; i++)
+    { h = (h ^ (unsigned char)name[i]) * 16777619u; }
+
+    return h;
+}
+
+static void sr_rt_ifset_init(struct sr_rt_ifset* set, struct sr_if* if_list)
+{
+    uint32_t h;
+
+    memset(set, 0, sizeof(struct sr_rt_ifset));
+
+    for( ; if_list; if_list = if_list->next)
+    {
+        h = sr_rt_ifhash(if_list->name);
+        while(set->slot[h & (SR_RT_IFSET_SZ - 1)])
+        { h++; }
+        set->slot[h & (SR_RT_IFSET_SZ - 1)] = if_list;
+    }
+}
+
+static int sr_rt_ifset_has(const struct sr_rt_ifset* set, const char* name)
+{
+    uint32_t h = sr_rt_ifhash(name);
+    struct sr_if* iface;
+
+    while((iface = set->slot[h & (SR_RT_IFSET_SZ - 1)]))
+    {
+        if(strncmp(iface->name, name, sr_IFACE_NAMELEN) == 0)
+        { return 1; }
+        h++;
+    }
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_verify_ifaces(..)
+ * Scope: Global
+ *
+ * Number of routes in the FIB whose interface is not in sr->if_list.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_verify_ifaces(struct sr_instance* sr, const struct sr_fib* fib)
+{
+    struct sr_rt_ifset ifset;
+    const struct sr_fib_nhg* nhg;
+    uint32_t i, k;
+    int ret = 0;
+
+    sr_rt_ifset_init(&ifset, sr->if_list);
+
+    for(i = 0; i < fib->nroutes; i++)
+    {
+        if(!sr_fib_route_live(fib, i))
+        { continue; }
+
+        if(fib->route_nhg[i] == SR_FIB_NHG_NONE)
+        {
+            if(!sr_rt_ifset_has(&ifset, fib->routes[i].interface))
+            { ret++; }
+            continue;
+        }
+
+        nhg = &fib->nhg[fib->route_nhg[i]];
+        for(k = 0; k < nhg->n; k++)
+        {
+            if(!sr_rt_ifset_has(&ifset, nhg->nh[k].interface))
+            { ret++; }
+        }
+    }
+
+    return ret;
+} /* -- sr_rt_verify_ifaces -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse_ip(..), sr_rt_field(..)
+ * Scope: Local
+ *
+ * Loader helpers working directly on the mapped file.  sr_rt_field
+ * returns the next blank separated field of [*pp, end) and its length,
+ * sr_rt_parse_ip converts a strict dotted quad.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_parse_ip(const char* p, int len, struct in_addr* addr)
+{
+    uint32_t ip = 0, octet;
+    int i, digits;
+    const char* end = p + len;
+
+    for(i = 0; i < 4; i++)
+    {
+        if(i > 0)
+        {
+            if(p == end || *p != '.')
+            { return -1; }
+            p++;
+        }
+
+        octet = 0;
+        for(digits = 0; p < end && *p >= '0' && *p <= '9'; digits++, p++)
+        { octet = octet * 10 + (*p - '0'); }
+
+        if(digits == 0 || digits > 3 || octet > 255)
+        { return -1; }
+        ip = (ip << 8) | octet;
+    }
+
+    if(p != end)
+    { return -1; }
+
+    addr->s_addr = htonl(ip);
+    return 0;
+}
+
+static const char* sr_rt_field(const char** pp, const char* end, int* len)
+{
+    const char* p = *pp;
+    const char* field;
+
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    { p++; }
+
+    field = p;
+    while(p < end && *p != ' ' && *p != '\t' && *p != '\r')
+    { p++; }
+
+    *len = p - field;
+    *pp = p;
+    return field;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_compress(..)
+ * Scope: Local
+ *
+ * Replaces *rtable with its compressed form and returns that compiled,
+ * or leaves it alone and returns 0 if compressing or the check that the
+ * result forwards the same way fails.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_fib* sr_rt_compress(struct sr_rt** rtable)
+{
+    struct sr_ortc_stats st;
+    struct sr_rt* compressed;
+    struct sr_fib* fib = 0;
+
+    if((compressed = sr_ortc_compress(*rtable, &st)) == 0)
+    {
+        fprintf(stderr, "Error compressing routing table, out of memory\n");
+        return 0;
+    }
+    if((fib = sr_fib_build(compressed)) == 0 ||
+            sr_ortc_verify(*rtable, fib, &st) != 0)
+    {
+        fprintf(stderr, "Routing table not compressed\n");
+        sr_fib_free(fib);
+        sr_rt_free(compressed);
+        return 0;
+    }
+
+    printf("Compressed routing table from %u to %u routes, saved %lu bytes "
+           "of routes and %ld of FIB\n", st.routes_in, st.routes_out,
+           (unsigned long)(st.bytes_in - st.bytes_out),
+           (long)st.fib_bytes_in - (long)st.fib_bytes_out);
+    sr_rt_free(*rtable);
+    *rtable = compressed;
+    return fib;
+} /* -- sr_rt_compress -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt(..)
+ * Scope: Global
+ *
+ * Load a routing table file of "dest gateway mask interface [weight]"
+ * lines.  Several lines for the same prefix are its equal cost paths,
+ * sharing flows in proportion to their weights (default 1).
+ * The file is mapped and parsed in place in a single pass that also
+ * checks interfaces, when they are already known.  Errors are reported
+ * with their line number, up to SR_RT_MAX_ERRORS of them, and leave the
+ * current table in place: the new table and its FIB are built off to
+ * the side and only published once the whole file has been read.  A
+ * file without routes loads an empty table, as it always did.
+ * With sr->rt_compress set the table is compressed first, see sr_ortc.h.
+ *
+ *---------------------------------------------------------------------*/
+
+#define SR_RT_MAX_ERRORS 10
+#define SR_RT_MAX_WEIGHT 255
+
 int sr_load_rt(struct sr_instance* sr,const char* filename)
 {
-    FILE* fp;
-    char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
+    int fd;
+    struct stat st;
+    const char* base = 0;
+    const char* p;
+    const char* end;
+    const char* eol;
+    const char* field[6];
+    int flen[6];
+    int i, lineno, errors = 0;
+    uint32_t weight;
     struct in_addr dest_addr;
     struct in_addr gw_addr;
     struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    struct sr_rt* rtable = 0;
+    struct sr_rt** tail = &rtable;
+    struct sr_rt* entry;
+    struct sr_fib* fib;
+    struct sr_rt_ifset ifset;
+    const char* err;
 
     /* -- REQUIRES -- */
     assert(filename);
-    if( access(filename,R_OK) != 0)
+    if((fd = open(filename, O_RDONLY)) < 0)
+    {
+        perror("open");
+        return -1;
+    }
+    if(fstat(fd, &st) != 0)
     {
-        perror("access");
+        perror("fstat");
+        close(fd);
         return -1;
     }
+    if(st.st_size > 0)
+    {
+        base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(base == MAP_FAILED)
+        {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+        madvise((void*)base, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
 
-    fp = fopen(filename,"r");
+    if(sr->if_list)
+    { sr_rt_ifset_init(&ifset, sr->if_list); }
 
-    while( fgets(line,BUFSIZ,fp) != 0)
+    end = base + st.st_size;
+    for(p = base, lineno = 1; p < end; p = eol + 1, lineno++)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
-        }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
+        if((eol = memchr(p, '\n', end - p)) == 0)
+        { eol = end; }
+
+        for(i = 0; i < 6; i++)
+        { field[i] = sr_rt_field(&p, eol, &flen[i]); }
+
+        weight = 1;
+        if(flen[4] > 0)
+        {
+            for(i = 0, weight = 0; i < flen[4] && i < 4 &&
+                    field[4][i] >= '0' && field[4][i] <= '9'; i++)
+            { weight = weight * 10 + (field[4][i] - '0'); }
+            if(i != flen[4])
+            { weight = 0; }
         }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
+
+        err = 0;
+        if(flen[0] == 0)
+        { continue; } /* -- blank line -- */
+        else if(flen[3] == 0)
+        { err = "expected: destination gateway mask interface"; }
+        else if(sr_rt_parse_ip(field[0], flen[0], &dest_addr) != 0)
+        { err = "invalid destination address"; }
+        else if(sr_rt_parse_ip(field[1], flen[1], &gw_addr) != 0)
+        { err = "invalid gateway address"; }
+        else if(sr_rt_parse_ip(field[2], flen[2], &mask_addr) != 0)
+        { err = "invalid mask"; }
+        else if(flen[3] >= sr_IFACE_NAMELEN)
+        { err = "interface name too long"; }
+        else if(weight == 0 || weight > SR_RT_MAX_WEIGHT)
+        { err = "invalid weight"; }
+        else if(flen[5] != 0)
+        { err = "trailing garbage"; }
+
+        if(err)
+        {
+            fprintf(stderr, "%s:%d: error loading routing table, %s\n",
+                    filename, lineno, err);
+            if(++errors == SR_RT_MAX_ERRORS)
+            { break; }
+            continue;
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+
+        entry = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+        assert(entry);
+        entry->next = 0;
+        entry->dest = dest_addr;
+        entry->gw   = gw_addr;
+        entry->mask = mask_addr;
+        memset(entry->interface, 0, sr_IFACE_NAMELEN);
+        memcpy(entry->interface, field[3], flen[3]);
+        entry->weight = weight;
+
+        if(sr->if_list && !sr_rt_ifset_has(&ifset, entry->interface))
+        {
+            fprintf(stderr, "%s:%d: error loading routing table, no interface %s\n",
+                    filename, lineno, entry->interface);
+            free(entry);
+            if(++errors == SR_RT_MAX_ERRORS)
+            { break; }
+            continue;
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
-    } /* -- while -- */
+
+        *tail = entry;
+        tail = &entry->next;
+    } /* -- for -- */
+
+    if(base)
+    { munmap((void*)base, st.st_size); }
+
+    if(errors)
+    {
+        fprintf(stderr, "%s: %d error%s, routing table not changed\n",
+                filename, errors, errors > 1 ? "s" : "");
+        sr_rt_free(rtable);
+        return -1;
+    }
+
+    /* -- compile the table for lookups; an empty file is an empty table -- */
+    fib = 0;
+    if(sr->rt_compress && rtable != 0)
+    { fib = sr_rt_compress(&rtable); }
+    if(fib == 0 && (fib = sr_fib_build(rtable)) == 0)
+    {
+        fprintf(stderr,"Error compiling routing table, out of memory\n");
+        sr_rt_free(rtable);
+        return -1;
+    }
+
+    printf("Loading routing table from server, clear local routing table.\n");
+    sr_rt_publish(sr, rtable, fib);
 
     return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
@@ -109,6 +593,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
         strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        sr->routing_table->weight = 1;
 
         return;
     }
@@ -128,9 +613,40 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
     strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    rt_walker->weight = 1;
 
 } /* -- sr_add_entry -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_rt_lookup_linear(..)
+ * Scope: Global
+ *
+ * Longest prefix match by walking the list, as the router did before
+ * the table was compiled.  Kept as a reference for checking and
+ * benchmarking the FIB; the forwarding path uses sr_findLPMentry.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_rt_lookup_linear(struct sr_rt* rtable, uint32_t ip_dst)
+{
+    struct sr_rt* entry, *lpmentry = 0;
+    uint32_t mask, lpmmask = 0;
+
+    ip_dst = ntohl(ip_dst);
+
+    for(entry = rtable; entry != 0; entry = entry->next)
+    {
+        mask = ntohl(entry->mask.s_addr);
+        if((ip_dst & mask) == (ntohl(entry->dest.s_addr) & mask) && mask > lpmmask)
+        {
+            lpmentry = entry;
+            lpmmask = mask;
+        }
+    }
+
+    return lpmentry;
+} /* -- sr_rt_lookup_linear -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -138,25 +654,47 @@ struct in_addr gw, struct in_addr mask,char* if_name)
 
 void sr_print_routing_table(struct sr_instance* sr)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_fib* fib;
+    const struct sr_fib_nhg* nhg;
+    struct sr_rt entry;
+    uint32_t i, k;
 
-    if(sr->routing_table == 0)
+    pthread_mutex_lock(&(sr->rt_lock)); /* -- no updates while walking -- */
+    fib = sr->fib;
+
+    if(fib == 0 || fib->nroutes == 0)
     {
         printf(" *warning* Routing table empty \n");
+        pthread_mutex_unlock(&(sr->rt_lock));
         return;
     }
 
     printf("Destination\tGateway\t\tMask\t\tIface\n");
 
-    rt_walker = sr->routing_table;
-    
-    sr_print_routing_entry(rt_walker);
-    while(rt_walker->next)
+    for(i = 0; i < fib->nroutes; i++)
     {
-        rt_walker = rt_walker->next; 
-        sr_print_routing_entry(rt_walker);
+        if(!sr_fib_route_live(fib, i))
+        { continue; }
+
+        if(fib->route_nhg[i] == SR_FIB_NHG_NONE)
+        {
+            sr_print_routing_entry(&fib->routes[i]);
+            continue;
+        }
+
+        /* -- one line per path of a multipath prefix -- */
+        nhg = &fib->nhg[fib->route_nhg[i]];
+        for(k = 0; k < nhg->n; k++)
+        {
+            entry = nhg->nh[k];
+            entry.dest = fib->routes[i].dest;
+            entry.mask = fib->routes[i].mask;
+            sr_print_routing_entry(&entry);
+        }
     }
 
+    pthread_mutex_unlock(&(sr->rt_lock));
+
 } /* -- sr_print_routing_table -- */
 
 /*---------------------------------------------------------------------
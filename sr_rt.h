@@ -33,13 +33,23 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    uint32_t weight; /* share of flows when a prefix has several routes */
     struct sr_rt* next;
 };
 
 
+struct sr_fib;
+
 int sr_load_rt(struct sr_instance*,const char*);
+void sr_rt_publish(struct sr_instance*, struct sr_rt*, struct sr_fib*);
+void sr_rt_unpublish(struct sr_instance*);
+int sr_rt_add(struct sr_instance*, struct in_addr, int, struct in_addr,
+              const char*);
+int sr_rt_del(struct sr_instance*, struct in_addr, int);
+int sr_rt_verify_ifaces(struct sr_instance*, const struct sr_fib*);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
+struct sr_rt* sr_rt_lookup_linear(struct sr_rt*, uint32_t);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
 
@@ -0,0 +1,101 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.c
+ *
+ * Description:
+ *
+ * Pool of fixed size objects, see sr_slab.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+
+#include "sr_slab.h"
+
+/* Objects are aligned like this header, enough for pointers and 64 bit
+   counters. */
+struct sr_slab_chunk {
+	struct sr_slab_chunk *next;
+	union {
+		void *p;
+		unsigned long long u;
+	} align;
+};
+
+#define SR_SLAB_ALIGN sizeof(union { void *p; unsigned long long u; })
+
+void sr_slab_init(struct sr_slab *s, size_t size, unsigned int per_chunk,
+				  unsigned long limit)
+{
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	s->size = (size + SR_SLAB_ALIGN - 1) / SR_SLAB_ALIGN * SR_SLAB_ALIGN;
+	s->per_chunk = per_chunk ? per_chunk : 1;
+	s->limit = limit;
+	s->in_use = 0;
+	s->chunks_n = 0;
+	s->free = NULL;
+	s->chunks = NULL;
+}
+
+void sr_slab_destroy(struct sr_slab *s)
+{
+	struct sr_slab_chunk *c, *next;
+
+	for (c = s->chunks; c != NULL; c = next)
+	{
+		next = c->next;
+		free(c);
+	}
+
+	s->chunks = NULL;
+	s->free = NULL;
+	s->in_use = 0;
+	s->chunks_n = 0;
+}
+
+static int sr_slab_grow(struct sr_slab *s)
+{
+	struct sr_slab_chunk *c;
+	char *obj;
+	unsigned int i;
+
+	c = malloc(offsetof(struct sr_slab_chunk, align) + (size_t)s->per_chunk * s->size);
+	if (c == NULL)
+		return -1;
+
+	c->next = s->chunks;
+	s->chunks = c;
+	s->chunks_n++;
+
+	/* thread the free list so objects come out in address order */
+	obj = (char *)&c->align + (size_t)(s->per_chunk - 1) * s->size;
+	for (i = 0; i < s->per_chunk; i++, obj -= s->size)
+	{
+		*(void **)obj = s->free;
+		s->free = obj;
+	}
+
+	return 0;
+}
+
+void *sr_slab_alloc(struct sr_slab *s)
+{
+	void *p;
+
+	if (s->limit != 0 && s->in_use >= s->limit)
+		return NULL;
+	if (s->free == NULL && sr_slab_grow(s) != 0)
+		return NULL;
+
+	p = s->free;
+	s->free = *(void **)p;
+	s->in_use++;
+	return p;
+}
+
+void sr_slab_free(struct sr_slab *s, void *p)
+{
+	*(void **)p = s->free;
+	s->free = p;
+	s->in_use--;
+}
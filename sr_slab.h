@@ -0,0 +1,41 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.h
+ *
+ * Description:
+ *
+ * Pool of fixed size objects.  Objects are carved from chunks of
+ * per_chunk at a time and kept on a free list when freed, so a steady
+ * state allocates nothing from malloc.  Memory goes back to the system
+ * only in sr_slab_destroy.  An optional limit bounds the objects in use.
+ *
+ * A pool takes no lock; its owner serialises the calls.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SLAB_H
+#define SR_SLAB_H
+
+#include <stddef.h>
+
+struct sr_slab_chunk;
+
+struct sr_slab {
+    size_t size;                /* of an object, rounded up */
+    unsigned int per_chunk;
+    unsigned long limit;        /* objects in use at most, 0 for no limit */
+    unsigned long in_use;
+    unsigned long chunks_n;
+    void *free;                 /* linked through the first word */
+    struct sr_slab_chunk *chunks;
+};
+
+void  sr_slab_init(struct sr_slab *s, size_t size, unsigned int per_chunk,
+                   unsigned long limit);
+void  sr_slab_destroy(struct sr_slab *s);
+
+/* Returns an uninitialised object, or NULL at the limit or when out of
+   memory. */
+void *sr_slab_alloc(struct sr_slab *s);
+void  sr_slab_free(struct sr_slab *s, void *p);
+
+#endif
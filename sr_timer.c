@@ -0,0 +1,209 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.c
+ *
+ * Description:
+ *
+ * Hierarchical timer wheel, see sr_timer.h.
+ *
+ * w->tick is the next millisecond sr_timer_run handles.  A timer due
+ * d ms after it sits at the level whose slots are the smallest that
+ * still reach d, in the slot of its expiry time at that level.  When
+ * the tick crosses a slot boundary of level n, the next slot of level n
+ * comes due and its timers are placed again, landing at level n - 1 or
+ * below.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "sr_timer.h"
+
+#define SR_TIMER_SPAN(level) ((uint64_t)1 << (SR_TIMER_BITS * (level)))
+
+uint64_t sr_timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void sr_timer_wheel_init(struct sr_timer_wheel *w, void *ctx, uint64_t now)
+{
+	int level, i;
+
+	for (level = 0; level < SR_TIMER_LEVELS; level++)
+		for (i = 0; i < SR_TIMER_SLOTS; i++)
+			w->slot[level][i] = NULL;
+
+	w->tick = now;
+	w->pending = 0;
+	w->fired = 0;
+	w->ctx = ctx;
+}
+
+void sr_timer_init(struct sr_timer *t, sr_timer_fn fn, void *arg)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+static void sr_timer_link(struct sr_timer **head, struct sr_timer *t)
+{
+	t->next = *head;
+	if (t->next != NULL)
+		t->next->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+}
+
+static void sr_timer_unlink(struct sr_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* Links t into the slot its expiry falls in as seen from w->tick */
+static void sr_timer_place(struct sr_timer_wheel *w, struct sr_timer *t)
+{
+	uint64_t e = t->expires < w->tick ? w->tick : t->expires;
+	int level;
+
+	/* beyond the wheel, wait in the furthest slot and look again */
+	if (e - w->tick >= SR_TIMER_SPAN(SR_TIMER_LEVELS))
+		e = w->tick + SR_TIMER_SPAN(SR_TIMER_LEVELS) - 1;
+
+	for (level = 0; level < SR_TIMER_LEVELS - 1; level++)
+		if (e - w->tick < SR_TIMER_SPAN(level + 1))
+			break;
+
+	sr_timer_link(&w->slot[level][(e >> (SR_TIMER_BITS * level)) & SR_TIMER_MASK], t);
+}
+
+void sr_timer_add(struct sr_timer_wheel *w, struct sr_timer *t, uint64_t expires)
+{
+	if (sr_timer_pending(t))
+		sr_timer_unlink(t);
+	else
+		w->pending++;
+
+	t->expires = expires;
+	sr_timer_place(w, t);
+}
+
+int sr_timer_del(struct sr_timer_wheel *w, struct sr_timer *t)
+{
+	if (!sr_timer_pending(t))
+		return 0;
+
+	sr_timer_unlink(t);
+	w->pending--;
+	return 1;
+}
+
+/* Places the timers of a slot of a coarser level again.  Returns the
+   slot index, 0 meaning the next level up comes due as well. */
+static int sr_timer_cascade(struct sr_timer_wheel *w, int level)
+{
+	int idx = (w->tick >> (SR_TIMER_BITS * level)) & SR_TIMER_MASK;
+	struct sr_timer *t, *next;
+
+	t = w->slot[level][idx];
+	w->slot[level][idx] = NULL;
+	for (; t != NULL; t = next)
+	{
+		next = t->next;
+		sr_timer_place(w, t);
+	}
+
+	return idx;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_run(struct sr_timer_wheel *w, uint64_t now)
+ * Scope:  Global
+ *
+ * Steps the wheel a millisecond at a time up to now.  The timers of a
+ * slot move to a local list before any fires, so a callback can cancel
+ * any of them or arm new ones; a timer armed for a time already past
+ * lands in the slot of the next tick.  With nothing pending the wheel
+ * jumps straight to now.
+ *
+ *---------------------------------------------------------------------*/
+void sr_timer_run(struct sr_timer_wheel *w, uint64_t now)
+{
+	struct sr_timer *expired, *t;
+	int level;
+
+	while (w->tick <= now)
+	{
+		if (w->pending == 0)
+		{
+			w->tick = now + 1;
+			break;
+		}
+
+		for (level = 1; level < SR_TIMER_LEVELS; level++)
+			if ((w->tick & (SR_TIMER_SPAN(level) - 1)) != 0 || sr_timer_cascade(w, level) != 0)
+				break;
+
+		expired = w->slot[0][w->tick & SR_TIMER_MASK];
+		w->slot[0][w->tick & SR_TIMER_MASK] = NULL;
+		if (expired != NULL)
+			expired->pprev = &expired;
+		w->tick++;
+
+		while ((t = expired) != NULL)
+		{
+			sr_timer_unlink(t);
+			w->pending--;
+			w->fired++;
+			t->fn(w->ctx, t);
+		}
+	}
+}
+
+uint64_t sr_timer_next(struct sr_timer_wheel *w)
+{
+	uint64_t best = SR_TIMER_NEVER, cur, when;
+	int level, k;
+
+	if (w->pending == 0)
+		return SR_TIMER_NEVER;
+
+	for (k = 0; k < SR_TIMER_SLOTS; k++)
+	{
+		if (w->slot[0][(w->tick + k) & SR_TIMER_MASK] != NULL)
+		{
+			best = w->tick + k;
+			break;
+		}
+	}
+
+	/* a coarser slot comes due when the tick reaches its start, which
+	   may be before the first timer of a finer level; the current slot,
+	   once past its start, holds timers a full turn ahead */
+	for (level = 1; level < SR_TIMER_LEVELS; level++)
+	{
+		cur = w->tick >> (SR_TIMER_BITS * level);
+		for (k = 0; k < SR_TIMER_SLOTS; k++)
+		{
+			if (w->slot[level][(cur + k) & SR_TIMER_MASK] == NULL)
+				continue;
+			when = (cur + k) << (SR_TIMER_BITS * level);
+			if (when < w->tick)
+				when += SR_TIMER_SPAN(level + 1);
+			if (when < best)
+				best = when;
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,76 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.h
+ *
+ * Description:
+ *
+ * Hierarchical timer wheel with millisecond ticks.  SR_TIMER_LEVELS
+ * wheels of SR_TIMER_SLOTS slots each cover 1 ms, 64 ms, 4 s and 4.4 min
+ * per slot; a timer sits in the slot of the coarsest level its delay
+ * needs and moves down a level each time the finer wheel comes round to
+ * it.  Adding and cancelling a timer unlink and link a list node, O(1)
+ * whatever the number of timers.  Timers further out than the wheel
+ * reaches wait in its last slot and are placed again from there.
+ *
+ * A timer is embedded in whatever it times and handed to the wheel; the
+ * wheel allocates nothing.  The wheel takes no lock of its own: its
+ * owner serialises every call, and callbacks run from sr_timer_run with
+ * that serialisation held, so they may add and cancel timers, free the
+ * memory of the timer that fired, but must not block.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TIMER_H
+#define SR_TIMER_H
+
+#include <stdint.h>
+
+#define SR_TIMER_LEVELS  4
+#define SR_TIMER_BITS    6
+#define SR_TIMER_SLOTS   (1 << SR_TIMER_BITS)
+#define SR_TIMER_MASK    (SR_TIMER_SLOTS - 1)
+#define SR_TIMER_NEVER   UINT64_MAX
+
+struct sr_timer;
+
+typedef void (*sr_timer_fn)(void *ctx, struct sr_timer *t);
+
+struct sr_timer {
+    struct sr_timer *next;
+    struct sr_timer **pprev;    /* NULL when not pending */
+    uint64_t expires;           /* ms, on the sr_timer_now clock */
+    sr_timer_fn fn;
+    void *arg;                  /* for fn */
+};
+
+struct sr_timer_wheel {
+    uint64_t tick;              /* next ms to run */
+    unsigned long pending;
+    unsigned long fired;
+    void *ctx;                  /* first argument of every callback */
+    struct sr_timer *slot[SR_TIMER_LEVELS][SR_TIMER_SLOTS];
+};
+
+/* Milliseconds on the monotonic clock */
+uint64_t sr_timer_now(void);
+
+void sr_timer_wheel_init(struct sr_timer_wheel *w, void *ctx, uint64_t now);
+
+void sr_timer_init(struct sr_timer *t, sr_timer_fn fn, void *arg);
+
+#define sr_timer_pending(t) ((t)->pprev != NULL)
+
+/* Arms t to fire at expires, moving it if already pending.  A time
+   already past fires on the next sr_timer_run. */
+void sr_timer_add(struct sr_timer_wheel *w, struct sr_timer *t, uint64_t expires);
+
+/* Disarms t.  Returns 1 if it was pending. */
+int  sr_timer_del(struct sr_timer_wheel *w, struct sr_timer *t);
+
+/* Fires every timer due by now, in order of expiry to the ms. */
+void sr_timer_run(struct sr_timer_wheel *w, uint64_t now);
+
+/* A time no later than the first pending timer fires, SR_TIMER_NEVER if
+   none is pending.  Either that time or when a coarser slot is due. */
+uint64_t sr_timer_next(struct sr_timer_wheel *w);
+
+#endif
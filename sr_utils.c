@@ -30,6 +30,18 @@ uint8_t ip_protocol(uint8_t *buf) {
   return iphdr->ip_p;
 }
 
+/* Hash of the addresses and protocol of the IP packet in buf, for
+   picking one of several paths, see sr_utils.h. */
+uint32_t flow_hash(uint8_t *buf) {
+  sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(buf);
+  uint32_t h;
+
+  h = iphdr->ip_src * 0x9e3779b1u;
+  h = (h ^ iphdr->ip_dst) * 0x85ebca6bu;
+  h = (h ^ (uint32_t)iphdr->ip_p << 24) * 0xc2b2ae35u;
+  return h ^ (h >> 16);
+}
+
 
 /* Prints out formatted Ethernet address, e.g. 00:11:22:33:44:55 */
 void print_addr_eth(uint8_t *addr) {
@@ -33,6 +33,15 @@ uint16_t cksum(const void *_data, int len);
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
 
+/* Flow hash of an IP packet for multipath routes.  Only the addresses
+   and the protocol go in: every packet of a flow, fragments included,
+   carries them, so a flow stays on one path.  Ports would spread the
+   flows between two hosts over more paths, but only the first fragment
+   has them, and a flow mixing fragments and whole packets would split.
+   The trade-off is that all traffic between a pair of hosts shares one
+   path. */
+uint32_t flow_hash(uint8_t *buf);
+
 void print_addr_eth(uint8_t *addr);
 void print_addr_ip(struct in_addr address);
 void print_addr_ip_int(uint32_t ip);
@@ -32,18 +32,50 @@
 #include <errno.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_rcu.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
 
+#define SR_TX_BATCH 64 /* frames sent in one writev at most */
+
+/* the VNS header must fit the headroom sr_pkt.h reserves */
+typedef char sr_headroom_fits[SR_PKT_HEADROOM >= sizeof(c_packet_header) ? 1 : -1];
+
+/*-----------------------------------------------------------------------------
+ * struct sr_txbatch
+ *
+ * Frames the reader has sent while handling what one read brought in,
+ * waiting to go out in a single writev.  A frame forwarded from the
+ * receive buffer has its VNS header written in its headroom and takes
+ * one iovec, merged with the one before when the two are adjacent, as
+ * packets forwarded one after the other are.  A frame without headroom
+ * takes two, its VNS header built here and the frame.
+ *
+ *---------------------------------------------------------------------------*/
+
+struct sr_txbatch
+{
+    pthread_mutex_t lock;   /* serialises writes to the socket */
+    pthread_t reader;       /* the thread whose frames are batched */
+    int n;                  /* frames batched */
+    int niov;               /* iovecs they take */
+    c_packet_header hdr[SR_TX_BATCH];
+    struct iovec iov[2 * SR_TX_BATCH];
+    unsigned long frames;   /* sent */
+    unsigned long writes;   /* writev calls that sent them */
+};
+
 static void sr_log_packet(struct sr_instance* , uint8_t* , int );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
@@ -89,6 +121,19 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
     /* purify UMR be gone ! */
     memset((void*)&command,0,sizeof(c_open));
 
+    /* -- transmit side, before any other thread can send; frames of the
+       thread connecting, the reader, are batched -- */
+    if (sr->tx == 0)
+    {
+        if ((sr->tx = (struct sr_txbatch*)calloc(1, sizeof(struct sr_txbatch))) == 0)
+        {
+            fprintf(stderr,"Error: out of memory (sr_connect_to_server)\n");
+            return -1;
+        }
+        pthread_mutex_init(&(sr->tx->lock), 0);
+        sr->tx->reader = pthread_self();
+    }
+
     /* zero out server address struct */
     memset(&(sr->sr_addr),0,sizeof(struct sockaddr_in));
 
@@ -331,80 +376,133 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
     return sr_read_from_server_expect(sr, 0);
 }
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_command(..)
+ * Scope: Local
+ *
+ * Length of the command at the head of the receive buffer, 0 if it has
+ * not all been read yet, -1 if its length is impossible.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_rx_command(struct sr_rxbuf* rx)
+{
+    uint32_t len;
+
+    if (rx->tail - rx->head < sizeof(len))
+    { return 0; }
+
+    memcpy(&len, rx->buf + rx->head, sizeof(len));
+    len = ntohl(len);
+    if (len > SR_RX_CMD_MAX || len < sizeof(c_base))
+    { return -1; }
+
+    return rx->tail - rx->head >= len ? (int)len : 0;
+} /* -- sr_rx_command -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_fill(..)
+ * Scope: Local
+ *
+ * Reads as much as the socket has into the receive buffer, in one recv.
+ * A partial command is moved to the front first if the buffer could not
+ * take the rest of it, which is the only copy a command ever sees.
+ * Returns what recv returned.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_rx_fill(struct sr_instance* sr)
+{
+    struct sr_rxbuf* rx = &(sr->rx);
+    int ret;
+
+    if (rx->buf == 0 && (rx->buf = malloc(SR_RX_RING)) == 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (rx->head == rx->tail)
+    { rx->head = rx->tail = 0; }
+    else if (SR_RX_RING - rx->head < SR_RX_CMD_MAX)
+    {
+        memmove(rx->buf, rx->buf + rx->head, rx->tail - rx->head);
+        rx->tail -= rx->head;
+        rx->head = 0;
+    }
+
+    /* -- between packets we hold no FIB references, and recv may block -- */
+    sr_rcu_thread_offline();
+    do
+    { /* -- just in case SIGALRM breaks recv -- */
+        ret = recv(sr->sockfd, rx->buf + rx->tail, SR_RX_RING - rx->tail, 0);
+    } while (ret == -1 && errno == EINTR);
+    sr_rcu_thread_online();
+
+    if (ret > 0)
+    {
+        rx->tail += ret;
+        rx->reads++;
+    }
+
+    return ret;
+} /* -- sr_rx_fill -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_from_server_expect(..)
+ * Scope: global
+ *
+ * Handles the next command from the server.  Commands are read into
+ * sr->rx as many at a time as the socket has and handled where they lie,
+ * so the socket is only read again once every complete command in the
+ * buffer is handled, and the router gets packets without a copy.  A
+ * packet is lent to sr_handlepacket for the duration of the call, as
+ * before, with the VNS header it came in as headroom.
+ *
+ *---------------------------------------------------------------------------*/
+
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
 {
     int command, len;
     unsigned char *buf = 0;
     c_packet_ethernet_header* sr_pkt = 0;
-    int ret = 0, bytes_read = 0;
+    struct sr_pkt pkt;
+    char iface[sizeof(sr_pkt->mInterfaceName) + 1];
+    int ret = 0;
 
     /* REQUIRES */
     assert(sr);
 
     /*---------------------------------------------------------------------------
-      Read a command from the server
+      Take a command from the receive buffer, reading when none is complete
       -------------------------------------------------------------------------*/
 
-    bytes_read = 0;
-
-    /* attempt to read the size of the incoming packet */
-    while( bytes_read < 4)
+    while ( (len = sr_rx_command(&(sr->rx))) == 0 )
     {
-        do
-        { /* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-
-                perror("recv(..):sr_client.c::sr_read_from_server");
-                return -1;
-            }
-            bytes_read += ret;
-        } while ( errno == EINTR); /* be mindful of signals */
+        /* -- the end of a burst, and frames batched from the buffer must
+           go before the read may move it -- */
+        sr_flush_packets(sr);
 
+        if ( (ret = sr_rx_fill(sr)) <= 0 )
+        {
+            if ( ret == 0 )
+            { fprintf(stderr,"Error: server closed the connection\n"); }
+            else
+            { perror("recv(..):sr_client.c::sr_read_from_server"); }
+            return -1;
+        }
     }
 
-    len = ntohl(len);
-
-    if ( len > 10000 || len < 0 )
+    if ( len < 0 )
     {
-        fprintf(stderr,"Error: command length to large %d\n",len);
+        fprintf(stderr,"Error: bad command length\n");
         close(sr->sockfd);
         return -1;
     }
 
-    if((buf = malloc(len)) == 0)
-    {
-        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
-        return -1;
-    }
-
-    /* set first field of command since we've already read it */
-    *((int *)buf) = htonl(len);
-
-    bytes_read = 0;
-
-    /* read the rest of the command */
-    while ( bytes_read < len - 4)
-    {
-        do
-        {/* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
-                    -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-                fprintf(stderr,"Error: failed reading command body %d\n",ret);
-                close(sr->sockfd);
-                return -1;
-            }
-            bytes_read += ret;
-        } while (errno == EINTR); /* be mindful of signals */
-    }
+    buf = sr->rx.buf + sr->rx.head;
+    sr->rx.head += len;
+    sr->rx.commands++;
 
     /* My entry for most unreadable line of code - guido */
     /* ... you win - mc                                  */
@@ -438,12 +536,17 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             sr_log_packet(sr, buf + sizeof(c_packet_header),
                     ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
 
+            /* -- the VNS header is headroom now, sending the frame writes
+               over it, interface name included -- */
+            pkt.buf = buf;
+            pkt.off = sizeof(c_packet_header);
+            pkt.len = len - sizeof(c_packet_ethernet_header) +
+                      sizeof(struct sr_ethernet_hdr);
+            memcpy(iface, sr_pkt->mInterfaceName, sizeof(sr_pkt->mInterfaceName));
+            iface[sizeof(sr_pkt->mInterfaceName)] = 0;
+
             /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+            sr_handlepacket(sr, &pkt, iface);
 
             break;
 
@@ -453,9 +556,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"VNS server closed session.\n");
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
-
-            if(buf)
-            { free(buf); }
             return 0;
             break;
 
@@ -501,8 +601,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
     return ret;
 }/* -- sr_read_from_server -- */
 
@@ -551,12 +649,85 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
 
 } /* -- sr_ether_addrs_match_interface -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_tx_write(..)
+ * Scope: Local
+ *
+ * Writes cnt iovecs carrying frames packets to the server, in as few
+ * writev calls as the socket allows.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_tx_write(struct sr_instance* sr, struct iovec* iov, int cnt,
+                       int frames)
+{
+    ssize_t ret;
+    int err = 0;
+
+    pthread_mutex_lock(&(sr->tx->lock));
+    while (cnt > 0)
+    {
+        if ((ret = writev(sr->sockfd, iov, cnt)) < 0)
+        {
+            if (errno == EINTR)
+            { continue; }
+            err = -1;
+            break;
+        }
+        sr->tx->writes++;
+
+        /* -- step over what went out, a short write resumes mid iovec -- */
+        while (cnt > 0 && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    if (!err)
+    { sr->tx->frames += frames; }
+    pthread_mutex_unlock(&(sr->tx->lock));
+
+    if (err)
+    { fprintf(stderr, "Error writing packet\n"); }
+    return err;
+} /* -- sr_tx_write -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_flush_packets(..)
+ * Scope: Global
+ *
+ * Sends the frames batched by sr_send_packet.  Called by the reader once
+ * it has handled everything a read brought in, before reading again.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_flush_packets(struct sr_instance* sr)
+{
+    struct sr_txbatch* tx = sr->tx;
+    int ret;
+
+    if (tx == 0 || tx->n == 0)
+    { return 0; }
+
+    ret = sr_tx_write(sr, tx->iov, tx->niov, tx->n);
+    tx->n = 0;
+    tx->niov = 0;
+    return ret;
+} /* -- sr_flush_packets -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_send_packet(..)
  * Scope: Global
  *
  * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * to be injected onto the wire.  The frame has no headroom the caller
+ * knows of, see sr_send_pkt.
  *
  *---------------------------------------------------------------------------*/
 
@@ -565,13 +736,48 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
-    c_packet_header *sr_pkt;
-    unsigned int total_len =  len + (sizeof(c_packet_header));
+    struct sr_pkt pkt;
+
+    pkt.buf = buf;
+    pkt.off = 0;
+    pkt.len = len;
+    return sr_send_pkt(sr, &pkt, iface);
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_pkt(..)
+ * Scope: Global
+ *
+ * Sends the frame of pkt to the server to be injected onto the wire.
+ *
+ * With SR_PKT_HEADROOM bytes of headroom the VNS header is written
+ * there, over whatever they held, and header and frame go out as one
+ * piece; without, the header is built apart and goes out with the frame
+ * in one writev.  Either way the frame is not copied.  A frame the
+ * reader sends from the receive buffer, as when forwarding, stays there
+ * until the reader reads again, so it joins a batch flushed before that
+ * read.  Any other frame may be gone once we return: the reader sends
+ * it at once along with what it batched before, other threads send it
+ * on its own.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_pkt(struct sr_instance* sr /* borrowed */,
+                struct sr_pkt* pkt /* borrowed */,
+                const char* iface /* borrowed */)
+{
+    struct sr_txbatch* tx = sr->tx;
+    uint8_t* buf = sr_pkt_frame(pkt);
+    unsigned int len = pkt->len;
+    c_packet_header hdr, *vhdr;
+    struct iovec iov[2], *v;
+    int batched, in_rx;
 
     /* REQUIRES */
     assert(sr);
-    assert(buf);
+    assert(pkt);
     assert(iface);
+    assert(tx);
 
     /* don't waste my time ... */
     if ( len < sizeof(struct sr_ethernet_hdr) ){
@@ -579,35 +785,74 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
-
     /* -- log packet -- */
     sr_log_packet(sr,buf,len);
 
     if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
         fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
-        fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
-        return -1;
+    batched = pthread_equal(pthread_self(), tx->reader);
+    if ( batched && tx->n == SR_TX_BATCH )
+    { sr_flush_packets(sr); }
+
+    /* Create packet */
+    if ( pkt->off >= SR_PKT_HEADROOM )
+    { vhdr = (c_packet_header*)(buf - sizeof(c_packet_header)); }
+    else
+    { vhdr = batched ? &(tx->hdr[tx->n]) : &hdr; }
+    vhdr->mLen  = htonl(len + sizeof(c_packet_header));
+    vhdr->mType = htonl(VNSPACKET);
+    strncpy(vhdr->mInterfaceName,iface,16);
+
+    v = batched ? &(tx->iov[tx->niov]) : iov;
+    if ( (uint8_t*)vhdr + sizeof(c_packet_header) == buf )
+    {
+        /* -- in place, and right after the frame batched before if that
+           was read just ahead of it -- */
+        if ( batched && tx->niov > 0 &&
+             (uint8_t*)v[-1].iov_base + v[-1].iov_len == (uint8_t*)vhdr )
+        { v[-1].iov_len += sizeof(c_packet_header) + len; }
+        else
+        {
+            v[0].iov_base = vhdr;
+            v[0].iov_len = sizeof(c_packet_header) + len;
+            v++;
+        }
+    }
+    else
+    {
+        v[0].iov_base = vhdr;
+        v[0].iov_len = sizeof(c_packet_header);
+        v[1].iov_base = buf;
+        v[1].iov_len = len;
+        v += 2;
     }
 
-    free(sr_pkt);
+    if ( !batched )
+    { return sr_tx_write(sr, iov, v - iov, 1); }
 
-    return 0;
-} /* -- sr_send_packet -- */
+    tx->niov = v - tx->iov;
+    tx->n++;
+    in_rx = sr->rx.buf != 0 && buf >= sr->rx.buf &&
+            buf + len <= sr->rx.buf + SR_RX_RING;
+    return in_rx ? 0 : sr_flush_packets(sr);
+} /* -- sr_send_pkt -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_dump_server_stats(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_dump_server_stats(struct sr_instance* sr)
+{
+    fprintf(stderr, "server connection: %lu commands in %lu reads, "
+            "%lu packets in %lu writes\n",
+            sr->rx.commands, sr->rx.reads,
+            sr->tx ? sr->tx->frames : 0, sr->tx ? sr->tx->writes : 0);
+} /* -- sr_dump_server_stats -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
@@ -662,7 +907,13 @@ int  sr_arp_req_not_for_us(struct sr_instance* sr,
     if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
             (a_hdr->ar_op      == htons(arp_op_request))   &&
             (a_hdr->ar_tip     != iface->ip ) )
-    { return 1; }
+    {
+        /* a gratuitous ARP announces the sender, let the router see it
+           if it learns from such */
+        if ( sr->arp_snoop && a_hdr->ar_tip == a_hdr->ar_sip )
+        { return 0; }
+        return 1;
+    }
 
     return 0;
 } /* -- sr_arp_req_not_for_us -- */